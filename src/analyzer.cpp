@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <climits>
+#include "lisp.h"
+
+namespace {
+
+using Builtins = Tokenizer::Builtins;
+
+struct Arity {
+    uint32_t min;
+    uint32_t max;
+};
+
+constexpr uint32_t kAny = UINT32_MAX;
+
+/* Special forms with a shape of their own are checked separately */
+Arity ArityOf(Builtins builtin) {
+    switch (builtin) {
+        case Builtins::QUOTE:
+        case Builtins::IS_NULL:
+        case Builtins::IS_PAIR:
+        case Builtins::IS_NUMBER:
+        case Builtins::IS_BOOLEAN:
+        case Builtins::IS_SYMBOL:
+        case Builtins::IS_LIST:
+        case Builtins::NOT:
+        case Builtins::ABS:
+        case Builtins::CAR:
+        case Builtins::CDR:
+        case Builtins::SPAWN:
+        case Builtins::CHANNEL:
+        case Builtins::RECV:
+            return {1, 1};
+        case Builtins::ARE_EQ:
+        case Builtins::ARE_EQUAL:
+        case Builtins::CONS:
+        case Builtins::SET_CAR:
+        case Builtins::SET_CDR:
+        case Builtins::LIST_REF:
+        case Builtins::LIST_TAIL:
+        case Builtins::PMAP:
+        case Builtins::PFOR_EACH:
+        case Builtins::SEND:
+        case Builtins::SET:
+            return {2, 2};
+        case Builtins::PREDUCE:
+            return {3, 3};
+        case Builtins::IF:
+            return {2, 3};
+        case Builtins::SUB:
+        case Builtins::DIV:
+        case Builtins::MIN:
+        case Builtins::MAX:
+            return {1, kAny};
+        case Builtins::INT_EQ:
+        case Builtins::EQ:
+        case Builtins::GT:
+        case Builtins::LT:
+        case Builtins::GEQ:
+        case Builtins::LEQ:
+        case Builtins::LAMBDA:
+        case Builtins::DEFINE:
+            return {2, kAny};
+        default:
+            return {0, kAny};
+    }
+}
+
+std::string Arguments(uint32_t count) {
+    return std::to_string(count) + (count == 1 ? " argument" : " arguments");
+}
+
+}
+
+void AST::Analyze() {
+    std::string errors = errors_;
+    for (auto node = root_; node; node = node->next) {
+        AnalyzeNode(node, nullptr, errors);
+    }
+
+    if (!errors.empty()) {
+        throw SyntaxError(errors);
+    }
+}
+
+void AST::AnalyzeNode(Pair* node, const Pair* list, std::string& errors) const {
+    switch (node->type) {
+        case TokenType::OPEN_PARENT:
+            AnalyzeList(node, errors);
+            break;
+        case TokenType::PAIR:
+            Report(list, "Unexpected .", errors);
+            break;
+        case TokenType::BUILTIN:
+            /* Builtins are not procedures, they only act heading a list */
+            Report(node, "Builtin " + Symbols().Name(node->value.GetSymbol()) +
+                                 " used as a value, wrap it in a lambda",
+                   errors);
+            break;
+        default:
+            break;
+    }
+}
+
+void AST::AnalyzeList(Pair* list, std::string& errors) const {
+    auto head = list->child;
+    if (!head) {
+        Report(list, "Empty combination", errors);
+        return;
+    }
+
+    uint32_t argc = 0;
+    for (auto arg = head->next; arg; arg = arg->next) {
+        ++argc;
+    }
+
+    if (head->type != TokenType::BUILTIN) {
+        AnalyzeBody(head, list, errors);
+        return;
+    }
+
+    head->argc = argc;
+    auto builtin = ToBuiltin(head->value.GetSymbol());
+    auto arity = ArityOf(builtin);
+    if (argc < arity.min || argc > arity.max) {
+        auto& name = Symbols().Name(head->value.GetSymbol());
+        auto expected = arity.min == arity.max ? Arguments(arity.min)
+                        : arity.max == kAny    ? "at least " + Arguments(arity.min)
+                                               : std::to_string(arity.min) + " to " +
+                                                 Arguments(arity.max);
+        Report(list, name + " expects " + expected + " but got " + std::to_string(argc), errors);
+        return;
+    }
+
+    auto target = head->next;
+    switch (builtin) {
+        case Builtins::QUOTE:
+            /* Data, not code */
+            return;
+
+        case Builtins::LAMBDA:
+            if (target->type != TokenType::OPEN_PARENT) {
+                Report(list, "Malformed lambda", errors);
+                return;
+            }
+            AnalyzeParams(target->child, list, errors);
+            AnalyzeBody(target->next, list, errors);
+            return;
+
+        case Builtins::DEFINE:
+            /* (define (name params...) body...) */
+            if (target->type == TokenType::OPEN_PARENT) {
+                auto name = target->child;
+                if (!name || name->type != TokenType::NAME) {
+                    Report(list, "Malformed define", errors);
+                    return;
+                }
+                AnalyzeParams(name->next, list, errors);
+                AnalyzeBody(target->next, list, errors);
+                return;
+            }
+            if (argc != 2 || target->type != TokenType::NAME) {
+                Report(list, "Malformed define", errors);
+                return;
+            }
+            AnalyzeBody(target->next, list, errors);
+            return;
+
+        case Builtins::SET:
+            if (target->type != TokenType::NAME) {
+                Report(list, "Malformed set!", errors);
+                return;
+            }
+            AnalyzeBody(target->next, list, errors);
+            return;
+
+        default:
+            AnalyzeBody(target, list, errors);
+            return;
+    }
+}
+
+void AST::AnalyzeBody(Pair* body, const Pair* list, std::string& errors) const {
+    for (auto node = body; node; node = node->next) {
+        AnalyzeNode(node, list, errors);
+    }
+}
+
+void AST::AnalyzeParams(const Pair* params, const Pair* list, std::string& errors) const {
+    for (auto param = params; param; param = param->next) {
+        if (param->type != TokenType::NAME) {
+            Report(list, "Parameters must be names", errors);
+            return;
+        }
+
+        for (auto other = params; other != param; other = other->next) {
+            if (other->value == param->value) {
+                Report(list, "Duplicate parameter " + Symbols().Name(param->value.GetSymbol()),
+                       errors);
+                return;
+            }
+        }
+    }
+}
+
+void AST::Report(const Pair* list, const std::string& message, std::string& errors) const {
+    errors += "ERROR: " + message + " at " + DescribeOffset(list->offset) + "\n";
+}
@@ -1,21 +1,39 @@
 #pragma once
 
-#include <iostream>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <typeinfo>
+#include <utility>
 
 struct PlaceHolder {
     virtual const std::type_info& TypeInfo() const = 0;
-    virtual std::unique_ptr<PlaceHolder> Clone() const = 0;
+    /* Copies the holder into buffer when it fits there, onto the heap otherwise */
+    virtual PlaceHolder* CloneInto(void* buffer) const = 0;
     virtual ~PlaceHolder() {};
 };
 
+/* Room for the vtable pointer and a payload of up to two pointers */
+constexpr size_t kAnyBufferSize = 3 * sizeof(void*);
+
 template <class T>
 struct Holder: public PlaceHolder {
-    Holder(const T& value): held(value) {}
-
-    std::unique_ptr<PlaceHolder> Clone() const override {
-        return std::make_unique<Holder<T>>(held);
+    template <class U>
+    explicit Holder(U&& value): held(std::forward<U>(value)) {}
+
+    /* Inline holders are relocated with a plain copy, so only trivially
+     * copyable payloads qualify */
+    static constexpr bool kInline = std::is_trivially_copyable<T>::value &&
+                                    sizeof(T) <= 2 * sizeof(void*) &&
+                                    alignof(T) <= alignof(std::max_align_t);
+
+    PlaceHolder* CloneInto(void* buffer) const override {
+        if constexpr (kInline) {
+            return new (buffer) Holder<T>(held);
+        }
+        return new Holder<T>(held);
     }
 
     const std::type_info& TypeInfo() const override {
@@ -27,54 +45,121 @@ struct Holder: public PlaceHolder {
 
 class Any {
 public:
-    Any() {}
+    Any(): content_(nullptr) {}
 
-    template<class T>
-    Any(const T& value): content_{std::make_unique<Holder<T>>(value)} {}
+    template<class T, class = typename std::enable_if<
+            !std::is_same<typename std::decay<T>::type, Any>::value>::type>
+    Any(T&& value): content_(nullptr) {
+        Emplace<typename std::decay<T>::type>(std::forward<T>(value));
+    }
 
-    template<class T>
-    Any& operator=(const T& value) {
-        content_ = std::make_unique<Holder<T>>(value);
+    template<class T, class = typename std::enable_if<
+            !std::is_same<typename std::decay<T>::type, Any>::value>::type>
+    Any& operator=(T&& value) {
+        Clear();
+        Emplace<typename std::decay<T>::type>(std::forward<T>(value));
         return *this;
     }
 
-    Any(const Any& rhs):
-            content_{!rhs.Empty() ?
-                     rhs.content_->Clone() :
-                     std::unique_ptr<PlaceHolder>(nullptr)}
-    {}
+    Any(const Any& rhs): content_(nullptr) {
+        if (!rhs.Empty()) {
+            content_ = rhs.content_->CloneInto(buffer_);
+        }
+    }
 
-    Any& operator=(Any rhs) {
-        Swap(rhs);
+    Any(Any&& rhs) noexcept: content_(nullptr) {
+        Steal(rhs);
+    }
+
+    Any& operator=(const Any& rhs) {
+        if (this != &rhs) {
+            Any copy(rhs);
+            Clear();
+            Steal(copy);
+        }
+        return *this;
+    }
+
+    Any& operator=(Any&& rhs) noexcept {
+        if (this != &rhs) {
+            Clear();
+            Steal(rhs);
+        }
         return *this;
     }
 
     ~Any() {
-        content_.reset();
+        Clear();
     }
 
     void Swap(Any& rhs) {
-        content_.swap(rhs.content_);
+        Any tmp(std::move(rhs));
+        rhs = std::move(*this);
+        *this = std::move(tmp);
     }
-    
+
+    /* Throws on a type mismatch instead of reinterpreting the payload */
     template<class T>
     T& TakeValue() const {
-        if (typeid(T) != content_->TypeInfo()) {
-            std::cout << "Wrong any cast!\n";
+        auto value = TryTakeValue<T>();
+        if (!value) {
+            throw std::runtime_error("ERROR: Wrong any cast\n");
+        }
+
+        return *value;
+    }
+
+    /* nullptr when empty or holding another type, never prints */
+    template<class T>
+    T* TryTakeValue() const {
+        if (Empty() || typeid(T) != content_->TypeInfo()) {
+            return nullptr;
         }
 
-        auto item = static_cast<Holder<T>*>(content_.get());
-        return item->held;
+        return &static_cast<Holder<T>*>(content_)->held;
     }
 
     bool Empty() const {
         return !content_;
     }
 
+    /* Whether the payload lives in the inline buffer */
+    bool IsInline() const {
+        return content_ == reinterpret_cast<const PlaceHolder*>(buffer_);
+    }
+
     void Clear() {
-        Any().Swap(*this);
+        if (IsInline()) {
+            content_->~PlaceHolder();
+        } else {
+            delete content_;
+        }
+        content_ = nullptr;
     }
 
 private:
-    std::unique_ptr<PlaceHolder> content_;
+    template<class T, class U>
+    void Emplace(U&& value) {
+        static_assert(!Holder<T>::kInline || sizeof(Holder<T>) <= kAnyBufferSize,
+                      "Inline holder does not fit the buffer");
+        if constexpr (Holder<T>::kInline) {
+            content_ = new (buffer_) Holder<T>(std::forward<U>(value));
+        } else {
+            content_ = new Holder<T>(std::forward<U>(value));
+        }
+    }
+
+    /* Heap payloads change owner, inline ones are trivially copied over */
+    void Steal(Any& rhs) {
+        if (rhs.IsInline()) {
+            content_ = rhs.content_->CloneInto(buffer_);
+            rhs.Clear();
+        } else {
+            content_ = rhs.content_;
+            rhs.content_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char buffer_[kAnyBufferSize];
+    PlaceHolder* content_;
 };
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Bump allocator handing out objects of one type from contiguous chunks.
+ * Nothing is freed individually: every object is destroyed in one flat
+ * loop, and the chunks are returned, when the arena is released. */
+template <class T>
+class Arena {
+public:
+    explicit Arena(size_t first_chunk = 64)
+            : next_chunk_(first_chunk)
+            , next_(nullptr)
+            , end_(nullptr)
+            , size_(0) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena() {
+        Release();
+    }
+
+    template <class... Args>
+    T* New(Args&&... args) {
+        if (next_ == end_) {
+            Grow();
+        }
+
+        auto object = new (next_) T(std::forward<Args>(args)...);
+        ++next_;
+        ++size_;
+        return object;
+    }
+
+    void Release() {
+        for (size_t i = 0; i < chunks_.size(); ++i) {
+            auto begin = chunks_[i].first;
+            auto end = (i + 1 == chunks_.size()) ? next_ : begin + chunks_[i].second;
+            if (!std::is_trivially_destructible<T>::value) {
+                for (auto object = begin; object != end; ++object) {
+                    object->~T();
+                }
+            }
+            ::operator delete(begin);
+        }
+
+        chunks_.clear();
+        next_ = end_ = nullptr;
+        size_ = 0;
+    }
+
+    /* Objects handed out since the last release */
+    size_t Size() const {
+        return size_;
+    }
+
+    size_t ChunkCount() const {
+        return chunks_.size();
+    }
+
+private:
+    void Grow() {
+        auto capacity = next_chunk_;
+        next_chunk_ *= 2;
+
+        next_ = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        end_ = next_ + capacity;
+        chunks_.emplace_back(next_, capacity);
+    }
+
+    std::vector<std::pair<T*, size_t>> chunks_;
+    size_t next_chunk_;
+    T* next_;
+    T* end_;
+    size_t size_;
+};
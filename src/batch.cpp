@@ -0,0 +1,39 @@
+#include "batch.h"
+
+namespace {
+
+/* Sources are small, but a grain of a few keeps the deques quiet */
+constexpr size_t kBatchGrain = 4;
+
+}
+
+BatchEvaluator::BatchEvaluator(size_t threads, Interpreter::Backend backend,
+                               size_t cache_capacity)
+        : pool_(threads) {
+    for (size_t slot = 0; slot < pool_.Slots(); ++slot) {
+        interpreters_.push_back(std::make_unique<Interpreter>(cache_capacity, backend));
+    }
+}
+
+std::vector<BatchResult> BatchEvaluator::Evaluate(const std::string* sources, size_t count) {
+    std::vector<BatchResult> results(count);
+    pool_.ParallelFor(count, kBatchGrain, [&](size_t slot, size_t index) {
+        auto& interpreter = *interpreters_[slot];
+        try {
+            results[index].value = interpreter.Eval(sources[index]);
+        } catch (std::exception& error) {
+            results[index].error = error.what();
+        }
+        interpreter.Reset();
+    });
+
+    return results;
+}
+
+size_t BatchEvaluator::Threads() const {
+    return pool_.Slots() - 1;
+}
+
+std::vector<BatchResult> EvaluateBatch(const std::vector<std::string>& sources, size_t threads) {
+    return BatchEvaluator(threads).Evaluate(sources);
+}
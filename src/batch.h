@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "interpreter.h"
+#include "pool.h"
+
+/* The outcome of one source of a batch */
+struct BatchResult {
+    /* The printed last value, empty on error */
+    std::string value;
+    /* What the evaluation threw, empty on success */
+    std::string error;
+
+    bool Ok() const {
+        return error.empty();
+    }
+};
+
+/* Evaluates independent sources in parallel. Every slot of the pool owns
+ * an interpreter, with its own heap and program cache, so workers share
+ * nothing but the symbol table. Each source starts with no globals, like
+ * a fresh Evaluate would. */
+class BatchEvaluator {
+public:
+    /* Zero threads for one per hardware thread */
+    explicit BatchEvaluator(size_t threads = 0,
+                            Interpreter::Backend backend = Interpreter::Backend::VM,
+                            size_t cache_capacity = 1024);
+
+    /* Results in the order of the sources */
+    std::vector<BatchResult> Evaluate(const std::string* sources, size_t count);
+
+    std::vector<BatchResult> Evaluate(const std::vector<std::string>& sources) {
+        return Evaluate(sources.data(), sources.size());
+    }
+
+    size_t Threads() const;
+
+private:
+    WorkStealingPool pool_;
+    std::vector<std::unique_ptr<Interpreter>> interpreters_;
+};
+
+/* One off batch on a pool of its own */
+std::vector<BatchResult> EvaluateBatch(const std::vector<std::string>& sources, size_t threads = 0);
@@ -0,0 +1,62 @@
+#include <algorithm>
+#include "budget.h"
+#include "lisp.h"
+
+Budget::Budget() {
+    Start(Limits());
+}
+
+void Budget::Start(const Limits& limits) {
+    limits_ = limits;
+    own_steps_ = limits.steps;
+    steps_left_ = &own_steps_;
+    /* The first step checks, which hands out the steps */
+    countdown_ = 1;
+    max_depth_ = limits.depth ? limits.depth : SIZE_MAX;
+    max_heap_ = limits.heap_bytes ? limits.heap_bytes : SIZE_MAX;
+}
+
+void Budget::Check(Heap& heap) {
+    if (!limits_.steps) {
+        countdown_ = kCheckInterval;
+    } else {
+        /* Early when the heap is over its limit, the steps not taken yet
+         * go back */
+        auto left = steps_left_->fetch_add(countdown_) + countdown_;
+        size_t take;
+        do {
+            if (!left) {
+                /* Whatever runs on this budget next fails right away as well */
+                countdown_ = 1;
+                throw BudgetError("ERROR: Budget exceeded, more than " +
+                                  std::to_string(limits_.steps) + " steps\n");
+            }
+            take = std::min(left, kCheckInterval);
+        } while (!steps_left_->compare_exchange_weak(left, left - take));
+        countdown_ = take;
+    }
+
+    if (limits_.heap_bytes && heap.Bytes() > limits_.heap_bytes) {
+        heap.Collect();
+        if (heap.Bytes() > limits_.heap_bytes) {
+            throw BudgetError("ERROR: Budget exceeded, heap over " +
+                              std::to_string(limits_.heap_bytes) + " bytes\n");
+        }
+    }
+}
+
+void Budget::Join(const Budget& budget, size_t depth) {
+    limits_ = budget.limits_;
+    steps_left_ = budget.steps_left_;
+    countdown_ = 1;
+    max_depth_ = budget.max_depth_;
+    if (limits_.depth) {
+        max_depth_ = std::max<size_t>(max_depth_ - std::min(depth, max_depth_), 1);
+    }
+    max_heap_ = budget.max_heap_;
+}
+
+void Budget::ThrowDepth() const {
+    throw BudgetError("ERROR: Budget exceeded, calls nested deeper than " +
+                      std::to_string(limits_.depth) + "\n");
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "heap.h"
+
+/* Limits on one evaluation, zero for none. Going over one throws a
+ * BudgetError. */
+struct Limits {
+    /* Every safepoint is a step, so every call and every allocation */
+    size_t steps = 0;
+    /* What the heap of the session may hold, bignums, environments and
+     * channels with their storage, checked every step and thrown only once
+     * a collection failed to get below it */
+    size_t heap_bytes = 0;
+    /* Calls waiting for their callee, tail calls do not nest. The passes
+     * before evaluation recurse once per level of nesting of the code,
+     * which the reader caps at AST::kMaxNesting whatever this is. */
+    size_t depth = 0;
+};
+
+/* What is left of the limits of the running evaluation. A step costs a
+ * decrement, the checks run once a countdown of steps reaches zero and
+ * take the next steps from a pool the workers of pmap share. */
+class Budget {
+public:
+    Budget();
+
+    /* Starts over with all of limits */
+    void Start(const Limits& limits);
+
+    /* False once the checks are due or the heap grew over its limit,
+     * Check is to be called then */
+    bool Step(const Heap& heap) {
+        return --countdown_ != 0 && heap.Bytes() <= max_heap_;
+    }
+
+    /* Throws if the steps ran out or the heap is over its limit even after
+     * a collection, which the caller has to be ready for */
+    void Check(Heap& heap);
+
+    /* Throws if depth calls waiting is more than the limit */
+    void Enter(size_t depth) const {
+        if (depth > max_depth_) {
+            ThrowDepth();
+        }
+    }
+
+    /* For the workers of pmap, to run on what is left of budget at depth:
+     * its steps, which they take from its pool, its heap limit and the
+     * depth below. Budget has to outlive this one. */
+    void Join(const Budget& budget, size_t depth);
+
+private:
+    /* Steps between two checks */
+    static constexpr size_t kCheckInterval = 256;
+
+    [[noreturn]] void ThrowDepth() const;
+
+    Limits limits_;
+    /* Steps not handed to a countdown yet, those of the budget joined or
+     * own_steps_ */
+    std::atomic<size_t>* steps_left_;
+    std::atomic<size_t> own_steps_;
+    size_t countdown_;
+    size_t max_depth_;
+    size_t max_heap_;
+};
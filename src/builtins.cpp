@@ -1,390 +1,300 @@
 #include "lisp.h"
+#include "numbers.h"
 
-void Evaluate::CheckOneArg(std::shared_ptr<Pair> func) {
-    if (!(func = func->next)) {
-        throw std::runtime_error("ERROR: Not enough arguments, expected 1.\n");
+Value Evaluate::Add(const Pair* curr) {
+    auto res = Value::MakeFixnum(0);
+    while ((curr = curr->next)) {
+        res = NumberAdd(heap_, res, Eval(curr));
     }
 
-    if (func->next->type != TokenType::CLOSE_PARENT) {
-        std::cerr << static_cast<int>(func->next->type) << std::endl;
-        throw std::runtime_error("ERROR: Too many arguments, expected 1.\n");
-    }
-}
-
-void Evaluate::CheckAtLeastOneArg(std::shared_ptr<Pair> func) {
-    if (!(func = func->next)) {
-        throw std::runtime_error("ERROR: Not enough arguments, expected at least 1.\n");
-    }
+    return res;
 }
 
-void Evaluate::CheckTwoArgs(std::shared_ptr<Pair> func) {
-    if (!(func = func->next)) {
-        throw std::runtime_error("Not enough arguments, expected 2 but got 0.\n");
-    }
-
-    if (!(func = func->next)) {
-        throw std::runtime_error("Not enough arguments, expected 2 but got 1.\n");
-    }
+Value Evaluate::Sub(const Pair* curr) {
+    curr = curr->next;
 
-    if (func->next->type != TokenType::CLOSE_PARENT) {
-        std::cerr << static_cast<int>(func->next->type) << std::endl;
-        throw std::runtime_error("ERROR: Too many arguments, expected 2.\n");
-    }
-}
+    auto res = Eval(curr);
+    CheckNumber(res);
 
-void Evaluate::CheckAtLeastTwoArgs(std::shared_ptr<Pair> func) {
-    if (!(func = func->next)) {
-        throw std::runtime_error("ERROR: Not enough arguments, expected at least 2 but got 0.\n");
+    while ((curr = curr->next)) {
+        res = NumberSub(heap_, res, Eval(curr));
     }
 
-    if (!func->next) {
-        throw std::runtime_error("ERROR: Not enough arguments, expected at least 2 but got 1.\n");
-    }
+    return res;
 }
 
-int64_t Evaluate::Add(std::shared_ptr<Pair> curr) {
-    int64_t res = 0;
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res += curr->value.TakeValue<int64_t>();
+Value Evaluate::Mul(const Pair* curr) {
+    auto res = Value::MakeFixnum(1);
+    while ((curr = curr->next)) {
+        res = NumberMul(heap_, res, Eval(curr));
     }
 
     return res;
 }
 
-int64_t Evaluate::Sub(std::shared_ptr<Pair> curr) {
-    CheckAtLeastOneArg(curr);
-
+Value Evaluate::Div(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto res = curr->value.TakeValue<int64_t>();
+    auto res = Eval(curr);
+    CheckNumber(res);
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res -= curr->value.TakeValue<int64_t>();
+    while ((curr = curr->next)) {
+        res = NumberDiv(heap_, res, Eval(curr));
     }
 
     return res;
 }
 
-int64_t Evaluate::Mul(std::shared_ptr<Pair> curr) {
-    int64_t res = 1;
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res *= curr->value.TakeValue<int64_t>();
-    }
+Value Evaluate::Abs(const Pair* curr) {
+    curr = curr->next;
 
-    return res;
+    return NumberAbs(heap_, Eval(curr));
 }
 
-int64_t Evaluate::Div(std::shared_ptr<Pair> curr) {
-    CheckAtLeastOneArg(curr);
-
+Value Evaluate::Min(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto res = curr->value.TakeValue<int64_t>();
+    auto res = Eval(curr);
+    CheckNumber(res);
+    bool inexact = KindOf(res) == NumberKind::FLONUM;
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res /= curr->value.TakeValue<int64_t>();
+    while ((curr = curr->next)) {
+        auto value = Eval(curr);
+        if (NumberOrdered(NumberCompare(value, res), std::less<int>())) {
+            res = value;
+        }
+        inexact |= KindOf(value) == NumberKind::FLONUM;
     }
 
-    return res;
+    return inexact ? ToFlonum(heap_, res) : res;
 }
 
-int64_t Evaluate::Abs(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
-
+Value Evaluate::Max(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto value = curr->value.TakeValue<int64_t>();
-
-    return (value) > 0 ? value : -value;
-}
+    auto res = Eval(curr);
+    CheckNumber(res);
+    bool inexact = KindOf(res) == NumberKind::FLONUM;
 
-int64_t Evaluate::Min(std::shared_ptr<Pair> curr) {
-    int64_t res = INT64_MAX;
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res = std::min(res, curr->value.TakeValue<int64_t>());
+    while ((curr = curr->next)) {
+        auto value = Eval(curr);
+        if (NumberOrdered(NumberCompare(value, res), std::greater<int>())) {
+            res = value;
+        }
+        inexact |= KindOf(value) == NumberKind::FLONUM;
     }
 
-    return res;
+    return inexact ? ToFlonum(heap_, res) : res;
 }
 
-int64_t Evaluate::Max(std::shared_ptr<Pair> curr) {
-    int64_t res = INT64_MIN;
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        res = std::max(res, curr->value.TakeValue<int64_t>());
+/* Every argument is evaluated and checked, like the other backends do */
+template <class Compare>
+bool Evaluate::Ordered(const Pair* curr, Compare compare) {
+    std::vector<Value> args;
+    while ((curr = curr->next)) {
+        args.push_back(Eval(curr));
     }
 
-    return res;
+    return NumbersOrdered(args.data(), args.size(), compare);
 }
 
-bool Evaluate::EQ(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
-
-    curr = curr->next;
+bool Evaluate::EQ(const Pair* curr) {
+    return Ordered(curr, std::equal_to<int>());
+}
 
-    Eval(curr);
-    auto first = curr->value.TakeValue<int64_t>();
+bool Evaluate::GT(const Pair* curr) {
+    return Ordered(curr, std::greater<int>());
+}
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        if (first != curr->value.TakeValue<int64_t>()) {
-            return false;
-        }
-    }
+bool Evaluate::LT(const Pair* curr) {
+    return Ordered(curr, std::less<int>());
+}
 
-    return true;
+bool Evaluate::GEQ(const Pair* curr) {
+    return Ordered(curr, std::greater_equal<int>());
 }
 
-bool Evaluate::GT(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
+bool Evaluate::LEQ(const Pair* curr) {
+    return Ordered(curr, std::less_equal<int>());
+}
 
+bool Evaluate::is_null(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto first = curr->value.TakeValue<int64_t>();
-
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        auto second = curr->value.TakeValue<int64_t>();
-
-        if (first <= second) {
-            return false;
-        }
+    return Eval(curr).IsNil();
+}
 
-        first = second;
-    }
+bool Evaluate::is_pair(const Pair* curr) {
+    curr = curr->next;
 
-    return true;
+    return Eval(curr).IsPair();
 }
 
-bool Evaluate::LT(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
-
+bool Evaluate::is_number(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto first = curr->value.TakeValue<int64_t>();
+    return IsNumber(Eval(curr));
+}
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        auto second = curr->value.TakeValue<int64_t>();
+bool Evaluate::is_bool(const Pair* curr) {
+    curr = curr->next;
 
-        if (first >= second) {
-            return false;
-        }
+    return Eval(curr).IsBool();
+}
 
-        first = second;
-    }
+bool Evaluate::is_symb(const Pair* curr) {
+    curr = curr->next;
 
-    return true;
+    return Eval(curr).IsSymbol();
 }
 
-bool Evaluate::GEQ(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
-
+bool Evaluate::is_list(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto first = curr->value.TakeValue<int64_t>();
+    return IsList(Eval(curr));
+}
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        auto second = curr->value.TakeValue<int64_t>();
+Value Evaluate::If(const Pair* curr) {
+    auto condition = curr->next;
+    auto true_branch = condition->next;
 
-        if (first < second) {
-            return false;
+    if (Eval(condition).IsFalse()) {
+        if (curr->argc == 2) {
+            throw std::runtime_error("ERROR: No else part to execute\n");
         }
-
-        first = second;
+        return Eval(true_branch->next);
     }
 
-    return true;
+    return Eval(true_branch);
 }
 
-bool Evaluate::LEQ(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
-
+bool Evaluate::NOT(const Pair* curr) {
     curr = curr->next;
 
-    Eval(curr);
-    auto first = curr->value.TakeValue<int64_t>();
-
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        auto second = curr->value.TakeValue<int64_t>();
+    return Eval(curr).IsFalse();
+}
 
-        if (first > second) {
+bool Evaluate::AND(const Pair* curr) {
+    while ((curr = curr->next)) {
+        if (Eval(curr).IsFalse()) {
             return false;
         }
-
-        first = second;
     }
 
     return true;
 }
 
-bool Evaluate::is_null(std::shared_ptr<Evaluate::Pair> curr) {
-    CheckOneArg(curr);
-    curr = curr->next;
-    Eval(curr);
+bool Evaluate::OR(const Pair* curr) {
+    while ((curr = curr->next)) {
+        if (!Eval(curr).IsFalse()) {
+            return true;
+        }
+    }
 
-    /* Not implemented */
+    return false;
 }
 
-bool Evaluate::is_pair(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
+bool Evaluate::ARE_EQUAL(const Pair* curr) {
     curr = curr->next;
-    Eval(curr);
+    auto first = Eval(curr);
+    auto second = Eval(curr->next);
 
-    /* Not implemented */
+    return Equal(first, second);
 }
 
-bool Evaluate::is_number(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
+bool Evaluate::ARE_EQ(const Pair* curr) {
     curr = curr->next;
-    Eval(curr);
+    auto first = Eval(curr);
+    auto second = Eval(curr->next);
 
-    return (curr->type == TokenType::NUM);
+    /* Numbers, booleans and symbols are all immediates, so equal values share one word */
+    return first == second;
 }
 
-bool Evaluate::is_bool(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
-    curr = curr->next;
-    Eval(curr);
-
-    return (curr->type == TokenType::BOOL);
+bool Evaluate::INT_EQ(const Pair* curr) {
+    return EQ(curr);
 }
 
-bool Evaluate::is_symb(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
-    curr = curr->next;
-    Eval(curr);
-
-    /* Not implemented */
+Value Evaluate::Quote(const Pair* curr) {
+    return Datum(curr->next);
 }
 
-bool Evaluate::is_list(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
-    curr = curr->next;
-    Eval(curr);
-
-    /* Not implemented */
-}
-
-void Evaluate::If(std::shared_ptr<Pair> curr) {
-    CheckAtLeastTwoArgs(curr);
-    bool no_else_branch = true;
-    /*Check if 3rd of 4th token in sequence is close parent*/
-    if (curr->next->next->next &&
-        curr->next->next->next->type != TokenType::CLOSE_PARENT) {
-        if(curr->next->next->next->next &&
-           curr->next->next->next->next->type != TokenType::CLOSE_PARENT) {
-            throw std::runtime_error("ERROR: Too many arguments, expected 2 or 3.\n");
-            return;
-        } else {
-            no_else_branch = false;
-        }
+Value Evaluate::Datum(const Pair* node) {
+    if (node->type != TokenType::OPEN_PARENT) {
+        return node->value;
     }
-    /*if((curr->next->next->next)->type != TokenType::CLOSE_PARENT ||
-       (curr->next->next->next->next)->type != TokenType::CLOSE_PARENT) {
-        throw std::runtime_error("ERROR: Too many arguments, expected 2 or 3.\n");
-    }*/
 
-    auto condition = curr->next;
-    auto true_branch = condition->next;
-    auto false_branch = true_branch->next;
-    Eval(condition);
-
-    if(condition->type == TokenType::BOOL &&
-       (condition->value).TakeValue<bool>() == false) {
-        if (no_else_branch) {
-            throw std::runtime_error("ERROR: No else part to execute\n");
-            return;
+    /* Built front to back, nothing is collected while the tree walker runs */
+    auto list = Value::MakeNil();
+    auto link = &list;
+    for (auto element = node->child; element; element = element->next) {
+        if (element->type == TokenType::PAIR) {
+            *link = Datum(element->next);
+            break;
         }
-        Eval(false_branch);
-        curr->type = false_branch->type;
-        curr->value = false_branch->value;
-    } else {
-        Eval(true_branch);
-        curr->type = true_branch->type;
-        curr->value = true_branch->value;
+
+        auto cell = heap_.NewCell(Datum(element), Value::MakeNil());
+        *link = Value::MakePair(cell);
+        link = &cell->cdr;
     }
+
+    return list;
 }
 
-bool Evaluate::NOT(std::shared_ptr<Pair> curr) {
-    CheckOneArg(curr);
+Value Evaluate::Cons(const Pair* curr) {
     curr = curr->next;
-    Eval(curr);
+    auto car = Eval(curr);
+    auto cdr = Eval(curr->next);
 
-    return (curr->type == TokenType::BOOL && curr->value.TakeValue<bool>() == false);
+    return Value::MakePair(heap_.NewCell(car, cdr));
 }
 
-bool Evaluate::AND(std::shared_ptr<Pair> curr) {
-    bool is_true = true;
-
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        if (curr->type == TokenType::BOOL && curr->value.TakeValue<bool>() == false) {
-            is_true = false;
-        }
-    }
-
-    return is_true;
+Value Evaluate::Car(const Pair* curr) {
+    return CheckPair(Eval(curr->next))->car;
 }
 
-bool Evaluate::OR(std::shared_ptr<Pair> curr) {
-    bool is_true = false;
+Value Evaluate::Cdr(const Pair* curr) {
+    return CheckPair(Eval(curr->next))->cdr;
+}
 
-    while ((curr = curr->next)->type != TokenType::CLOSE_PARENT) {
-        Eval(curr);
-        if (curr->type != TokenType::BOOL || curr->value.TakeValue<bool>() != false) {
-            is_true = true;
-        }
-    }
+Value Evaluate::SetCar(const Pair* curr) {
+    curr = curr->next;
+    auto cell = CheckPair(Eval(curr));
+    cell->car = Eval(curr->next);
 
-    return is_true;
+    return Value();
 }
 
-bool Evaluate::ARE_EQUAL(std::shared_ptr<Pair> curr) {
-    CheckTwoArgs(curr);
+Value Evaluate::SetCdr(const Pair* curr) {
     curr = curr->next;
-    Eval(curr);
-    Eval(curr->next);
+    auto cell = CheckPair(Eval(curr));
+    cell->cdr = Eval(curr->next);
 
-    if (curr->type != curr->next->type) {
-        return false;
-    }
+    return Value();
+}
 
-    switch (curr->type) {
-        case TokenType::NUM: {
-            auto first = curr->value.TakeValue<int64_t>();
-            auto second = curr->next->value.TakeValue<int64_t>();
-            return first == second;
-        }
-        case TokenType::BOOL: {
-            auto first = curr->value.TakeValue<bool>();
-            auto second = curr->next->value.TakeValue<bool>();
-            return first == second;
-        }
-        default:
-            std::runtime_error("Incomparable types\n");
-            break;
+Value Evaluate::List(const Pair* curr) {
+    auto list = Value::MakeNil();
+    auto link = &list;
+    while ((curr = curr->next)) {
+        auto cell = heap_.NewCell(Eval(curr), Value::MakeNil());
+        *link = Value::MakePair(cell);
+        link = &cell->cdr;
     }
 
+    return list;
 }
 
-bool Evaluate::ARE_EQ(std::shared_ptr<Pair> curr) {
-    return ARE_EQUAL(curr);
+Value Evaluate::ListRef(const Pair* curr) {
+    curr = curr->next;
+    auto list = Eval(curr);
+
+    return ::ListRef(list, TakeFixnum(Eval(curr->next)));
 }
 
-bool Evaluate::INT_EQ(std::shared_ptr<Pair> curr) {
-    return EQ(curr);
+Value Evaluate::ListTail(const Pair* curr) {
+    curr = curr->next;
+    auto list = Eval(curr);
+
+    return ::ListTail(list, TakeFixnum(Eval(curr->next)));
 }
@@ -0,0 +1,55 @@
+#include "cache.h"
+
+template <class Program>
+ProgramCache<Program>::ProgramCache(CompileFunction compile, size_t capacity)
+        : compile_(compile)
+        , capacity_(capacity ? capacity : 1)
+        , hits_(0)
+        , misses_(0) {}
+
+template <class Program>
+const Program& ProgramCache<Program>::Get(const std::string& source) {
+    auto found = index_.find(source);
+    if (found != index_.end()) {
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, found->second);
+        return found->second->program;
+    }
+
+    ++misses_;
+    /* Scripts that fail to compile are not cached */
+    auto program = compile_(source);
+
+    if (entries_.size() == capacity_) {
+        index_.erase(entries_.back().source);
+        entries_.pop_back();
+    }
+
+    entries_.push_front(Entry{source, std::move(program)});
+    index_.emplace(entries_.front().source, entries_.begin());
+    return entries_.front().program;
+}
+
+template <class Program>
+const Program* ProgramCache<Program>::Find(const std::string& source) const {
+    auto found = index_.find(source);
+    return found == index_.end() ? nullptr : &found->second->program;
+}
+
+template <class Program>
+size_t ProgramCache<Program>::Size() const {
+    return entries_.size();
+}
+
+template <class Program>
+size_t ProgramCache<Program>::Hits() const {
+    return hits_;
+}
+
+template <class Program>
+size_t ProgramCache<Program>::Misses() const {
+    return misses_;
+}
+
+template class ProgramCache<Chunk>;
+template class ProgramCache<ClosureTree>;
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "closure_tree.h"
+#include "vm.h"
+
+/* Compiled programs keyed by a hash of their source text, so resubmitting
+ * a script skips the tokenizer, the parser and the compiler. The least
+ * recently used program is dropped once the cache is full. */
+template <class Program>
+class ProgramCache {
+public:
+    using CompileFunction = Program (*)(const std::string& source);
+
+    ProgramCache(CompileFunction compile, size_t capacity);
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    /* Compiles on a miss, valid until the next call */
+    const Program& Get(const std::string& source);
+    /* Neither compiles nor counts, nullptr if the source is not cached */
+    const Program* Find(const std::string& source) const;
+
+    size_t Size() const;
+    size_t Hits() const;
+    size_t Misses() const;
+
+private:
+    struct Entry {
+        std::string source;
+        Program program;
+    };
+
+    CompileFunction compile_;
+    /* Most recently used first */
+    std::list<Entry> entries_;
+    /* Keys view into entries_, whose elements never move */
+    std::unordered_map<std::string_view, typename std::list<Entry>::iterator> index_;
+    size_t capacity_;
+    size_t hits_;
+    size_t misses_;
+};
+
+/* Bytecode for the VM */
+class ChunkCache : public ProgramCache<Chunk> {
+public:
+    explicit ChunkCache(size_t capacity = 1024)
+            : ProgramCache(&Compiler::CompileExpression, capacity) {}
+};
+
+/* Closure trees for the TreeEvaluator */
+class TreeCache : public ProgramCache<ClosureTree> {
+public:
+    explicit TreeCache(size_t capacity = 1024)
+            : ProgramCache(&TreeBuilder::BuildExpression, capacity) {}
+};
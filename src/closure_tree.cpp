@@ -0,0 +1,967 @@
+#include <algorithm>
+#include <functional>
+#include <pthread.h>
+#include "closure_tree.h"
+#include "numbers.h"
+#include "parallel.h"
+
+namespace {
+
+using NodePtr = std::unique_ptr<TreeNode>;
+using Nodes = std::vector<NodePtr>;
+
+inline Value Bool(bool value) {
+    return Value::MakeBool(value);
+}
+
+/* What the evaluation between two calls may take of the stack at least,
+ * a body nested as deep as the reader allows */
+constexpr size_t kMinStackHeadroom = 512 << 10;
+
+/* Lowest address a call may start at on this thread, which leaves a
+ * quarter of the stack to whatever runs above the last call */
+uintptr_t StackLimit() {
+    thread_local uintptr_t limit = [] {
+        void* low = nullptr;
+        size_t size = 0;
+        pthread_attr_t attributes;
+        if (!pthread_getattr_np(pthread_self(), &attributes)) {
+            pthread_attr_getstack(&attributes, &low, &size);
+            pthread_attr_destroy(&attributes);
+        }
+        return reinterpret_cast<uintptr_t>(low) + std::max(size / 4, kMinStackHeadroom);
+    }();
+    return limit;
+}
+
+class Constant : public TreeNode {
+public:
+    explicit Constant(Value value)
+            : value_(value) {}
+
+    Value Eval(TreeEvaluator&, size_t) const override {
+        return value_;
+    }
+
+private:
+    Value value_;
+};
+
+/* A boxed number literal, which belongs to the tree, the heap gets a copy */
+class Literal : public TreeNode {
+public:
+    Literal(Value value, std::shared_ptr<Heap> literals)
+            : value_(value)
+            , literals_(std::move(literals)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t) const override {
+        return CopyNumber(evaluator.GetHeap(), value_);
+    }
+
+private:
+    Value value_;
+    std::shared_ptr<Heap> literals_;
+};
+
+/* The slot of a local or captured variable, which holds its box if it has one */
+template <Address::Kind kind>
+Value& Slot(TreeEvaluator& evaluator, size_t frame, uint32_t index) {
+    auto& stack = evaluator.Stack();
+    if constexpr (kind == Address::Kind::LOCAL) {
+        return stack[frame + 1 + index];
+    } else {
+        return static_cast<Closure*>(stack[frame].GetObject())->free[index];
+    }
+}
+
+template <Address::Kind kind, bool boxed>
+class Get : public TreeNode {
+public:
+    explicit Get(uint32_t index)
+            : index_(index) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto value = Slot<kind>(evaluator, frame, index_);
+        return boxed ? GetBox(value)->value : value;
+    }
+
+private:
+    uint32_t index_;
+};
+
+class GetGlobal : public TreeNode {
+public:
+    explicit GetGlobal(Symbol symbol)
+            : site_(symbol) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t) const override {
+        auto binding = evaluator.Globals()->Find(site_);
+        if (!binding) {
+            ThrowUnbound(site_.symbol);
+        }
+
+        return binding->value;
+    }
+
+    const GlobalSite& Site() const {
+        return site_;
+    }
+
+private:
+    mutable GlobalSite site_;
+};
+
+/* Assignment to a local or captured variable, captured ones are boxed */
+template <Address::Kind kind, bool boxed>
+class Set : public TreeNode {
+public:
+    Set(uint32_t index, NodePtr value)
+            : index_(index)
+            , value_(std::move(value)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto value = value_->Eval(evaluator, frame);
+        auto& slot = Slot<kind>(evaluator, frame, index_);
+        if (boxed) {
+            GetBox(slot)->value = value;
+            evaluator.GetHeap().WriteBarrier(GetBox(slot), value);
+        } else {
+            slot = value;
+        }
+        return Value();
+    }
+
+private:
+    uint32_t index_;
+    NodePtr value_;
+};
+
+class SetGlobal : public TreeNode {
+public:
+    SetGlobal(Symbol symbol, NodePtr value)
+            : site_(symbol)
+            , value_(std::move(value)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto value = value_->Eval(evaluator, frame);
+        CheckAssignable(evaluator.GetHeap(), site_.symbol);
+        auto globals = evaluator.Globals();
+        auto binding = globals->Find(site_);
+        if (!binding) {
+            ThrowUnbound(site_.symbol);
+        }
+        Environment::Assign(binding, site_, value);
+        evaluator.GetHeap().WriteBarrier(globals, value);
+        return Value();
+    }
+
+    const GlobalSite& Site() const {
+        return site_;
+    }
+
+private:
+    mutable GlobalSite site_;
+    NodePtr value_;
+};
+
+class DefineGlobal : public TreeNode {
+public:
+    DefineGlobal(Symbol symbol, NodePtr value)
+            : symbol_(symbol)
+            , value_(std::move(value)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto value = value_->Eval(evaluator, frame);
+        CheckAssignable(evaluator.GetHeap(), symbol_);
+        if (evaluator.Globals()->Define(symbol_, value)) {
+            evaluator.GetHeap().Charge(Environment::kBindingBytes);
+        }
+        evaluator.GetHeap().WriteBarrier(evaluator.Globals(), value);
+        return Value();
+    }
+
+private:
+    Symbol symbol_;
+    NodePtr value_;
+};
+
+/* Gives the variables closures capture and assign their box as the call starts */
+class BoxLocals : public TreeNode {
+public:
+    BoxLocals(std::vector<uint32_t> slots, NodePtr body)
+            : slots_(std::move(slots))
+            , body_(std::move(body)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        for (auto slot : slots_) {
+            evaluator.Safepoint();
+            auto& local = evaluator.Stack()[frame + 1 + slot];
+            auto box = evaluator.GetHeap().New<Box>(local);
+            evaluator.GetHeap().WriteBarrier(box, box->value);
+            local = Value::MakeObject(box);
+        }
+
+        return body_->Eval(evaluator, frame);
+    }
+
+private:
+    std::vector<uint32_t> slots_;
+    NodePtr body_;
+};
+
+class If : public TreeNode {
+public:
+    /* false_branch is null for (if condition true_branch) */
+    If(NodePtr condition, NodePtr true_branch, NodePtr false_branch)
+            : condition_(std::move(condition))
+            , true_branch_(std::move(true_branch))
+            , false_branch_(std::move(false_branch)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        if (!condition_->Eval(evaluator, frame).IsFalse()) {
+            return true_branch_->Eval(evaluator, frame);
+        }
+        if (!false_branch_) {
+            throw std::runtime_error("ERROR: No else part to execute\n");
+        }
+
+        return false_branch_->Eval(evaluator, frame);
+    }
+
+private:
+    NodePtr condition_;
+    NodePtr true_branch_;
+    NodePtr false_branch_;
+};
+
+/* Stops at the first operand deciding the result */
+class Logic : public TreeNode {
+public:
+    Logic(bool is_and, Nodes operands)
+            : is_and_(is_and)
+            , operands_(std::move(operands)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        for (auto& operand : operands_) {
+            if (operand->Eval(evaluator, frame).IsFalse() == is_and_) {
+                return Bool(!is_and_);
+            }
+        }
+
+        return Bool(is_and_);
+    }
+
+private:
+    bool is_and_;
+    Nodes operands_;
+};
+
+class Sequence : public TreeNode {
+public:
+    explicit Sequence(Nodes body)
+            : body_(std::move(body)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        for (size_t i = 0; i + 1 < body_.size(); ++i) {
+            body_[i]->Eval(evaluator, frame);
+        }
+
+        return body_.back()->Eval(evaluator, frame);
+    }
+
+private:
+    Nodes body_;
+};
+
+class Lambda : public TreeNode {
+public:
+    explicit Lambda(std::shared_ptr<const Function> function)
+            : function_(std::move(function)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        evaluator.Safepoint();
+        auto closure = evaluator.GetHeap().New<Closure>(function_);
+        closure->free.reserve(function_->captures.size());
+        evaluator.GetHeap().Charge(closure->free.capacity() * sizeof(Value));
+        for (auto& from : function_->captures) {
+            auto value = from.kind == Address::Kind::LOCAL
+                                 ? Slot<Address::Kind::LOCAL>(evaluator, frame, from.index)
+                                 : Slot<Address::Kind::FREE>(evaluator, frame, from.index);
+            closure->free.push_back(value);
+            evaluator.GetHeap().WriteBarrier(closure, value);
+        }
+
+        return Value::MakeObject(closure);
+    }
+
+private:
+    std::shared_ptr<const Function> function_;
+};
+
+class Call : public TreeNode {
+public:
+    Call(NodePtr callee, Nodes operands, bool tail)
+            : callee_(std::move(callee))
+            , operands_(std::move(operands))
+            , tail_(tail) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto& stack = evaluator.Stack();
+        auto base = stack.size();
+        stack.push_back(callee_->Eval(evaluator, frame));
+        for (auto& operand : operands_) {
+            auto value = operand->Eval(evaluator, frame);
+            stack.push_back(value);
+        }
+
+        return tail_ ? evaluator.TailCall(base) : evaluator.Apply(base);
+    }
+
+private:
+    NodePtr callee_;
+    Nodes operands_;
+    bool tail_;
+};
+
+/* A builtin taking its operands evaluated, args stays valid across a
+ * safepoint the builtin runs itself */
+using Builtin = Value (*)(TreeEvaluator& evaluator, Value* args, size_t argc);
+
+class Primitive : public TreeNode {
+public:
+    Primitive(Builtin builtin, Nodes operands)
+            : builtin_(builtin)
+            , operands_(std::move(operands)) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        /* No other value is held while a single operand is evaluated */
+        if (operands_.size() == 1) {
+            auto value = operands_[0]->Eval(evaluator, frame);
+            return builtin_(evaluator, &value, 1);
+        }
+
+        auto& stack = evaluator.Stack();
+        auto base = stack.size();
+        for (auto& operand : operands_) {
+            auto value = operand->Eval(evaluator, frame);
+            stack.push_back(value);
+        }
+
+        auto result = builtin_(evaluator, stack.data() + base, operands_.size());
+        stack.resize(base);
+        return result;
+    }
+
+private:
+    Builtin builtin_;
+    Nodes operands_;
+};
+
+/* (list ...) and quoted lists, whose cells are made each time the quote
+ * runs like the VM does, so trees hold immediates only */
+class MakeList : public TreeNode {
+public:
+    /* The last element is the tail of a dotted list */
+    MakeList(Nodes elements, bool dotted)
+            : elements_(std::move(elements))
+            , dotted_(dotted) {}
+
+    Value Eval(TreeEvaluator& evaluator, size_t frame) const override {
+        auto& stack = evaluator.Stack();
+        auto base = stack.size();
+        for (auto& element : elements_) {
+            auto value = element->Eval(evaluator, frame);
+            stack.push_back(value);
+        }
+
+        auto cells = elements_.size() - dotted_;
+        evaluator.Safepoint(cells);
+        auto list = dotted_ ? stack.back() : Value::MakeNil();
+        for (auto i = cells; i-- > 0;) {
+            list = Value::MakePair(evaluator.GetHeap().NewCell(stack[base + i], list));
+        }
+        stack.resize(base);
+        return list;
+    }
+
+private:
+    Nodes elements_;
+    bool dotted_;
+};
+
+Value Add(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberSum(evaluator.GetHeap(), args, argc);
+}
+
+Value Sub(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberDifference(evaluator.GetHeap(), args, argc);
+}
+
+Value Mul(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberProduct(evaluator.GetHeap(), args, argc);
+}
+
+Value Div(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberQuotient(evaluator.GetHeap(), args, argc);
+}
+
+Value Min(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberExtremum(evaluator.GetHeap(), args, argc, -1);
+}
+
+Value Max(TreeEvaluator& evaluator, Value* args, size_t argc) {
+    return NumberExtremum(evaluator.GetHeap(), args, argc, 1);
+}
+
+Value Abs(TreeEvaluator& evaluator, Value* args, size_t) {
+    return NumberAbs(evaluator.GetHeap(), args[0]);
+}
+
+/* Against zero, like the result of NumberCompare */
+template <class Compare>
+Value Comparison(TreeEvaluator&, Value* args, size_t argc) {
+    return Bool(NumbersOrdered(args, argc, Compare()));
+}
+
+Value Not(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0].IsFalse());
+}
+
+Value IsNumber(TreeEvaluator&, Value* args, size_t) {
+    return Bool(IsNumber(args[0]));
+}
+
+Value IsBoolean(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0].IsBool());
+}
+
+Value IsSymbol(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0].IsSymbol());
+}
+
+Value IsNull(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0].IsNil());
+}
+
+Value IsPair(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0].IsPair());
+}
+
+Value IsProperList(TreeEvaluator&, Value* args, size_t) {
+    return Bool(IsList(args[0]));
+}
+
+Value AreEq(TreeEvaluator&, Value* args, size_t) {
+    return Bool(args[0] == args[1]);
+}
+
+Value AreEqual(TreeEvaluator&, Value* args, size_t) {
+    return Bool(Equal(args[0], args[1]));
+}
+
+Value Cons(TreeEvaluator& evaluator, Value* args, size_t) {
+    evaluator.Safepoint(1);
+    return Value::MakePair(evaluator.GetHeap().NewCell(args[0], args[1]));
+}
+
+Value Car(TreeEvaluator&, Value* args, size_t) {
+    return CheckPair(args[0])->car;
+}
+
+Value Cdr(TreeEvaluator&, Value* args, size_t) {
+    return CheckPair(args[0])->cdr;
+}
+
+Value SetCar(TreeEvaluator& evaluator, Value* args, size_t) {
+    auto cell = CheckPair(args[0]);
+    cell->car = args[1];
+    evaluator.GetHeap().WriteBarrier(cell, args[1]);
+    return Value();
+}
+
+Value SetCdr(TreeEvaluator& evaluator, Value* args, size_t) {
+    auto cell = CheckPair(args[0]);
+    cell->cdr = args[1];
+    evaluator.GetHeap().WriteBarrier(cell, args[1]);
+    return Value();
+}
+
+Value ListRefOf(TreeEvaluator&, Value* args, size_t) {
+    return ListRef(args[0], TakeFixnum(args[1]));
+}
+
+Value ListTailOf(TreeEvaluator&, Value* args, size_t) {
+    return ListTail(args[0], TakeFixnum(args[1]));
+}
+
+/* An evaluator of its own for each thread of a parallel section */
+class TreeCaller : public Caller {
+public:
+    explicit TreeCaller(TreeEvaluator& parent)
+            : evaluator_(parent.GetHeap(), parent.Globals()) {
+        evaluator_.ShareBudget(parent);
+    }
+
+    Value Call(Value procedure, const Value* args, size_t argc) override {
+        auto& stack = evaluator_.Stack();
+        auto base = stack.size();
+        stack.push_back(procedure);
+        stack.insert(stack.end(), args, args + argc);
+        try {
+            return evaluator_.Apply(base);
+        } catch (...) {
+            stack.resize(base);
+            throw;
+        }
+    }
+
+private:
+    TreeEvaluator evaluator_;
+};
+
+CallerFactory CallersOf(TreeEvaluator& evaluator) {
+    return [&evaluator] {
+        return std::make_unique<TreeCaller>(evaluator);
+    };
+}
+
+Value ParallelMapOf(TreeEvaluator& evaluator, Value* args, size_t) {
+    return ParallelMap(evaluator.GetHeap(), args[0], args[1], CallersOf(evaluator));
+}
+
+Value ParallelForEachOf(TreeEvaluator& evaluator, Value* args, size_t) {
+    ParallelForEach(evaluator.GetHeap(), args[0], args[1], CallersOf(evaluator));
+    return Value();
+}
+
+Value ParallelReduceOf(TreeEvaluator& evaluator, Value* args, size_t) {
+    return ParallelReduce(evaluator.GetHeap(), args[0], args[1], args[2], CallersOf(evaluator));
+}
+
+/* Calls recurse on the C++ stack here, which a green thread cannot be
+ * switched out of, so channel operations that would block throw */
+[[noreturn]] void ThrowNoGreenThreads() {
+    throw std::runtime_error("ERROR: Green threads need the vm backend\n");
+}
+
+Value Spawn(TreeEvaluator&, Value*, size_t) {
+    ThrowNoGreenThreads();
+}
+
+Value MakeChannelOf(TreeEvaluator& evaluator, Value* args, size_t) {
+    evaluator.Safepoint();
+    return MakeChannel(evaluator.GetHeap(), args[0]);
+}
+
+Value Send(TreeEvaluator& evaluator, Value* args, size_t) {
+    auto channel = CheckChannel(evaluator.GetHeap(), args[0]);
+    if (channel->values.size() == channel->capacity) {
+        ThrowNoGreenThreads();
+    }
+    channel->values.push_back(args[1]);
+    evaluator.GetHeap().Charge(sizeof(Value));
+    evaluator.GetHeap().WriteBarrier(channel, args[1]);
+    return Value();
+}
+
+Value Recv(TreeEvaluator& evaluator, Value* args, size_t) {
+    auto channel = CheckChannel(evaluator.GetHeap(), args[0]);
+    if (channel->values.empty()) {
+        ThrowNoGreenThreads();
+    }
+    auto value = channel->values.front();
+    channel->values.pop_front();
+    return value;
+}
+
+Builtin BuiltinOf(Tokenizer::Builtins builtin) {
+    using Builtins = Tokenizer::Builtins;
+
+    switch (builtin) {
+        case Builtins::ADD:
+            return Add;
+        case Builtins::SUB:
+            return Sub;
+        case Builtins::MUL:
+            return Mul;
+        case Builtins::DIV:
+            return Div;
+        case Builtins::MIN:
+            return Min;
+        case Builtins::MAX:
+            return Max;
+        case Builtins::ABS:
+            return Abs;
+        case Builtins::EQ:
+        case Builtins::INT_EQ:
+            return Comparison<std::equal_to<int>>;
+        case Builtins::GT:
+            return Comparison<std::greater<int>>;
+        case Builtins::LT:
+            return Comparison<std::less<int>>;
+        case Builtins::GEQ:
+            return Comparison<std::greater_equal<int>>;
+        case Builtins::LEQ:
+            return Comparison<std::less_equal<int>>;
+        case Builtins::NOT:
+            return Not;
+        case Builtins::IS_NUMBER:
+            return IsNumber;
+        case Builtins::IS_BOOLEAN:
+            return IsBoolean;
+        case Builtins::IS_SYMBOL:
+            return IsSymbol;
+        case Builtins::IS_NULL:
+            return IsNull;
+        case Builtins::IS_PAIR:
+            return IsPair;
+        case Builtins::IS_LIST:
+            return IsProperList;
+        case Builtins::ARE_EQ:
+            return AreEq;
+        case Builtins::ARE_EQUAL:
+            return AreEqual;
+        case Builtins::CONS:
+            return Cons;
+        case Builtins::CAR:
+            return Car;
+        case Builtins::CDR:
+            return Cdr;
+        case Builtins::SET_CAR:
+            return SetCar;
+        case Builtins::SET_CDR:
+            return SetCdr;
+        case Builtins::LIST_REF:
+            return ListRefOf;
+        case Builtins::LIST_TAIL:
+            return ListTailOf;
+        case Builtins::PMAP:
+            return ParallelMapOf;
+        case Builtins::PFOR_EACH:
+            return ParallelForEachOf;
+        case Builtins::PREDUCE:
+            return ParallelReduceOf;
+        case Builtins::SPAWN:
+            return Spawn;
+        case Builtins::CHANNEL:
+            return MakeChannelOf;
+        case Builtins::SEND:
+            return Send;
+        case Builtins::RECV:
+            return Recv;
+        default:
+            throw std::runtime_error("ERROR: Not implemented\n");
+    }
+}
+
+}
+
+TreeBuilder::TreeBuilder(const AST& ast)
+        : ast_(ast)
+        , scope_(nullptr)
+        , sites_(&own_sites_) {}
+
+TreeBuilder::TreeBuilder(const AST& ast, Scope* scope, std::vector<const GlobalSite*>& sites)
+        : ast_(ast)
+        , scope_(scope)
+        , sites_(&sites) {}
+
+ClosureTree TreeBuilder::Build() {
+    /* Every top level expression runs in order, the last one gives the result */
+    own_sites_.clear();
+    auto root = BuildSequence(ast_.root_, true);
+    return ClosureTree{std::move(root), std::move(own_sites_)};
+}
+
+ClosureTree TreeBuilder::BuildExpression(const std::string& expr) {
+    AST ast{std::string_view(expr)};
+    while (ast.InsertLexema()) {}
+    ast.Analyze();
+    ast.Fold();
+
+    return TreeBuilder(ast).Build();
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildSequence(const Pair* node, bool tail) {
+    if (!node) {
+        return std::make_unique<Constant>(Value());
+    }
+    if (!node->next) {
+        return BuildNode(node, tail);
+    }
+
+    Nodes body;
+    for (; node->next; node = node->next) {
+        body.push_back(BuildNode(node));
+    }
+    body.push_back(BuildNode(node, tail));
+
+    return std::make_unique<Sequence>(std::move(body));
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildNode(const Pair* node, bool tail) {
+    switch (node->type) {
+        case TokenType::NUM:
+        case TokenType::BOOL:
+            return BuildConstant(node->value);
+        case TokenType::NAME:
+            return BuildGet(node->value.GetSymbol());
+        case TokenType::OPEN_PARENT: {
+            auto head = node->child;
+            if (head->type == TokenType::BUILTIN) {
+                return BuildForm(head, tail);
+            }
+            return BuildCall(head, tail);
+            }
+        default:
+            throw std::runtime_error("ERROR: Not implemented\n");
+    }
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildForm(const Pair* head, bool tail) {
+    auto builtin = Tokenizer::ToBuiltin(head->value.GetSymbol());
+
+    switch (builtin) {
+        case Builtins::LAMBDA:
+            return BuildLambda(head->next->child, head->next->next);
+        case Builtins::DEFINE:
+            return BuildDefine(head);
+        case Builtins::SET:
+            return BuildAssign(head->next->value.GetSymbol(), BuildNode(head->next->next), false);
+        case Builtins::QUOTE:
+            return BuildDatum(head->next);
+        case Builtins::IF: {
+            auto condition = head->next;
+            auto true_branch = condition->next;
+            auto false_branch = true_branch->next;
+            return std::make_unique<If>(BuildNode(condition), BuildNode(true_branch, tail),
+                                        head->argc == 3 ? BuildNode(false_branch, tail) : nullptr);
+            }
+        case Builtins::AND:
+        case Builtins::OR:
+            return std::make_unique<Logic>(builtin == Builtins::AND, BuildArgs(head));
+        case Builtins::LIST:
+            return std::make_unique<MakeList>(BuildArgs(head), false);
+        default:
+            return std::make_unique<Primitive>(BuiltinOf(builtin), BuildArgs(head));
+    }
+}
+
+std::vector<TreeBuilder::NodePtr> TreeBuilder::BuildArgs(const Pair* head) {
+    Nodes args;
+    for (auto arg = head->next; arg; arg = arg->next) {
+        args.push_back(BuildNode(arg));
+    }
+
+    return args;
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildConstant(Value value) {
+    if (value.IsObject()) {
+        return std::make_unique<Literal>(value, ast_.GetLiterals());
+    }
+    return std::make_unique<Constant>(value);
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildDatum(const Pair* node) {
+    if (node->type != TokenType::OPEN_PARENT) {
+        return BuildConstant(node->value);
+    }
+
+    Nodes elements;
+    for (auto element = node->child; element; element = element->next) {
+        if (element->type == TokenType::PAIR) {
+            elements.push_back(BuildDatum(element->next));
+            return std::make_unique<MakeList>(std::move(elements), true);
+        }
+        elements.push_back(BuildDatum(element));
+    }
+
+    return std::make_unique<MakeList>(std::move(elements), false);
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildCall(const Pair* head, bool tail) {
+    auto callee = BuildNode(head);
+    return std::make_unique<Call>(std::move(callee), BuildArgs(head), tail);
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildLambda(const Pair* params, const Pair* body) {
+    auto function = std::make_shared<Function>();
+    for (auto param = params; param; param = param->next) {
+        function->params.push_back(param->value.GetSymbol());
+    }
+
+    Scope scope(scope_, params, body);
+    auto built = TreeBuilder(ast_, &scope, *sites_).BuildSequence(body, true);
+    auto boxed = scope.BoxedLocals();
+    if (!boxed.empty()) {
+        built = std::make_unique<BoxLocals>(std::move(boxed), std::move(built));
+    }
+    function->body = std::move(built);
+    function->locals = scope.LocalCount();
+    function->captures = scope.Captures();
+
+    return std::make_unique<Lambda>(std::move(function));
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildDefine(const Pair* head) {
+    auto target = head->next;
+
+    /* (define (name params...) body...) */
+    if (target->type == TokenType::OPEN_PARENT) {
+        auto name = target->child;
+        return BuildAssign(name->value.GetSymbol(), BuildLambda(name->next, target->next), true);
+    }
+
+    return BuildAssign(target->value.GetSymbol(), BuildNode(target->next), true);
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildGet(Symbol symbol) {
+    using Kind = Address::Kind;
+
+    auto address = Scope::Resolve(scope_, symbol);
+    switch (address.kind) {
+        case Kind::LOCAL:
+            if (address.boxed) {
+                return std::make_unique<Get<Kind::LOCAL, true>>(address.index);
+            }
+            return std::make_unique<Get<Kind::LOCAL, false>>(address.index);
+        case Kind::FREE:
+            if (address.boxed) {
+                return std::make_unique<Get<Kind::FREE, true>>(address.index);
+            }
+            return std::make_unique<Get<Kind::FREE, false>>(address.index);
+        default: {
+            auto get = std::make_unique<GetGlobal>(symbol);
+            sites_->push_back(&get->Site());
+            return get;
+            }
+    }
+}
+
+TreeBuilder::NodePtr TreeBuilder::BuildAssign(Symbol symbol, NodePtr value, bool define) {
+    using Kind = Address::Kind;
+
+    /* Defines in a lambda body have a frame slot of their own */
+    auto address = Scope::Resolve(scope_, symbol);
+    switch (address.kind) {
+        case Kind::LOCAL:
+            if (address.boxed) {
+                return std::make_unique<Set<Kind::LOCAL, true>>(address.index, std::move(value));
+            }
+            return std::make_unique<Set<Kind::LOCAL, false>>(address.index, std::move(value));
+        case Kind::FREE:
+            /* Captured variables that get assigned are always boxed */
+            return std::make_unique<Set<Kind::FREE, true>>(address.index, std::move(value));
+        default:
+            break;
+    }
+
+    if (define) {
+        return std::make_unique<DefineGlobal>(symbol, std::move(value));
+    }
+    auto set = std::make_unique<SetGlobal>(symbol, std::move(value));
+    sites_->push_back(&set->Site());
+    return set;
+}
+
+TreeEvaluator::TreeEvaluator(Heap& heap, Environment* globals)
+        : heap_(heap)
+        , roots_id_(heap.AddRoots([this](Heap& heap) { MarkRoots(heap); }))
+        , globals_(globals ? globals : heap.New<Environment>())
+        , tail_call_(kNoTailCall)
+        , depth_(0) {}
+
+TreeEvaluator::~TreeEvaluator() {
+    heap_.RemoveRoots(roots_id_);
+}
+
+void TreeEvaluator::ResetGlobals() {
+    globals_ = heap_.New<Environment>();
+}
+
+void TreeEvaluator::SetLimits(const Limits& limits) {
+    limits_ = limits;
+    budget_.Start(limits);
+}
+
+void TreeEvaluator::ShareBudget(const TreeEvaluator& parent) {
+    budget_.Join(parent.budget_, parent.depth_);
+}
+
+void TreeEvaluator::Safepoint(size_t cells) {
+    /* Everything live is on the stack already */
+    if (!budget_.Step(heap_)) {
+        budget_.Check(heap_);
+    }
+    if (heap_.ShouldCollect()) {
+        heap_.Collect();
+    }
+    if (!heap_.HasRoom(cells)) {
+        heap_.CollectNursery();
+    }
+}
+
+void TreeEvaluator::MarkRoots(Heap& heap) {
+    heap.Mark(globals_);
+    /* Locals are stack slots too */
+    for (auto& value : stack_) {
+        heap.Mark(value);
+    }
+}
+
+Value TreeEvaluator::Run(const ClosureTree& tree) {
+    /* Nothing but the globals is live once the run is over, even if it threw */
+    struct Finish {
+        ~Finish() {
+            evaluator->stack_.clear();
+            evaluator->tail_call_ = kNoTailCall;
+        }
+        TreeEvaluator* evaluator;
+    } finish{this};
+    budget_.Start(limits_);
+
+    /* The top level has no locals and no callee */
+    auto result = tree.root->Eval(*this, 0);
+    if (tail_call_ != kNoTailCall) {
+        auto base = tail_call_;
+        tail_call_ = kNoTailCall;
+        result = Apply(base);
+    }
+
+    return result;
+}
+
+Value TreeEvaluator::Apply(size_t base) {
+    /* Calls that are not in tail position recurse on the C++ stack */
+    if (reinterpret_cast<uintptr_t>(__builtin_frame_address(0)) < StackLimit()) {
+        throw std::runtime_error("ERROR: Calls nested too deep for the stack\n");
+    }
+
+    struct Nested {
+        ~Nested() {
+            --depth;
+        }
+        size_t& depth;
+    } nested{++depth_};
+    budget_.Enter(depth_);
+
+    for (;;) {
+        Safepoint();
+        auto& function = *CheckCallee(stack_[base], stack_.size() - base - 1)->function;
+
+        /* The callee stays in its slot while it runs, which keeps its body
+         * alive, and the arguments are its first locals already */
+        stack_.resize(base + 1 + function.locals);
+        auto result = function.body->Eval(*this, base);
+        if (tail_call_ == kNoTailCall) {
+            stack_.resize(base);
+            return result;
+        }
+
+        /* The call in tail position takes over the slots of this one */
+        std::move(stack_.begin() + tail_call_, stack_.end(), stack_.begin() + base);
+        stack_.resize(stack_.size() - (tail_call_ - base));
+        tail_call_ = kNoTailCall;
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "heap.h"
+#include "vm.h"
+
+class TreeEvaluator;
+
+/* One form analyzed ahead of time: special forms are dispatched, builtins
+ * resolved, variables addressed and operands analyzed when the tree is
+ * built, so evaluating is a walk of virtual calls with no switch over the
+ * builtins. */
+struct TreeNode {
+    virtual ~TreeNode() = default;
+
+    /* frame is the stack slot of the running callee, its locals follow */
+    virtual Value Eval(TreeEvaluator& evaluator, size_t frame) const = 0;
+};
+
+/* A whole source analyzed once, to be run any number of times */
+struct ClosureTree {
+    std::shared_ptr<const TreeNode> root;
+    /* Inline caches of the global references in the tree, lambdas
+     * included, owned by the nodes */
+    std::vector<const GlobalSite*> globals;
+};
+
+/* Expects an analyzed AST, like the Compiler */
+class TreeBuilder {
+public:
+    explicit TreeBuilder(const AST& ast);
+
+    ClosureTree Build();
+
+    static ClosureTree BuildExpression(const std::string& expr);
+
+private:
+    using Pair = AST::Pair;
+    using TokenType = Tokenizer::TokenType;
+    using Builtins = Tokenizer::Builtins;
+    using NodePtr = std::unique_ptr<TreeNode>;
+
+    /* Builds the body of the lambda scope stands for, adding the global
+     * sites to those of the top level */
+    TreeBuilder(const AST& ast, Scope* scope, std::vector<const GlobalSite*>& sites);
+
+    /* Tail is set when the value is returned right away, calls there
+     * replace the current one instead of nesting */
+    NodePtr BuildSequence(const Pair* node, bool tail);
+    NodePtr BuildNode(const Pair* node, bool tail = false);
+    NodePtr BuildForm(const Pair* head, bool tail);
+    std::vector<NodePtr> BuildArgs(const Pair* head);
+    /* A number, boolean, symbol or the unspecified value */
+    NodePtr BuildConstant(Value value);
+    /* What a quoted node stands for */
+    NodePtr BuildDatum(const Pair* node);
+    NodePtr BuildCall(const Pair* head, bool tail);
+    NodePtr BuildLambda(const Pair* params, const Pair* body);
+    NodePtr BuildDefine(const Pair* head);
+    NodePtr BuildGet(Symbol symbol);
+    NodePtr BuildAssign(Symbol symbol, NodePtr value, bool define);
+
+    const AST& ast_;
+    Scope* scope_;
+    std::vector<const GlobalSite*> own_sites_;
+    std::vector<const GlobalSite*>* sites_;
+};
+
+/* Runs closure trees against the same heap objects as the VM: closures,
+ * boxes and cons cells. Frames are laid out on the stack like the VM's.
+ * Calls recurse on the C++ stack, except in tail position where they are
+ * trampolined through the closure being applied, so loops run in
+ * constant space. */
+class TreeEvaluator {
+public:
+    /* Shares the globals of another evaluator when given, like the
+     * workers of pmap do */
+    explicit TreeEvaluator(Heap& heap, Environment* globals = nullptr);
+    ~TreeEvaluator();
+
+    TreeEvaluator(const TreeEvaluator&) = delete;
+    TreeEvaluator& operator=(const TreeEvaluator&) = delete;
+
+    /* Runs a tree in the global environment, which persists between runs */
+    Value Run(const ClosureTree& tree);
+
+    /* The rest is for the nodes. Values held across anything that may
+     * allocate go on the stack, which the collector sees and updates. */
+    std::vector<Value>& Stack() {
+        return stack_;
+    }
+
+    Heap& GetHeap() {
+        return heap_;
+    }
+
+    Environment* Globals() {
+        return globals_;
+    }
+
+    /* Starts over with no globals defined, the old ones become garbage */
+    void ResetGlobals();
+
+    /* Calls the callee in stack slot base with the arguments above it,
+     * which become its first locals and are popped with the rest. Throws
+     * once the calls waiting take up most of the C++ stack. */
+    Value Apply(size_t base);
+
+    /* Leaves the call in stack slot base to the closure being applied */
+    Value TailCall(size_t base) {
+        tail_call_ = base;
+        return Value();
+    }
+
+    /* Collects if the heap asks for it or the nursery has no room for the
+     * cells about to be allocated, and counts a step of the budget */
+    void Safepoint(size_t cells = 0);
+
+    /* Every run from now on gets all of limits, calls made straight to
+     * Apply share them */
+    void SetLimits(const Limits& limits);
+
+    /* For a worker, calls made straight to Apply run on what is left of
+     * the budget of parent, which goes on counting the steps */
+    void ShareBudget(const TreeEvaluator& parent);
+
+private:
+    static constexpr size_t kNoTailCall = SIZE_MAX;
+
+    void MarkRoots(Heap& heap);
+
+    Heap& heap_;
+    size_t roots_id_;
+    Environment* globals_;
+    std::vector<Value> stack_;
+    /* Stack slot of the pending tail call, kNoTailCall if there is none */
+    size_t tail_call_;
+
+    Limits limits_;
+    Budget budget_;
+    /* Applies running */
+    size_t depth_;
+};
@@ -0,0 +1,463 @@
+#include <algorithm>
+#include "vm.h"
+
+Compiler::Compiler(const AST& ast, Scope* scope)
+        : ast_(ast)
+        , scope_(scope)
+        , depth_(0) {}
+
+Chunk Compiler::Compile() {
+    /* Every top level expression runs in order, the last one gives the result */
+    return CompileBody(ast_.root_);
+}
+
+Chunk Compiler::CompileBody(const Pair* body) {
+    chunk_ = Chunk();
+    chunk_.literals = ast_.GetLiterals();
+    depth_ = 0;
+
+    /* Variables closures capture and assign get their box first thing */
+    if (scope_) {
+        for (auto slot : scope_->BoxedLocals()) {
+            Emit(OpCode::BOX_LOCAL, slot);
+        }
+    }
+    CompileSequence(body, true);
+    Emit(OpCode::RETURN);
+
+    return std::move(chunk_);
+}
+
+Chunk Compiler::CompileExpression(const std::string& expr) {
+    AST ast{std::string_view(expr)};
+    while (ast.InsertLexema()) {}
+    ast.Analyze();
+    ast.Fold();
+
+    return Compiler(ast).Compile();
+}
+
+void Compiler::CompileSequence(const Pair* node, bool tail) {
+    if (!node) {
+        CompileConstant(Value());
+        return;
+    }
+
+    while (node->next) {
+        CompileNode(node);
+        Emit(OpCode::POP);
+        Push(-1);
+        node = node->next;
+    }
+    CompileNode(node, tail);
+}
+
+void Compiler::CompileNode(const Pair* node, bool tail) {
+    switch (node->type) {
+        case TokenType::NUM:
+            CompileConstant(node->value);
+            break;
+        case TokenType::BOOL:
+            Emit(OpCode::PUSH_BOOL, node->value.GetBool());
+            Push(1);
+            break;
+        case TokenType::NAME:
+            CompileGet(node->value.GetSymbol());
+            break;
+        case TokenType::OPEN_PARENT: {
+            auto head = node->child;
+            if (head->type == TokenType::BUILTIN) {
+                CompileForm(head, tail);
+            } else {
+                CompileCall(head, tail);
+            }
+            }
+            break;
+        default:
+            throw std::runtime_error("ERROR: Not implemented\n");
+    }
+}
+
+void Compiler::CompileForm(const Pair* head, bool tail) {
+    auto argc = head->argc;
+
+    switch (Tokenizer::ToBuiltin(head->value.GetSymbol())) {
+            // Special forms
+        case Builtins::LAMBDA:
+            CompileLambda(head->next->child, head->next->next);
+            return;
+        case Builtins::DEFINE:
+            CompileDefine(head);
+            return;
+        case Builtins::SET:
+            CompileSet(head);
+            return;
+        case Builtins::QUOTE:
+            CompileDatum(head->next);
+            return;
+
+            // Integer math
+        case Builtins::ADD:
+            CompileArgs(head);
+            Emit(OpCode::ADD, argc);
+            break;
+        case Builtins::SUB:
+            CompileArgs(head);
+            Emit(OpCode::SUB, argc);
+            break;
+        case Builtins::MUL:
+            CompileArgs(head);
+            Emit(OpCode::MUL, argc);
+            break;
+        case Builtins::DIV:
+            CompileArgs(head);
+            Emit(OpCode::DIV, argc);
+            break;
+        case Builtins::MIN:
+            CompileArgs(head);
+            Emit(OpCode::MIN, argc);
+            break;
+        case Builtins::MAX:
+            CompileArgs(head);
+            Emit(OpCode::MAX, argc);
+            break;
+        case Builtins::ABS:
+            CompileArgs(head);
+            Emit(OpCode::ABS, argc);
+            break;
+        case Builtins::EQ:
+        case Builtins::INT_EQ:
+            CompileArgs(head);
+            Emit(OpCode::EQ, argc);
+            break;
+        case Builtins::GT:
+            CompileArgs(head);
+            Emit(OpCode::GT, argc);
+            break;
+        case Builtins::LT:
+            CompileArgs(head);
+            Emit(OpCode::LT, argc);
+            break;
+        case Builtins::GEQ:
+            CompileArgs(head);
+            Emit(OpCode::GEQ, argc);
+            break;
+        case Builtins::LEQ:
+            CompileArgs(head);
+            Emit(OpCode::LEQ, argc);
+            break;
+
+            // Predicates
+        case Builtins::IS_NUMBER:
+            CompileArgs(head);
+            Emit(OpCode::IS_NUMBER, argc);
+            break;
+        case Builtins::IS_BOOLEAN:
+            CompileArgs(head);
+            Emit(OpCode::IS_BOOLEAN, argc);
+            break;
+        case Builtins::ARE_EQUAL:
+            CompileArgs(head);
+            Emit(OpCode::ARE_EQUAL, argc);
+            break;
+        case Builtins::ARE_EQ:
+            CompileArgs(head);
+            Emit(OpCode::ARE_EQ, argc);
+            break;
+        case Builtins::IS_SYMBOL:
+            CompileArgs(head);
+            Emit(OpCode::IS_SYMBOL, argc);
+            break;
+        case Builtins::IS_LIST:
+            CompileArgs(head);
+            Emit(OpCode::IS_LIST, argc);
+            break;
+        case Builtins::IS_NULL:
+            CompileArgs(head);
+            Emit(OpCode::IS_NULL, argc);
+            break;
+        case Builtins::IS_PAIR:
+            CompileArgs(head);
+            Emit(OpCode::IS_PAIR, argc);
+            break;
+
+            // Logic
+        case Builtins::IF:
+            CompileIf(head, argc, tail);
+            return;
+        case Builtins::NOT:
+            CompileArgs(head);
+            Emit(OpCode::NOT, argc);
+            break;
+        case Builtins::AND:
+            CompileLogic(head, true);
+            return;
+        case Builtins::OR:
+            CompileLogic(head, false);
+            return;
+
+            // List functions
+        case Builtins::CONS:
+            CompileArgs(head);
+            Emit(OpCode::CONS, argc);
+            break;
+        case Builtins::CAR:
+            CompileArgs(head);
+            Emit(OpCode::CAR, argc);
+            break;
+        case Builtins::CDR:
+            CompileArgs(head);
+            Emit(OpCode::CDR, argc);
+            break;
+        case Builtins::SET_CAR:
+            CompileArgs(head);
+            Emit(OpCode::SET_CAR, argc);
+            break;
+        case Builtins::SET_CDR:
+            CompileArgs(head);
+            Emit(OpCode::SET_CDR, argc);
+            break;
+        case Builtins::LIST:
+            CompileArgs(head);
+            Emit(OpCode::LIST, argc);
+            break;
+        case Builtins::LIST_REF:
+            CompileArgs(head);
+            Emit(OpCode::LIST_REF, argc);
+            break;
+        case Builtins::LIST_TAIL:
+            CompileArgs(head);
+            Emit(OpCode::LIST_TAIL, argc);
+            break;
+
+            // Parallel
+        case Builtins::PMAP:
+            CompileArgs(head);
+            Emit(OpCode::PMAP, argc);
+            break;
+        case Builtins::PFOR_EACH:
+            CompileArgs(head);
+            Emit(OpCode::PFOR_EACH, argc);
+            break;
+        case Builtins::PREDUCE:
+            CompileArgs(head);
+            Emit(OpCode::PREDUCE, argc);
+            break;
+
+            // Green threads
+        case Builtins::SPAWN:
+            CompileArgs(head);
+            Emit(OpCode::SPAWN, argc);
+            break;
+        case Builtins::CHANNEL:
+            CompileArgs(head);
+            Emit(OpCode::MAKE_CHANNEL, argc);
+            break;
+        case Builtins::SEND:
+            CompileArgs(head);
+            Emit(OpCode::SEND, argc);
+            break;
+        case Builtins::RECV:
+            CompileArgs(head);
+            Emit(OpCode::RECV, argc);
+            break;
+
+        default:
+            throw std::runtime_error("ERROR: Not implemented\n");
+    }
+
+    /* Every n-ary builtin pops its arguments and pushes one result */
+    Push(1 - static_cast<int64_t>(argc));
+}
+
+void Compiler::CompileArgs(const Pair* head) {
+    for (auto arg = head->next; arg; arg = arg->next) {
+        CompileNode(arg);
+    }
+}
+
+void Compiler::CompileConstant(Value value) {
+    chunk_.constants.push_back(value);
+    /* A boxed literal belongs to the chunk, the heap gets a copy */
+    Emit(value.IsObject() ? OpCode::PUSH_LITERAL : OpCode::PUSH_CONST,
+         chunk_.constants.size() - 1);
+    Push(1);
+}
+
+void Compiler::CompileDatum(const Pair* node) {
+    if (node->type != TokenType::OPEN_PARENT) {
+        CompileConstant(node->value);
+        return;
+    }
+
+    /* Literal lists are built when the quote runs, so chunks only ever
+     * hold immediates and can be shared by any heap */
+    uint32_t length = 0;
+    for (auto element = node->child; element; element = element->next) {
+        if (element->type == TokenType::PAIR) {
+            CompileDatum(element->next);
+            for (uint32_t i = 0; i < length; ++i) {
+                Emit(OpCode::CONS, 2);
+                Push(-1);
+            }
+            return;
+        }
+        CompileDatum(element);
+        ++length;
+    }
+
+    Emit(OpCode::LIST, length);
+    Push(1 - static_cast<int64_t>(length));
+}
+
+void Compiler::CompileIf(const Pair* head, size_t argc, bool tail) {
+    auto condition = head->next;
+    auto true_branch = condition->next;
+    auto false_branch = true_branch->next;
+
+    CompileNode(condition);
+    auto to_false = Emit(OpCode::JUMP_IF_FALSE);
+    Push(-1);
+
+    CompileNode(true_branch, tail);
+    auto to_end = Emit(OpCode::JUMP);
+    Push(-1);
+
+    Patch(to_false);
+    if (argc == 3) {
+        CompileNode(false_branch, tail);
+    } else {
+        Emit(OpCode::NO_ELSE);
+        Push(1);
+    }
+    Patch(to_end);
+}
+
+void Compiler::CompileLogic(const Pair* head, bool is_and) {
+    /* Short circuit to the first argument deciding the result */
+    std::vector<size_t> to_decided;
+    for (auto arg = head->next; arg; arg = arg->next) {
+        CompileNode(arg);
+        to_decided.push_back(Emit(is_and ? OpCode::JUMP_IF_FALSE : OpCode::JUMP_IF_TRUE));
+        Push(-1);
+    }
+
+    Emit(OpCode::PUSH_BOOL, is_and);
+    auto to_end = Emit(OpCode::JUMP);
+
+    for (auto jump : to_decided) {
+        Patch(jump);
+    }
+    Emit(OpCode::PUSH_BOOL, !is_and);
+    Patch(to_end);
+    Push(1);
+}
+
+void Compiler::CompileCall(const Pair* head, bool tail) {
+    CompileNode(head);
+
+    uint32_t argc = 0;
+    for (auto arg = head->next; arg; arg = arg->next) {
+        CompileNode(arg);
+        ++argc;
+    }
+
+    /* The callee and its arguments are replaced by the result */
+    Emit(tail ? OpCode::TAIL_CALL : OpCode::CALL, argc);
+    Push(-static_cast<int64_t>(argc));
+}
+
+void Compiler::CompileLambda(const Pair* params, const Pair* body) {
+    auto function = std::make_shared<Function>();
+    for (auto param = params; param; param = param->next) {
+        function->params.push_back(param->value.GetSymbol());
+    }
+
+    Scope scope(scope_, params, body);
+    function->chunk = Compiler(ast_, &scope).CompileBody(body);
+    function->locals = scope.LocalCount();
+    function->captures = scope.Captures();
+
+    chunk_.functions.push_back(std::move(function));
+    Emit(OpCode::MAKE_CLOSURE, chunk_.functions.size() - 1);
+    Push(1);
+}
+
+void Compiler::CompileDefine(const Pair* head) {
+    auto target = head->next;
+
+    /* (define (name params...) body...) */
+    if (target->type == TokenType::OPEN_PARENT) {
+        auto name = target->child;
+        CompileLambda(name->next, target->next);
+        CompileAssign(name->value.GetSymbol(), true);
+        return;
+    }
+
+    CompileNode(target->next);
+    CompileAssign(target->value.GetSymbol(), true);
+}
+
+void Compiler::CompileSet(const Pair* head) {
+    auto target = head->next;
+    CompileNode(target->next);
+    CompileAssign(target->value.GetSymbol(), false);
+}
+
+void Compiler::CompileGet(Symbol symbol) {
+    auto address = Scope::Resolve(scope_, symbol);
+    switch (address.kind) {
+        case Address::Kind::LOCAL:
+            Emit(address.boxed ? OpCode::GET_BOXED_LOCAL : OpCode::GET_LOCAL, address.index);
+            break;
+        case Address::Kind::FREE:
+            Emit(address.boxed ? OpCode::GET_BOXED_FREE : OpCode::GET_FREE, address.index);
+            break;
+        case Address::Kind::GLOBAL:
+            Emit(OpCode::GET_GLOBAL, AddGlobalSite(symbol));
+            break;
+    }
+    Push(1);
+}
+
+void Compiler::CompileAssign(Symbol symbol, bool define) {
+    /* Defines in a lambda body have a frame slot of their own */
+    auto address = Scope::Resolve(scope_, symbol);
+    switch (address.kind) {
+        case Address::Kind::LOCAL:
+            Emit(address.boxed ? OpCode::SET_BOXED_LOCAL : OpCode::SET_LOCAL, address.index);
+            break;
+        case Address::Kind::FREE:
+            /* Captured variables that get assigned are always boxed */
+            Emit(OpCode::SET_BOXED_FREE, address.index);
+            break;
+        case Address::Kind::GLOBAL:
+            if (define) {
+                Emit(OpCode::DEFINE_GLOBAL, symbol);
+            } else {
+                Emit(OpCode::SET_GLOBAL, AddGlobalSite(symbol));
+            }
+            break;
+    }
+}
+
+size_t Compiler::Emit(OpCode op, uint32_t arg) {
+    chunk_.code.push_back({op, arg});
+    return chunk_.code.size() - 1;
+}
+
+uint32_t Compiler::AddGlobalSite(Symbol symbol) {
+    chunk_.globals.emplace_back(symbol);
+    return chunk_.globals.size() - 1;
+}
+
+void Compiler::Patch(size_t jump) {
+    chunk_.code[jump].arg = chunk_.code.size();
+}
+
+void Compiler::Push(int64_t count) {
+    depth_ += count;
+    if (depth_ > static_cast<int64_t>(chunk_.max_stack)) {
+        chunk_.max_stack = depth_;
+    }
+}
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include "lisp.h"
+#include "numbers.h"
+
+namespace {
+
+using Builtins = Tokenizer::Builtins;
+
+bool IsPure(Builtins builtin) {
+    switch (builtin) {
+        case Builtins::ADD:
+        case Builtins::SUB:
+        case Builtins::MUL:
+        case Builtins::DIV:
+        case Builtins::MIN:
+        case Builtins::MAX:
+        case Builtins::ABS:
+        case Builtins::EQ:
+        case Builtins::INT_EQ:
+        case Builtins::GT:
+        case Builtins::LT:
+        case Builtins::GEQ:
+        case Builtins::LEQ:
+        case Builtins::NOT:
+        case Builtins::AND:
+        case Builtins::OR:
+        case Builtins::IS_NUMBER:
+        case Builtins::IS_BOOLEAN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Integer math as the backends do it, but giving up instead of throwing
+ * or overflowing, so whatever would fail is left to fail at run time */
+bool Reduce(Builtins builtin, int64_t lhs, int64_t rhs, int64_t* result) {
+    switch (builtin) {
+        case Builtins::ADD:
+            return !__builtin_add_overflow(lhs, rhs, result);
+        case Builtins::SUB:
+            return !__builtin_sub_overflow(lhs, rhs, result);
+        case Builtins::MUL:
+            return !__builtin_mul_overflow(lhs, rhs, result);
+        case Builtins::DIV:
+            /* A fraction would be a heap object */
+            if (!rhs || lhs % rhs) {
+                return false;
+            }
+            *result = lhs / rhs;
+            return true;
+        case Builtins::MIN:
+            *result = std::min(lhs, rhs);
+            return true;
+        case Builtins::MAX:
+            *result = std::max(lhs, rhs);
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Compare(Builtins builtin, int64_t lhs, int64_t rhs) {
+    switch (builtin) {
+        case Builtins::GT:
+            return lhs > rhs;
+        case Builtins::LT:
+            return lhs < rhs;
+        case Builtins::GEQ:
+            return lhs >= rhs;
+        case Builtins::LEQ:
+            return lhs <= rhs;
+        default:
+            return lhs == rhs;
+    }
+}
+
+/* The value of a pure builtin applied to constants, false if it has to be
+ * left to run time */
+bool Apply(Builtins builtin, const std::vector<Value>& args, Value* result) {
+    switch (builtin) {
+        case Builtins::NOT:
+            *result = Value::MakeBool(args[0].IsFalse());
+            return true;
+        case Builtins::IS_NUMBER:
+            *result = Value::MakeBool(IsNumber(args[0]));
+            return true;
+        case Builtins::IS_BOOLEAN:
+            *result = Value::MakeBool(args[0].IsBool());
+            return true;
+        case Builtins::AND:
+        case Builtins::OR: {
+            bool is_and = builtin == Builtins::AND;
+            auto decided = std::find_if(args.begin(), args.end(), [is_and](Value arg) {
+                return arg.IsFalse() == is_and;
+            });
+            *result = Value::MakeBool(decided == args.end() ? is_and : !is_and);
+            return true;
+            }
+        default:
+            break;
+    }
+
+    /* Type errors are raised at run time, with the operands evaluated,
+     * and only fixnums are folded */
+    for (auto arg : args) {
+        if (!arg.IsFixnum()) {
+            return false;
+        }
+    }
+
+    switch (builtin) {
+        case Builtins::EQ:
+        case Builtins::INT_EQ:
+        case Builtins::GT:
+        case Builtins::LT:
+        case Builtins::GEQ:
+        case Builtins::LEQ: {
+            bool holds = true;
+            for (size_t i = 1; i < args.size() && holds; ++i) {
+                holds = Compare(builtin, args[i - 1].GetFixnum(), args[i].GetFixnum());
+            }
+            *result = Value::MakeBool(holds);
+            return true;
+            }
+        case Builtins::ABS: {
+            auto value = args[0].GetFixnum();
+            if (!Value::FitsFixnum(-value)) {
+                return false;
+            }
+            *result = Value::MakeFixnum(value > 0 ? value : -value);
+            return true;
+            }
+        default:
+            break;
+    }
+
+    int64_t res = builtin == Builtins::ADD ? 0 : builtin == Builtins::MUL ? 1
+                : builtin == Builtins::MIN ? INT64_MAX : builtin == Builtins::MAX ? INT64_MIN
+                : args[0].GetFixnum();
+    bool leading = builtin == Builtins::SUB || builtin == Builtins::DIV;
+    for (size_t i = leading; i < args.size(); ++i) {
+        if (!Reduce(builtin, res, args[i].GetFixnum(), &res)) {
+            return false;
+        }
+    }
+
+    if (!Value::FitsFixnum(res)) {
+        return false;
+    }
+    *result = Value::MakeFixnum(res);
+    return true;
+}
+
+}
+
+size_t AST::Fold() {
+    size_t folded = 0;
+    FoldBody(root_, &folded);
+    return folded;
+}
+
+void AST::FoldBody(Pair* body, size_t* folded) {
+    for (auto node = body; node; node = node->next) {
+        FoldNode(node, folded);
+    }
+}
+
+void AST::FoldNode(Pair* node, size_t* folded) {
+    if (node->type != TokenType::OPEN_PARENT || !node->child) {
+        return;
+    }
+
+    auto head = node->child;
+    if (head->type != TokenType::BUILTIN) {
+        FoldBody(head, folded);
+        return;
+    }
+
+    auto builtin = ToBuiltin(head->value.GetSymbol());
+    auto target = head->next;
+    switch (builtin) {
+        case Builtins::QUOTE:
+            return;
+        case Builtins::LAMBDA:
+            FoldBody(target->next, folded);
+            return;
+        case Builtins::DEFINE:
+        case Builtins::SET:
+            FoldBody(target->next, folded);
+            return;
+        case Builtins::IF:
+            FoldBody(target, folded);
+            FoldIf(node, folded);
+            return;
+        default:
+            break;
+    }
+
+    FoldBody(target, folded);
+    if (!IsPure(builtin)) {
+        return;
+    }
+
+    std::vector<Value> args;
+    for (auto arg = target; arg; arg = arg->next) {
+        if (!IsConstant(arg)) {
+            if (builtin == Builtins::ADD || builtin == Builtins::MUL) {
+                FoldOperands(head, folded);
+            }
+            return;
+        }
+        args.push_back(arg->value);
+    }
+
+    Value result;
+    if (Apply(builtin, args, &result)) {
+        ReplaceWithConstant(node, result);
+        ++*folded;
+    }
+}
+
+void AST::FoldIf(Pair* node, size_t* folded) {
+    auto head = node->child;
+    auto condition = head->next;
+    if (!IsConstant(condition)) {
+        return;
+    }
+
+    auto branch = condition->value.IsFalse() ? condition->next->next : condition->next;
+    /* A missing else part is an error to raise at run time, and a define
+     * has to stay where the scope of the body expects it */
+    if (!branch || (branch->type == TokenType::OPEN_PARENT && branch->child &&
+                    branch->child->type == TokenType::BUILTIN &&
+                    ToBuiltin(branch->child->value.GetSymbol()) == Builtins::DEFINE)) {
+        return;
+    }
+
+    auto next = node->next;
+    *node = *branch;
+    node->next = next;
+    ++*folded;
+}
+
+void AST::FoldOperands(Pair* head, size_t* folded) {
+    auto builtin = ToBuiltin(head->value.GetSymbol());
+
+    /* Only the constants leading the operands are combined: a flonum
+     * coming later would round differently once they are summed up front,
+     * and anything that is not a number fails the call whatever the order */
+    auto first = head->next;
+    size_t constants = 0;
+    for (auto arg = first; arg && IsConstant(arg); arg = arg->next) {
+        if (!arg->value.IsFixnum()) {
+            return;
+        }
+        ++constants;
+    }
+    if (constants < 2) {
+        return;
+    }
+
+    auto res = first->value.GetFixnum();
+    auto arg = first->next;
+    for (size_t i = 1; i < constants; ++i, arg = arg->next) {
+        if (!Reduce(builtin, res, arg->value.GetFixnum(), &res)) {
+            return;
+        }
+    }
+    if (!Value::FitsFixnum(res)) {
+        return;
+    }
+
+    first->value = Value::MakeFixnum(res);
+    first->next = arg;
+    head->argc -= constants - 1;
+    ++*folded;
+}
+
+bool AST::IsConstant(const Pair* node) {
+    return node->type == TokenType::NUM || node->type == TokenType::BOOL;
+}
+
+void AST::ReplaceWithConstant(Pair* node, Value value) {
+    node->type = value.IsBool() ? TokenType::BOOL : TokenType::NUM;
+    node->value = value;
+}
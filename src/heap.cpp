@@ -0,0 +1,612 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <tuple>
+#include <unordered_set>
+#include "heap.h"
+#include "numbers.h"
+
+namespace {
+
+Cell* NextFree(const Cell* cell) {
+    Cell* next;
+    std::memcpy(&next, cell, sizeof(next));
+    return next;
+}
+
+void SetNextFree(Cell* cell, Cell* next) {
+    std::memcpy(static_cast<void*>(cell), &next, sizeof(next));
+}
+
+/* Old cells a thread takes from the heap at once in a parallel section */
+constexpr size_t kParallelCellBatch = 256;
+/* Bytes a thread allocates in a parallel section before it tells the heap */
+constexpr size_t kParallelBytesBatch = size_t(64) << 10;
+
+std::atomic<uint64_t> next_section{0};
+
+/* The space the thread allocated from last, valid while section matches */
+thread_local struct {
+    uint64_t section = 0;
+    void* space = nullptr;
+} local_space;
+
+enum class Comparison {
+    EQUAL,
+    DIFFERENT,
+    UNDECIDED
+};
+
+/* Cells walked before Equal starts looking for cycles */
+constexpr size_t kUncheckedCells = 1 << 16;
+
+struct CellPairHash {
+    size_t operator()(const std::pair<const Cell*, const Cell*>& cells) const {
+        auto hash = std::hash<const Cell*>();
+        return hash(cells.first) * 31 + hash(cells.second);
+    }
+};
+
+using CellPairs = std::unordered_set<std::pair<const Cell*, const Cell*>, CellPairHash>;
+
+/* Walks both sides together with a stack of its own, lists nest as deep as
+ * the heap lets them. Without compared gives up after kUncheckedCells
+ * cells. With it, cells met again are taken as equal, as they were
+ * compared already or are being compared, which ends the walk on cycles. */
+Comparison Compare(Value lhs, Value rhs, CellPairs* compared) {
+    /* Cars that are pairs on both sides, compared once the cdrs are */
+    std::vector<std::pair<Value, Value>> pending;
+    size_t cells = 0;
+    for (;;) {
+        bool again = false;
+        while (lhs != rhs && lhs.IsPair() && rhs.IsPair()) {
+            if (!compared && ++cells > kUncheckedCells) {
+                return Comparison::UNDECIDED;
+            }
+            if (compared && !compared->emplace(lhs.GetCell(), rhs.GetCell()).second) {
+                again = true;
+                break;
+            }
+
+            auto left = lhs.GetCell()->car;
+            auto right = rhs.GetCell()->car;
+            if (left.IsPair() && right.IsPair()) {
+                pending.emplace_back(left, right);
+            } else if (left != right && !NumberEqv(left, right)) {
+                return Comparison::DIFFERENT;
+            }
+            lhs = lhs.GetCell()->cdr;
+            rhs = rhs.GetCell()->cdr;
+        }
+
+        /* Boxed numbers are never shared, equal ones are compared by value */
+        if (!again && lhs != rhs && !NumberEqv(lhs, rhs)) {
+            return Comparison::DIFFERENT;
+        }
+        if (pending.empty()) {
+            return Comparison::EQUAL;
+        }
+        std::tie(lhs, rhs) = pending.back();
+        pending.pop_back();
+    }
+}
+
+}
+
+uint64_t Environment::NextSerial() {
+    static std::atomic<uint64_t> serial{0};
+    return ++serial;
+}
+
+bool IsList(Value value) {
+    /* The slow walker moves half as fast and meets the fast one on a cycle */
+    auto slow = value;
+    while (value.IsPair()) {
+        value = value.GetCell()->cdr;
+        if (!value.IsPair()) {
+            break;
+        }
+        value = value.GetCell()->cdr;
+        slow = slow.GetCell()->cdr;
+        if (value == slow) {
+            return false;
+        }
+    }
+
+    return value.IsNil();
+}
+
+bool Equal(Value lhs, Value rhs) {
+    auto outcome = Compare(lhs, rhs, nullptr);
+    if (outcome == Comparison::UNDECIDED) {
+        CellPairs compared;
+        outcome = Compare(lhs, rhs, &compared);
+    }
+    return outcome == Comparison::EQUAL;
+}
+
+Value ListTail(Value list, int64_t k) {
+    if (k < 0) {
+        throw std::runtime_error("ERROR: Index out of range\n");
+    }
+
+    for (; k > 0; --k) {
+        if (!list.IsPair()) {
+            throw std::runtime_error("ERROR: Index out of range\n");
+        }
+        list = list.GetCell()->cdr;
+    }
+
+    return list;
+}
+
+Value ListRef(Value list, int64_t k) {
+    auto tail = ListTail(list, k);
+    if (!tail.IsPair()) {
+        throw std::runtime_error("ERROR: Index out of range\n");
+    }
+
+    return tail.GetCell()->car;
+}
+
+Heap::Heap(size_t min_threshold, double growth_factor, size_t nursery_bytes)
+        : nursery_(nullptr)
+        , top_(nullptr)
+        , end_(nullptr)
+        , nursery_capacity_(0)
+        , nursery_bytes_(nursery_bytes)
+        , minor_(false)
+        , free_cells_(nullptr)
+        , next_root_id_(0)
+        , parallel_(false)
+        , section_(0)
+        , nursery_end_(nullptr)
+        , section_bytes_(0)
+        , section_room_(0)
+        , min_threshold_(min_threshold)
+        , growth_factor_(growth_factor) {
+    stats_.threshold = min_threshold_;
+}
+
+Heap::~Heap() {
+    for (auto object : objects_) {
+        delete object;
+    }
+    for (auto chunk : cell_chunks_) {
+        std::free(chunk);
+    }
+    std::free(nursery_);
+}
+
+size_t Heap::AddRoots(RootScanner scanner) {
+    std::lock_guard<std::mutex> lock(roots_mutex_);
+    roots_.emplace_back(next_root_id_, std::move(scanner));
+    return next_root_id_++;
+}
+
+void Heap::RemoveRoots(size_t id) {
+    std::lock_guard<std::mutex> lock(roots_mutex_);
+    roots_.erase(std::remove_if(roots_.begin(), roots_.end(),
+                                [id](const std::pair<size_t, RootScanner>& root) {
+                                    return root.first == id;
+                                }),
+                 roots_.end());
+}
+
+void Heap::Mark(Object* object) {
+    /* Objects never move and a minor collection only follows pointers
+     * into the nursery */
+    if (!object || object->marked || minor_) {
+        return;
+    }
+
+    object->marked = true;
+    gray_.push_back(object);
+}
+
+void Heap::Mark(Value& value) {
+    if (value.IsObject()) {
+        Mark(value.GetObject());
+    } else if (!value.IsPair()) {
+        return;
+    } else if (!minor_) {
+        MarkCell(value.GetCell());
+    } else if (IsYoung(value)) {
+        value = Value::MakePair(Promote(value.GetCell()));
+    }
+}
+
+void Heap::CollectNursery() {
+    if (parallel_) {
+        return;
+    }
+    if (!nursery_) {
+        nursery_capacity_ = std::max<size_t>(nursery_bytes_ / sizeof(Cell), 1);
+        nursery_ = static_cast<Cell*>(
+                std::aligned_alloc(alignof(Cell), nursery_capacity_ * sizeof(Cell)));
+        if (!nursery_) {
+            nursery_capacity_ = 0;
+            throw std::bad_alloc();
+        }
+        top_ = nursery_;
+        end_ = nursery_ + nursery_capacity_;
+        return;
+    }
+    if (top_ == nursery_) {
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    /* Cheney style, except that the promoted cells to scan are kept on a
+     * stack as the old space is not contiguous */
+    minor_ = true;
+    for (auto& root : roots_) {
+        root.second(*this);
+    }
+    for (auto object : remembered_objects_) {
+        object->remembered = false;
+        Trace(object);
+    }
+    for (auto cell : remembered_cells_) {
+        ChunkOf(cell)->remembered[IndexOf(cell) / 64] &= ~(uint64_t(1) << IndexOf(cell) % 64);
+        Trace(cell);
+    }
+    remembered_objects_.clear();
+    remembered_cells_.clear();
+    while (!promoted_.empty()) {
+        auto cell = promoted_.back();
+        promoted_.pop_back();
+        Trace(cell);
+    }
+    minor_ = false;
+    top_ = nursery_;
+
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start);
+    ++stats_.minor_collections;
+    stats_.last_minor_pause = pause;
+    stats_.max_minor_pause = std::max(stats_.max_minor_pause, pause);
+    stats_.total_minor_pause += pause;
+}
+
+void Heap::Collect() {
+    if (parallel_) {
+        return;
+    }
+
+    /* Nothing is young afterwards, so marking only sees the old space */
+    if (top_ != nursery_) {
+        CollectNursery();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    /* Mark with explicit stacks, environment chains and lists can be long */
+    for (auto& root : roots_) {
+        root.second(*this);
+    }
+    while (!gray_.empty() || !gray_cells_.empty()) {
+        if (!gray_.empty()) {
+            auto object = gray_.back();
+            gray_.pop_back();
+            Trace(object);
+        } else {
+            auto cell = gray_cells_.back();
+            gray_cells_.pop_back();
+            Trace(cell);
+        }
+    }
+
+    size_t live = 0;
+    size_t live_bytes = 0;
+    for (auto object : objects_) {
+        if (object->marked) {
+            object->marked = false;
+            objects_[live++] = object;
+            live_bytes += SizeOf(object);
+        } else {
+            delete object;
+        }
+    }
+
+    stats_.freed_objects += objects_.size() - live;
+    objects_.resize(live);
+    stats_.objects = live;
+    SweepCells();
+    stats_.bytes = live_bytes + stats_.cells * sizeof(Cell);
+    stats_.threshold = std::max(min_threshold_, static_cast<size_t>(stats_.bytes * growth_factor_));
+
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start);
+    ++stats_.collections;
+    stats_.last_pause = pause;
+    stats_.max_pause = std::max(stats_.max_pause, pause);
+    stats_.total_pause += pause;
+}
+
+void Heap::SetThreshold(size_t min_threshold, double growth_factor) {
+    min_threshold_ = min_threshold;
+    growth_factor_ = growth_factor;
+    stats_.threshold = std::max(min_threshold_, static_cast<size_t>(stats_.bytes * growth_factor_));
+}
+
+void Heap::SetNurserySize(size_t bytes) {
+    CollectNursery();
+    std::free(nursery_);
+    nursery_ = top_ = end_ = nullptr;
+    nursery_capacity_ = 0;
+    nursery_bytes_ = bytes;
+}
+
+void Heap::BeginParallel() {
+    CollectNursery();
+    nursery_end_ = end_;
+    end_ = top_;
+    section_ = ++next_section;
+    section_room_ =
+            std::max(nursery_bytes_, stats_.threshold - std::min(stats_.bytes, stats_.threshold));
+    parallel_ = true;
+}
+
+void Heap::EndParallel() {
+    parallel_ = false;
+    end_ = nursery_end_;
+
+    for (auto& space : spaces_) {
+        objects_.insert(objects_.end(), space->objects.begin(), space->objects.end());
+        stats_.objects += space->objects.size();
+        stats_.cells += space->cells;
+        stats_.bytes += space->bytes;
+        while (space->free_cells) {
+            auto cell = space->free_cells;
+            space->free_cells = NextFree(cell);
+            SetNextFree(cell, free_cells_);
+            free_cells_ = cell;
+        }
+    }
+    spaces_.clear();
+    section_bytes_ = 0;
+}
+
+Heap::LocalSpace& Heap::Local() {
+    if (local_space.section == section_) {
+        return *static_cast<LocalSpace*>(local_space.space);
+    }
+
+    std::lock_guard<std::mutex> lock(parallel_mutex_);
+    auto owner = std::this_thread::get_id();
+    auto found = std::find_if(spaces_.begin(), spaces_.end(),
+                              [owner](const std::unique_ptr<LocalSpace>& space) {
+                                  return space->owner == owner;
+                              });
+    if (found == spaces_.end()) {
+        spaces_.push_back(std::make_unique<LocalSpace>());
+        spaces_.back()->owner = owner;
+        found = spaces_.end() - 1;
+    }
+
+    local_space.section = section_;
+    local_space.space = found->get();
+    return **found;
+}
+
+void Heap::AddParallelObject(Object* object, size_t bytes) {
+    auto& space = Local();
+    space.objects.push_back(object);
+    CountParallelBytes(space, bytes);
+}
+
+void Heap::AddParallelBytes(size_t bytes) {
+    CountParallelBytes(Local(), bytes);
+}
+
+void Heap::CountParallelBytes(LocalSpace& space, size_t bytes) {
+    space.bytes += bytes;
+    space.uncounted += bytes;
+    if (space.uncounted >= kParallelBytesBatch) {
+        section_bytes_.fetch_add(space.uncounted, std::memory_order_relaxed);
+        space.uncounted = 0;
+    }
+}
+
+Cell* Heap::AllocateParallelCell() {
+    auto& space = Local();
+    if (!space.free_cells) {
+        std::lock_guard<std::mutex> lock(parallel_mutex_);
+        for (size_t i = 0; i < kParallelCellBatch; ++i) {
+            if (!free_cells_) {
+                AddCellChunk();
+            }
+            auto cell = free_cells_;
+            free_cells_ = NextFree(cell);
+            SetNextFree(cell, space.free_cells);
+            space.free_cells = cell;
+        }
+    }
+
+    auto cell = space.free_cells;
+    space.free_cells = NextFree(cell);
+    ++space.cells;
+    CountParallelBytes(space, sizeof(Cell));
+    return cell;
+}
+
+Cell* Heap::NewOldCell(Value car, Value cdr) {
+    auto cell = new (AllocateOldCell()) Cell{car, cdr};
+    if (IsYoung(car) || IsYoung(cdr)) {
+        RememberCell(cell);
+    }
+
+    return cell;
+}
+
+Cell* Heap::AllocateOldCell() {
+    if (parallel_) {
+        return AllocateParallelCell();
+    }
+    if (!free_cells_) {
+        AddCellChunk();
+    }
+
+    auto cell = free_cells_;
+    free_cells_ = NextFree(cell);
+    ++stats_.cells;
+    stats_.bytes += sizeof(Cell);
+    return cell;
+}
+
+void Heap::AddCellChunk() {
+    auto memory = std::aligned_alloc(kCellChunkBytes, kCellChunkBytes);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+
+    auto chunk = new (memory) CellChunk();
+    cell_chunks_.push_back(chunk);
+
+    /* Handed out in address order */
+    auto cells = static_cast<Cell*>(memory);
+    for (size_t i = kCellsPerChunk; i-- > kFirstCell;) {
+        SetNextFree(&cells[i], free_cells_);
+        free_cells_ = &cells[i];
+    }
+}
+
+void Heap::RememberCell(Cell* cell) {
+    auto& word = ChunkOf(cell)->remembered[IndexOf(cell) / 64];
+    auto bit = uint64_t(1) << IndexOf(cell) % 64;
+    if (!(word & bit)) {
+        word |= bit;
+        remembered_cells_.push_back(cell);
+    }
+}
+
+Cell* Heap::Promote(Cell* cell) {
+    if (cell->car.IsMoved()) {
+        return cell->cdr.GetCell();
+    }
+
+    auto copy = new (AllocateOldCell()) Cell(*cell);
+    cell->car = Value::MakeMoved();
+    cell->cdr = Value::MakePair(copy);
+    promoted_.push_back(copy);
+    ++stats_.promoted_cells;
+    return copy;
+}
+
+void Heap::MarkCell(Cell* cell) {
+    auto& word = ChunkOf(cell)->marks[IndexOf(cell) / 64];
+    auto bit = uint64_t(1) << IndexOf(cell) % 64;
+    if (!(word & bit)) {
+        word |= bit;
+        gray_cells_.push_back(cell);
+    }
+}
+
+void Heap::SweepCells() {
+    size_t live = 0;
+    size_t kept = 0;
+    free_cells_ = nullptr;
+    for (auto chunk : cell_chunks_) {
+        auto cells = reinterpret_cast<Cell*>(chunk);
+        Cell* head = nullptr;
+        Cell* tail = nullptr;
+        size_t chunk_live = 0;
+        for (size_t i = kCellsPerChunk; i-- > kFirstCell;) {
+            if (chunk->marks[i / 64] >> i % 64 & 1) {
+                ++chunk_live;
+                continue;
+            }
+            SetNextFree(&cells[i], head);
+            head = &cells[i];
+            if (!tail) {
+                tail = head;
+            }
+        }
+        std::memset(chunk->marks, 0, sizeof(chunk->marks));
+
+        /* Chunks with nothing left go back to the system */
+        if (!chunk_live) {
+            std::free(chunk);
+            continue;
+        }
+        if (head) {
+            SetNextFree(tail, free_cells_);
+            free_cells_ = head;
+        }
+        live += chunk_live;
+        cell_chunks_[kept++] = chunk;
+    }
+
+    cell_chunks_.resize(kept);
+    stats_.freed_cells += stats_.cells - live;
+    stats_.cells = live;
+}
+
+void Heap::Trace(Cell* cell) {
+    Mark(cell->car);
+    Mark(cell->cdr);
+}
+
+void Heap::Trace(Object* object) {
+    switch (object->type) {
+        case ObjectType::ENVIRONMENT: {
+            auto env = static_cast<Environment*>(object);
+            for (auto& variable : env->variables) {
+                Mark(variable.second.value);
+            }
+            }
+            break;
+        case ObjectType::CLOSURE:
+            for (auto& value : static_cast<Closure*>(object)->free) {
+                Mark(value);
+            }
+            break;
+        case ObjectType::BOX:
+            Mark(static_cast<Box*>(object)->value);
+            break;
+        case ObjectType::RATIO:
+            Mark(static_cast<Ratio*>(object)->numerator);
+            Mark(static_cast<Ratio*>(object)->denominator);
+            break;
+        case ObjectType::CHANNEL:
+            for (auto& value : static_cast<Channel*>(object)->values) {
+                Mark(value);
+            }
+            break;
+        case ObjectType::BIGNUM:
+        case ObjectType::FLONUM:
+            break;
+    }
+}
+
+size_t Heap::SizeOf(const Object* object) {
+    switch (object->type) {
+        case ObjectType::ENVIRONMENT: {
+            auto& variables = static_cast<const Environment*>(object)->variables;
+            return sizeof(Environment) + variables.size() * Environment::kBindingBytes +
+                   variables.bucket_count() * sizeof(void*);
+            }
+        case ObjectType::CLOSURE:
+            return sizeof(Closure) +
+                   static_cast<const Closure*>(object)->free.capacity() * sizeof(Value);
+        case ObjectType::BOX:
+            return sizeof(Box);
+        case ObjectType::BIGNUM:
+            return sizeof(Bignum) +
+                   static_cast<const Bignum*>(object)->limbs.capacity() * sizeof(uint32_t);
+        case ObjectType::RATIO:
+            return sizeof(Ratio);
+        case ObjectType::FLONUM:
+            return sizeof(Flonum);
+        case ObjectType::CHANNEL: {
+            auto channel = static_cast<const Channel*>(object);
+            return sizeof(Channel) + channel->values.size() * sizeof(Value) +
+                   (channel->senders.size() + channel->receivers.size()) * sizeof(GreenThread*);
+            }
+    }
+
+    return sizeof(Object);
+}
@@ -0,0 +1,559 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "value.h"
+
+struct Function;
+struct GreenThread;
+
+enum class ObjectType : uint8_t {
+    CLOSURE,
+    ENVIRONMENT,
+    BOX,
+    BIGNUM,
+    RATIO,
+    FLONUM,
+    CHANNEL
+};
+
+/* Header of everything the VM allocates, referenced from Values by pointer */
+struct alignas(8) Object {
+    explicit Object(ObjectType type)
+            : type(type)
+            , marked(false)
+            , remembered(false) {}
+
+    virtual ~Object() = default;
+
+    ObjectType type;
+    /* Reachable from a root in the current collection */
+    bool marked;
+    /* May point into the nursery, listed for the next minor collection */
+    bool remembered;
+};
+
+/* A cons cell has no header, two of them fit a cache line */
+struct alignas(16) Cell {
+    Value car;
+    Value cdr;
+};
+
+/* A global variable, which stays at its address once defined */
+struct Binding {
+    Value value;
+    /* Bumped by every define and set! of the variable */
+    uint64_t version = 0;
+};
+
+/* Inline cache of one reference to a global in compiled code. It hits
+ * while the environment and the version of the binding are the ones it
+ * was filled for, and looks the symbol up again otherwise.
+ *
+ * The threads of a parallel section run the same code, so the fields are
+ * atomics: globals cannot change during a section, every thread filling
+ * the site stores the same binding, and environment is stored last. The
+ * counters are not exact while threads share the site. */
+struct GlobalSite {
+    explicit GlobalSite(Symbol symbol)
+            : symbol(symbol) {}
+
+    GlobalSite(const GlobalSite& other)
+            : symbol(other.symbol)
+            , environment(other.environment.load(std::memory_order_relaxed))
+            , binding(other.binding.load(std::memory_order_relaxed))
+            , version(other.version.load(std::memory_order_relaxed))
+            , hits(other.hits.load(std::memory_order_relaxed))
+            , misses(other.misses.load(std::memory_order_relaxed)) {}
+
+    Symbol symbol;
+    /* Serial of the environment binding lives in, 0 while empty */
+    std::atomic<uint64_t> environment{0};
+    std::atomic<Binding*> binding{nullptr};
+    std::atomic<uint64_t> version{0};
+
+    std::atomic<size_t> hits{0};
+    std::atomic<size_t> misses{0};
+};
+
+/* A plain increment, losing counts when threads race is fine for statistics */
+inline void Count(std::atomic<size_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+/* The global variables, looked up by symbol. Locals live in frame slots
+ * resolved at compile time. */
+struct Environment : Object {
+    Environment()
+            : Object(ObjectType::ENVIRONMENT)
+            , serial(NextSerial()) {}
+
+    /* nullptr if unbound */
+    Binding* Find(Symbol symbol) {
+        auto found = variables.find(symbol);
+        return found == variables.end() ? nullptr : &found->second;
+    }
+
+    /* Through the cache of the site, nullptr if unbound */
+    Binding* Find(GlobalSite& site) {
+        if (site.environment.load(std::memory_order_acquire) == serial) {
+            auto binding = site.binding.load(std::memory_order_relaxed);
+            if (binding->version == site.version.load(std::memory_order_relaxed)) {
+                Count(site.hits);
+                return binding;
+            }
+        }
+
+        Count(site.misses);
+        auto binding = Find(site.symbol);
+        if (binding) {
+            site.binding.store(binding, std::memory_order_relaxed);
+            site.version.store(binding->version, std::memory_order_relaxed);
+            site.environment.store(serial, std::memory_order_release);
+        }
+        return binding;
+    }
+
+    /* True if symbol was not bound before */
+    bool Define(Symbol symbol, Value value) {
+        auto size = variables.size();
+        auto& binding = variables[symbol];
+        binding.value = value;
+        ++binding.version;
+        return variables.size() != size;
+    }
+
+    /* The site assigning keeps its cache */
+    static void Assign(Binding* binding, GlobalSite& site, Value value) {
+        binding->value = value;
+        site.version.store(++binding->version, std::memory_order_relaxed);
+    }
+
+    /* Unique for the process, so caches filled for an environment that is
+     * gone never hit another one at the same address */
+    static uint64_t NextSerial();
+
+    /* About what a binding takes in variables, its node and its bucket */
+    static constexpr size_t kBindingBytes =
+            sizeof(std::pair<const Symbol, Binding>) + 2 * sizeof(void*);
+
+    const uint64_t serial;
+    std::unordered_map<Symbol, Binding> variables;
+};
+
+/* Flat closure, holding the values of the variables it uses from the
+ * enclosing lambdas rather than their frames */
+struct Closure : Object {
+    explicit Closure(std::shared_ptr<const Function> function)
+            : Object(ObjectType::CLOSURE)
+            , function(std::move(function)) {}
+
+    /* Shared with the chunk that created it, which may be gone already */
+    std::shared_ptr<const Function> function;
+    /* In the order of Function::captures */
+    std::vector<Value> free;
+};
+
+/* A variable assigned after closures captured it, shared by all of them
+ * and the frame defining it */
+struct Box : Object {
+    explicit Box(Value value)
+            : Object(ObjectType::BOX)
+            , value(value) {}
+
+    Value value;
+};
+
+/* An integer out of the fixnum range, which arithmetic returns to a fixnum
+ * as soon as the result fits again */
+struct Bignum : Object {
+    Bignum(bool negative, std::vector<uint32_t> limbs)
+            : Object(ObjectType::BIGNUM)
+            , negative(negative)
+            , limbs(std::move(limbs)) {}
+
+    bool negative;
+    /* Magnitude, least significant first, with no leading zero limb */
+    std::vector<uint32_t> limbs;
+};
+
+/* An exact fraction in lowest terms, the denominator is above one and
+ * both are fixnums or bignums */
+struct Ratio : Object {
+    Ratio(Value numerator, Value denominator)
+            : Object(ObjectType::RATIO)
+            , numerator(numerator)
+            , denominator(denominator) {}
+
+    Value numerator;
+    Value denominator;
+};
+
+/* A double too large, too small or not finite for an immediate flonum */
+struct Flonum : Object {
+    explicit Flonum(double value)
+            : Object(ObjectType::FLONUM)
+            , value(value) {}
+
+    double value;
+};
+
+/* A bounded queue between green threads. Those waiting for room or for
+ * a value are parked on it until the other side makes progress. */
+struct Channel : Object {
+    explicit Channel(size_t capacity)
+            : Object(ObjectType::CHANNEL)
+            , capacity(capacity) {}
+
+    size_t capacity;
+    std::deque<Value> values;
+    std::deque<GreenThread*> senders;
+    std::deque<GreenThread*> receivers;
+};
+
+inline Bignum* AsBignum(Value value) {
+    if (!value.IsObject() || value.GetObject()->type != ObjectType::BIGNUM) {
+        return nullptr;
+    }
+
+    return static_cast<Bignum*>(value.GetObject());
+}
+
+inline Ratio* AsRatio(Value value) {
+    if (!value.IsObject() || value.GetObject()->type != ObjectType::RATIO) {
+        return nullptr;
+    }
+
+    return static_cast<Ratio*>(value.GetObject());
+}
+
+inline Flonum* AsFlonum(Value value) {
+    if (!value.IsObject() || value.GetObject()->type != ObjectType::FLONUM) {
+        return nullptr;
+    }
+
+    return static_cast<Flonum*>(value.GetObject());
+}
+
+inline Channel* AsChannel(Value value) {
+    if (!value.IsObject() || value.GetObject()->type != ObjectType::CHANNEL) {
+        return nullptr;
+    }
+
+    return static_cast<Channel*>(value.GetObject());
+}
+
+inline Closure* AsClosure(Value value) {
+    if (!value.IsObject() || value.GetObject()->type != ObjectType::CLOSURE) {
+        return nullptr;
+    }
+
+    return static_cast<Closure*>(value.GetObject());
+}
+
+/* For slots the compiler knows to hold a box */
+inline Box* GetBox(Value value) {
+    return static_cast<Box*>(value.GetObject());
+}
+
+/* List operations both backends share */
+inline Cell* CheckPair(Value value) {
+    if (!value.IsPair()) {
+        throw std::runtime_error("ERROR: Expected a pair\n");
+    }
+
+    return value.GetCell();
+}
+
+/* Proper lists only, a cycle is not a list */
+bool IsList(Value value);
+/* Structural for pairs, by value for boxed numbers, identity for everything else */
+bool Equal(Value lhs, Value rhs);
+Value ListTail(Value list, int64_t k);
+Value ListRef(Value list, int64_t k);
+
+struct HeapStats {
+    size_t objects = 0;
+    /* Cells in the old space */
+    size_t cells = 0;
+    /* Objects with what their containers own and old cells. Containers
+     * growing are charged as they do, collections count them again. */
+    size_t bytes = 0;
+    /* Bytes allocated after which the next safepoint collects */
+    size_t threshold = 0;
+
+    size_t collections = 0;
+    size_t freed_objects = 0;
+    size_t freed_cells = 0;
+    std::chrono::nanoseconds last_pause{0};
+    std::chrono::nanoseconds max_pause{0};
+    std::chrono::nanoseconds total_pause{0};
+
+    size_t minor_collections = 0;
+    /* Nursery cells that survived a minor collection and were copied out */
+    size_t promoted_cells = 0;
+    std::chrono::nanoseconds last_minor_pause{0};
+    std::chrono::nanoseconds max_minor_pause{0};
+    std::chrono::nanoseconds total_minor_pause{0};
+};
+
+/* Precise generational collector. Cons cells are bump allocated in a
+ * nursery, and a minor collection copies the ones still reachable to the
+ * old space, where they stay put like every other object. The old space is
+ * collected by mark-sweep.
+ *
+ * Whoever holds Values outside of the heap registers a root scanner
+ * marking them, and collections only happen when asked for, so pointers
+ * held in C++ locals between two collection points stay valid. A minor
+ * collection moves cells, so roots are marked in place and get updated.
+ * Old objects and cells made to point into the nursery have to be passed
+ * to WriteBarrier, since a minor collection does not look at the rest of
+ * the old space. */
+class Heap {
+public:
+    using RootScanner = std::function<void(Heap&)>;
+
+    explicit Heap(size_t min_threshold = size_t(1) << 20, double growth_factor = 2.0,
+                  size_t nursery_bytes = size_t(4) << 20);
+
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    ~Heap();
+
+    template <class T, class... Args>
+    T* New(Args&&... args) {
+        auto object = new T(std::forward<Args>(args)...);
+        if (parallel_) {
+            AddParallelObject(object, SizeOf(object));
+            return object;
+        }
+        objects_.push_back(object);
+        ++stats_.objects;
+        stats_.bytes += SizeOf(object);
+        return object;
+    }
+
+    /* Counts storage the containers of an object took on after New, the
+     * free variables of a closure or the values sent to a channel */
+    void Charge(size_t bytes) {
+        if (parallel_) {
+            AddParallelBytes(bytes);
+            return;
+        }
+        stats_.bytes += bytes;
+    }
+
+    /* Old space cells are only used once the nursery is full, callers
+     * make room with CollectNursery first */
+    Cell* NewCell(Value car, Value cdr) {
+        if (top_ == end_) {
+            return NewOldCell(car, cdr);
+        }
+
+        return new (top_++) Cell{car, cdr};
+    }
+
+    /* Whether the next cells allocations stay in the nursery */
+    bool HasRoom(size_t cells) const {
+        return static_cast<size_t>(end_ - top_) >= cells;
+    }
+
+    bool IsYoung(Value value) const {
+        return value.IsPair() && IsYoung(value.GetCell());
+    }
+
+    bool IsYoung(const Cell* cell) const {
+        return reinterpret_cast<uintptr_t>(cell) - reinterpret_cast<uintptr_t>(nursery_) <
+               nursery_capacity_ * sizeof(Cell);
+    }
+
+    /* To be called after value was stored into the object or the cell */
+    void WriteBarrier(Object* object, Value value) {
+        if (IsYoung(value) && !object->remembered) {
+            object->remembered = true;
+            remembered_objects_.push_back(object);
+        }
+    }
+
+    void WriteBarrier(Cell* cell, Value value) {
+        if (IsYoung(value) && !IsYoung(cell)) {
+            RememberCell(cell);
+        }
+    }
+
+    /* Returns an id for RemoveRoots. Both may be called from any thread
+     * while a parallel section is open. */
+    size_t AddRoots(RootScanner scanner);
+    void RemoveRoots(size_t id);
+
+    /* For root scanners, marks the object and everything reachable from
+     * it. A value referring to a nursery cell is updated to where the cell
+     * was moved. */
+    void Mark(Object* object);
+    void Mark(Value& value);
+
+    /* Whether enough was allocated since the last collection */
+    bool ShouldCollect() const {
+        return stats_.bytes >= stats_.threshold;
+    }
+
+    /* Minor collection, empties the nursery and allocates it on first use */
+    void CollectNursery();
+
+    /* Major collection, the nursery is emptied first */
+    void Collect();
+
+    /* The next collection happens once the heap grows to growth_factor
+     * times what survived the last one, but not below min_threshold */
+    void SetThreshold(size_t min_threshold, double growth_factor);
+
+    /* Empties the nursery, the new one is allocated on first use */
+    void SetNurserySize(size_t bytes);
+
+    /* While a parallel section is open, any thread may allocate, each
+     * from buffers of its own, and nothing is collected: the collections
+     * return right away and new cells go to the old space. Opening one
+     * empties the nursery, so nothing is young until it is closed, which
+     * has to happen on the thread that opened it once the others are done
+     * with the heap. Sections do not nest. */
+    void BeginParallel();
+    void EndParallel();
+
+    bool InParallel() const {
+        return parallel_;
+    }
+
+    /* Whether the open section allocated what a collection would have been
+     * due after, or a nursery if that is more. Nothing it allocated is
+     * freed before it closes, so callers should close it then. */
+    bool SectionFull() const {
+        return section_bytes_.load(std::memory_order_relaxed) >= section_room_;
+    }
+
+    /* Objects allocated and not yet collected */
+    size_t Size() const {
+        return objects_.size();
+    }
+
+    /* What the heap holds, the nursery cells in use included and, while a
+     * section is open, most of what its threads allocated */
+    size_t Bytes() const {
+        return stats_.bytes + (top_ - nursery_) * sizeof(Cell) +
+               section_bytes_.load(std::memory_order_relaxed);
+    }
+
+    const HeapStats& Stats() const {
+        return stats_;
+    }
+
+private:
+    /* Old cells come in aligned chunks starting with the mark and the
+     * remembered bits of every cell in the chunk */
+    static constexpr size_t kCellChunkBytes = size_t(64) << 10;
+    static constexpr size_t kCellsPerChunk = kCellChunkBytes / sizeof(Cell);
+
+    struct CellChunk {
+        uint64_t marks[kCellsPerChunk / 64];
+        uint64_t remembered[kCellsPerChunk / 64];
+    };
+
+    static constexpr size_t kFirstCell = sizeof(CellChunk) / sizeof(Cell);
+
+    static CellChunk* ChunkOf(const Cell* cell) {
+        return reinterpret_cast<CellChunk*>(reinterpret_cast<uintptr_t>(cell) &
+                                            ~(kCellChunkBytes - 1));
+    }
+
+    static size_t IndexOf(const Cell* cell) {
+        return (reinterpret_cast<uintptr_t>(cell) & (kCellChunkBytes - 1)) / sizeof(Cell);
+    }
+
+    /* What one thread allocated in the current parallel section, handed
+     * over to the heap as the section ends */
+    struct LocalSpace {
+        std::thread::id owner;
+        std::vector<Object*> objects;
+        Cell* free_cells = nullptr;
+        size_t cells = 0;
+        size_t bytes = 0;
+        /* Not added to section_bytes_ yet */
+        size_t uncounted = 0;
+    };
+
+    LocalSpace& Local();
+    void AddParallelObject(Object* object, size_t bytes);
+    void AddParallelBytes(size_t bytes);
+    void CountParallelBytes(LocalSpace& space, size_t bytes);
+    Cell* AllocateParallelCell();
+
+    Cell* NewOldCell(Value car, Value cdr);
+    Cell* AllocateOldCell();
+    void AddCellChunk();
+    void RememberCell(Cell* cell);
+
+    /* Copies a nursery cell to the old space once, later calls find it there */
+    Cell* Promote(Cell* cell);
+    void MarkCell(Cell* cell);
+    void SweepCells();
+
+    void Trace(Object* object);
+    void Trace(Cell* cell);
+
+    /* The object and what its containers own */
+    static size_t SizeOf(const Object* object);
+
+    std::vector<Object*> objects_;
+    /* Marked objects whose fields are not marked yet */
+    std::vector<Object*> gray_;
+    std::vector<Cell*> gray_cells_;
+
+    Cell* nursery_;
+    Cell* top_;
+    Cell* end_;
+    /* Zero until the nursery is allocated, so nothing is young before */
+    size_t nursery_capacity_;
+    size_t nursery_bytes_;
+    /* Set while a minor collection runs, marking moves cells then */
+    bool minor_;
+    /* Promoted cells whose fields may still point into the nursery */
+    std::vector<Cell*> promoted_;
+    std::vector<Object*> remembered_objects_;
+    std::vector<Cell*> remembered_cells_;
+
+    std::vector<CellChunk*> cell_chunks_;
+    /* Free old cells, linked through their first word */
+    Cell* free_cells_;
+
+    std::vector<std::pair<size_t, RootScanner>> roots_;
+    size_t next_root_id_;
+    std::mutex roots_mutex_;
+
+    bool parallel_;
+    /* Unique for the process, threads cache the space they use by it */
+    uint64_t section_;
+    /* Where the nursery ends, end_ is kept at top_ during a section */
+    Cell* nursery_end_;
+    /* Guards the spaces and the free cells they take from */
+    std::mutex parallel_mutex_;
+    std::vector<std::unique_ptr<LocalSpace>> spaces_;
+    /* What the spaces of the open section counted so far */
+    std::atomic<size_t> section_bytes_;
+    size_t section_room_;
+
+    size_t min_threshold_;
+    double growth_factor_;
+    HeapStats stats_;
+};
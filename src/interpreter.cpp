@@ -0,0 +1,169 @@
+#include <unordered_set>
+#include "interpreter.h"
+#include "numbers.h"
+
+Interpreter::Interpreter(size_t cache_capacity, Backend backend)
+        : cache_(cache_capacity)
+        , tree_cache_(cache_capacity) {
+    if (backend == Backend::CLOSURE_TREE) {
+        tree_ = std::make_unique<TreeEvaluator>(heap_);
+    } else {
+        vm_ = std::make_unique<VM>(heap_);
+    }
+}
+
+std::string Interpreter::Eval(const std::string& expr) {
+    /* Code reaching no safepoint leaves its garbage to the runs after it */
+    if (heap_.ShouldCollect()) {
+        heap_.Collect();
+    }
+
+    if (tree_) {
+        return Show(tree_->Run(tree_cache_.Get(expr)));
+    }
+
+    return Show(vm_->Run(cache_.Get(expr)));
+}
+
+void Interpreter::Reset() {
+    if (tree_) {
+        tree_->ResetGlobals();
+    } else {
+        vm_->ResetGlobals();
+    }
+}
+
+std::vector<const GlobalSite*> Interpreter::GlobalSites(const std::string& expr) const {
+    if (tree_) {
+        auto tree = tree_cache_.Find(expr);
+        return tree ? tree->globals : std::vector<const GlobalSite*>();
+    }
+
+    auto chunk = cache_.Find(expr);
+    return chunk ? chunk->GlobalSites() : std::vector<const GlobalSite*>();
+}
+
+void Interpreter::SetLimits(const Limits& limits) {
+    if (tree_) {
+        tree_->SetLimits(limits);
+    } else {
+        vm_->SetLimits(limits);
+    }
+}
+
+size_t Interpreter::GreenThreads() const {
+    return vm_ ? vm_->GreenThreads() : 0;
+}
+
+size_t Interpreter::HeapSize() const {
+    return heap_.Size();
+}
+
+const HeapStats& Interpreter::GetHeapStats() const {
+    return heap_.Stats();
+}
+
+void Interpreter::Collect() {
+    heap_.Collect();
+}
+
+void Interpreter::SetCollectionThreshold(size_t min_bytes, double growth_factor) {
+    heap_.SetThreshold(min_bytes, growth_factor);
+}
+
+void Interpreter::SetNurserySize(size_t bytes) {
+    heap_.SetNurserySize(bytes);
+}
+
+namespace {
+
+/* Anything but a pair */
+std::string ShowAtom(Value value) {
+    switch (value.GetTag()) {
+        case Value::Tag::FIXNUM:
+        case Value::Tag::FLONUM:
+            return NumberToString(value);
+        case Value::Tag::BOOL:
+            return value.GetBool() ? "#t" : "#f";
+        case Value::Tag::OBJECT:
+            if (AsClosure(value)) {
+                return "#<procedure>";
+            }
+            if (AsChannel(value)) {
+                return "#<channel>";
+            }
+            if (IsNumber(value)) {
+                return NumberToString(value);
+            }
+            return "#<object>";
+        case Value::Tag::SYMBOL:
+            return Tokenizer::Symbols().Name(value.GetSymbol());
+        case Value::Tag::NIL:
+            return "()";
+        default:
+            return "";
+    }
+}
+
+}
+
+std::string Interpreter::Show(Value value) {
+    struct List {
+        /* What is left of it */
+        Value rest;
+        /* Where its cells start in path */
+        size_t cells;
+    };
+
+    std::string text;
+    /* The lists being shown, innermost last. A stack of its own, lists
+     * nest as deep as the heap lets them. */
+    std::vector<List> lists;
+    /* Cells of those lists shown so far. Reaching one of them again is
+     * going around a cycle, which shows as #<cycle>. */
+    std::vector<const Cell*> path;
+    std::unordered_set<const Cell*> on_path;
+    auto enter = [&path, &on_path](Value pair) {
+        if (!on_path.insert(pair.GetCell()).second) {
+            return false;
+        }
+        path.push_back(pair.GetCell());
+        return true;
+    };
+
+    for (;;) {
+        if (value.IsPair() && enter(value)) {
+            text += "(";
+            lists.push_back({value.GetCell()->cdr, path.size() - 1});
+            value = value.GetCell()->car;
+            continue;
+        }
+        text += value.IsPair() ? "#<cycle>" : ShowAtom(value);
+
+        for (;;) {
+            if (lists.empty()) {
+                return text;
+            }
+            auto& list = lists.back();
+            if (list.rest.IsPair() && enter(list.rest)) {
+                text += " ";
+                value = list.rest.GetCell()->car;
+                list.rest = list.rest.GetCell()->cdr;
+                break;
+            }
+            if (!list.rest.IsNil()) {
+                text += " . ";
+                value = list.rest;
+                list.rest = Value::MakeNil();
+                break;
+            }
+
+            text += ")";
+            for (auto i = list.cells; i < path.size(); ++i) {
+                on_path.erase(path[i]);
+            }
+            path.resize(list.cells);
+            lists.pop_back();
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "cache.h"
+#include "closure_tree.h"
+#include "heap.h"
+#include "vm.h"
+
+/* A session: whatever one Eval defines stays visible to the next, and
+ * identical sources are compiled only once. */
+class Interpreter {
+public:
+    /* Both run on the same heap objects, the bytecode VM is the default */
+    enum class Backend {
+        VM,
+        CLOSURE_TREE
+    };
+
+    explicit Interpreter(size_t cache_capacity = 1024, Backend backend = Backend::VM);
+
+    Interpreter(const Interpreter&) = delete;
+    Interpreter& operator=(const Interpreter&) = delete;
+
+    /* Runs every expression of the source, returns the printed last value */
+    std::string Eval(const std::string& expr);
+
+    static std::string Show(Value value);
+
+    /* Forgets every definition, but keeps the heap and the compiled
+     * programs warm for the next independent source */
+    void Reset();
+
+    /* Inline caches of the global references in the program cached for
+     * expr, empty if it is not cached */
+    std::vector<const GlobalSite*> GlobalSites(const std::string& expr) const;
+
+    /* Limits on every Eval from now on, each getting all of them. A source
+     * going over one throws a BudgetError, its definitions up to there
+     * stay. */
+    void SetLimits(const Limits& limits);
+
+    /* Green threads spawned and not finished yet, none on the closure tree */
+    size_t GreenThreads() const;
+
+    /* Objects allocated on the session heap and not collected yet */
+    size_t HeapSize() const;
+    const HeapStats& GetHeapStats() const;
+
+    /* Collects right away instead of at the next safepoint due */
+    void Collect();
+    /* See Heap::SetThreshold */
+    void SetCollectionThreshold(size_t min_bytes, double growth_factor);
+    /* See Heap::SetNurserySize */
+    void SetNurserySize(size_t bytes);
+
+private:
+    Heap heap_;
+    /* Only the backend chosen exists, the other one's globals would
+     * take up the heap for nothing */
+    std::unique_ptr<VM> vm_;
+    std::unique_ptr<TreeEvaluator> tree_;
+    ChunkCache cache_;
+    TreeCache tree_cache_;
+};
@@ -1,59 +1,215 @@
-#include <sstream>
-#include <tic.h>
+#include <algorithm>
+#include <cstring>
 #include "lisp.h"
+#include "interpreter.h"
+#include "numbers.h"
+
+namespace {
+
+/* Indexed by Tokenizer::Builtins */
+const char* const builtin_names[] = {
+        // Special forms
+        "if", // +
+        "quote",
+        "lambda",
+        "define",
+        "set!",
+
+        //  Predicates
+        "null?",
+        "pair?",
+        "number?", // +
+        "boolean?", // +
+        "symbol?",
+        "list?",
+        "eq?", // +
+        "equal?", // +
+        "integer-equal?", // +
+
+        //  Logic
+        "not", // +
+        "and", // +
+        "or", // +
+
+        //  Integer math
+        "+", // +
+        "-", // +
+        "*", // +
+        "/", // +
+        "=", // +
+        ">", // +
+        "<", // +
+        ">=", // +
+        "<=", // +
+        "min", // +
+        "max", // +
+        "abs", // +
+
+        //  List functions
+        "cons",
+        "car",
+        "cdr",
+        "set-car!",
+        "set-cdr!",
+        "list",
+        "list-ref",
+        "list-tail",
+
+        //  Parallel
+        "pmap",
+        "pfor-each",
+        "preduce",
+
+        //  Green threads
+        "spawn",
+        "channel",
+        "send",
+        "recv",
+};
+
+const Symbol builtin_count = sizeof(builtin_names) / sizeof(*builtin_names);
+
+static_assert(builtin_count == static_cast<Symbol>(Tokenizer::Builtins::RECV) + 1,
+              "every builtin needs a name");
+
+}
 
 Tokenizer::Tokenizer(std::unique_ptr<std::istream> input_stream)
-        : input_stream_(std::move(input_stream)) {}
+        : input_stream_(std::move(input_stream))
+        , position_(0)
+        , offset_(0) {}
+
+Tokenizer::Tokenizer(std::string_view source, std::unique_ptr<StructuralIndex> index)
+        : input_stream_(nullptr)
+        , source_(source)
+        , index_(std::move(index))
+        , position_(0)
+        , offset_(0) {}
+
+SymbolTable& Tokenizer::Symbols() {
+    static SymbolTable symbols;
+    static bool builtins_interned = [] {
+        for (auto name : builtin_names) {
+            symbols.Intern(name);
+        }
+        return true;
+    }();
+
+    (void)builtins_interned;
+    return symbols;
+}
+
+bool Tokenizer::IsBuiltin(Symbol symbol) {
+    return symbol < builtin_count;
+}
+
+Tokenizer::Builtins Tokenizer::ToBuiltin(Symbol symbol) {
+    return static_cast<Builtins>(symbol);
+}
 
 void Tokenizer::ReadNext() {
+    if (input_stream_) {
+        ReadNextFromStream();
+    } else {
+        ReadNextFromBuffer();
+    }
+}
+
+void Tokenizer::ReadNextFromStream() {
+    *input_stream_ >> std::ws;
+
     if (input_stream_->peek() == EOF) {
         type_ = TokenType::END_OF_FILE;
         return;
     }
 
-    *input_stream_ >> std::ws;
+    auto offset = input_stream_->tellg();
+    offset_ = offset < 0 ? 0 : static_cast<size_t>(offset);
 
-    char symb;
-    *input_stream_ >> symb;
-    auto token = std::string();
-    token.push_back(symb);
+    stream_token_.clear();
+    stream_token_.push_back(input_stream_->get());
 
-    if (!(symb == '(' || symb == ')')) {
+    if (!IsSeparator(stream_token_[0])) {
         auto next = input_stream_->peek();
-        while (next != '\n' && next != ' ' && next != '(' && next != ')' && next != EOF) {
-            token.push_back(input_stream_->get());
+        while (next != EOF && !IsSeparator(next)) {
+            stream_token_.push_back(input_stream_->get());
             next = input_stream_->peek();
         }
-    } else {
-        type_ = ((symb == '(') ? TokenType::OPEN_PARENT : TokenType::CLOSE_PARENT);
+    }
+
+    Classify(stream_token_);
+}
+
+void Tokenizer::ReadNextFromBuffer() {
+    auto size = source_.size();
+
+    if (index_) {
+        position_ = index_->SkipSpaces(position_);
+        if (position_ == size) {
+            type_ = TokenType::END_OF_FILE;
+            return;
+        }
+
+        auto begin = offset_ = position_;
+        position_ = index_->TokenEnd(begin);
+        Classify(source_.substr(begin, position_ - begin));
+        return;
+    }
+
+    while (position_ < size && IsSpace(source_[position_])) {
+        ++position_;
+    }
+
+    if (position_ == size) {
+        type_ = TokenType::END_OF_FILE;
         return;
     }
 
-    if (IsNumber(token)) {
-        size_t *processed = nullptr;
-        number_ = std::stoll(token, processed, 10);
+    auto begin = offset_ = position_++;
+    if (!IsSeparator(source_[begin])) {
+        while (position_ < size && !IsSeparator(source_[position_])) {
+            ++position_;
+        }
+    }
+
+    Classify(source_.substr(begin, position_ - begin));
+}
+
+void Tokenizer::Classify(std::string_view token) {
+    token_ = token;
+
+    switch (token[0]) {
+        case '(':
+            type_ = TokenType::OPEN_PARENT;
+            return;
+        case ')':
+            type_ = TokenType::CLOSE_PARENT;
+            return;
+        case '\'':
+            type_ = TokenType::APOSTROPH;
+            return;
+        default:
+            break;
+    }
+
+    /* Integers out of the fixnum range are boxed like the other literals */
+    bool integer = ParseNumber(token, &number_);
+    if (integer && Value::FitsFixnum(number_)) {
+        type_ = TokenType::NUM;
+        literal_ = Value::MakeFixnum(number_);
+    } else if (ParseNumberLiteral(token, &literals_, &literal_)) {
         type_ = TokenType::NUM;
+        number_ = integer ? number_ : 0;
     } else if (IsBool(token)) {
-        name_ = token;
         type_ = TokenType::BOOL;
-    } else if (IsBuiltin(token)) {
-        name_ = token;
-        type_ = TokenType::BUILTIN;
+    } else if (Symbols().Find(token, &symbol_)) {
+        /* Only builtins and valid names ever get interned */
+        type_ = IsBuiltin(symbol_) ? TokenType::BUILTIN : TokenType::NAME;
     } else if (IsName(token)) {
-        name_ = token;
+        symbol_ = Symbols().Intern(token);
         type_ = TokenType::NAME;
     } else {
-        switch (symb) {
-            case '.':
-                type_ = TokenType::PAIR;
-                break;
-            case '\'':
-                type_ = TokenType::APOSTROPH;
-                break;
-            default:
-                type_ = TokenType::UNKNOWN;
-                break;
-        }
+        type_ = (token[0] == '.') ? TokenType::PAIR : TokenType::UNKNOWN;
     }
 }
 
@@ -61,147 +217,266 @@ Tokenizer::TokenType Tokenizer::ShowTokenType() const{
     return type_;
 }
 
-const std::string &Tokenizer::GetTokenName() const{
-    return name_;
+std::string_view Tokenizer::GetTokenView() const {
+    return token_;
 }
 
 int64_t Tokenizer::GetTokenNumber() const {
     return number_;
 }
 
-bool Tokenizer::IsNumber(const std::string &token) {
-    try {
-        size_t processed = 0;
-        std::stoll(token, &processed, 10);
-        if (processed != token.size()) {
+Value Tokenizer::GetTokenValue() const {
+    return literal_;
+}
+
+bool Tokenizer::GetTokenBool() const {
+    return number_;
+}
+
+Symbol Tokenizer::GetTokenSymbol() const {
+    return symbol_;
+}
+
+bool Tokenizer::IsSpace(char symb) {
+    return symb == ' ' || symb == '\n' || symb == '\t' || symb == '\r' || symb == '\v' || symb == '\f';
+}
+
+bool Tokenizer::IsSeparator(char symb) {
+    return IsSpace(symb) || symb == '(' || symb == ')' || symb == '\'';
+}
+
+bool Tokenizer::ParseNumber(std::string_view token, int64_t* number) {
+    size_t pos = 0;
+    bool negative = false;
+    if (token[0] == '-' || token[0] == '+') {
+        negative = (token[0] == '-');
+        ++pos;
+    }
+
+    if (pos == token.size()) {
+        return false;
+    }
+
+    /* Accumulate the magnitude, the negative range is one larger */
+    uint64_t limit = negative ? uint64_t(INT64_MAX) + 1 : uint64_t(INT64_MAX);
+    uint64_t value = 0;
+    for (; pos < token.size(); ++pos) {
+        unsigned digit = static_cast<unsigned char>(token[pos]) - '0';
+        if (digit > 9 || value > (limit - digit) / 10) {
             return false;
         }
-    } catch (const std::invalid_argument &exc) {
-        return false;
-    } catch (const std::out_of_range &exc) {
-        return false;
+        value = value * 10 + digit;
     }
 
+    *number = negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
     return true;
 }
 
-bool Tokenizer::IsName(const std::string &token) {
-    bool return_value = false;
-    if (builtins_.find(token) != builtins_.end()) {
-        return_value = true;
+bool Tokenizer::IsName(std::string_view token) {
+    /* Scheme identifiers like slow-add or set-x! */
+    auto is_initial = [](char symb) {
+        return std::isalpha(static_cast<unsigned char>(symb)) ||
+               (symb && std::strchr("!$%&*/:<=>?^_~", symb));
+    };
+    auto is_subsequent = [&is_initial](char symb) {
+        return is_initial(symb) || std::isdigit(static_cast<unsigned char>(symb)) ||
+               (symb && std::strchr("+-.@", symb));
+    };
+
+    if (!is_initial(token[0])) {
+        return false;
     }
 
-    if (!token.empty() && std::isalpha(token[0])) {
-        auto iter = token.begin();
-        while (iter < token.end()) {
-            if (!std::isalnum(*iter)) {
-                break;
-            }
-            ++iter;
-        }
-        if (iter == token.end()) {
-            return_value = true;
+    for (auto symb : token) {
+        if (!is_subsequent(symb)) {
+            return false;
         }
     }
 
-    return return_value;
+    return true;
+}
+
+bool Tokenizer::IsBool(std::string_view token) {
+    if (token == "#t" || token == "#f") {
+        number_ = (token[1] == 't');
+        return true;
+    }
+
+    return false;
 }
 
-bool Tokenizer::IsBuiltin(const std::string &token) {
-    return builtins_.find(token) != builtins_.end();
+size_t Tokenizer::GetTokenOffset() const {
+    return offset_;
 }
 
-bool Tokenizer::IsBool(const std::string &token) {
-    return bools_.find(token) != bools_.end();
+std::string Tokenizer::DescribeOffset(size_t offset) const {
+    if (input_stream_) {
+        return "offset " + std::to_string(offset);
+    }
+
+    auto before = source_.substr(0, offset);
+    auto line = std::count(before.begin(), before.end(), '\n') + 1;
+    auto line_start = before.rfind('\n');
+    auto column = offset - (line_start == std::string_view::npos ? 0 : line_start + 1) + 1;
+    return "line " + std::to_string(line) + ", column " + std::to_string(column);
 }
 
 AST::Pair::Pair()
-        : value(std::shared_ptr<Pair>(nullptr)), next(nullptr) {}
+        : type(TokenType::UNDEFINED), argc(0), child(nullptr), next(nullptr) {}
 
 AST::AST(std::unique_ptr<std::istream> input_stream)
         : Tokenizer(std::move(input_stream))
-        , root_(std::make_shared<Pair>())
-        , curr_(root_) {}
+        , root_(nullptr)
+        , link_(&root_)
+        , last_(nullptr) {}
+
+AST::AST(std::string_view source, std::unique_ptr<StructuralIndex> index)
+        : Tokenizer(source, std::move(index))
+        , root_(nullptr)
+        , link_(&root_)
+        , last_(nullptr) {}
+
+size_t AST::NodeCount() const {
+    return nodes_.Size();
+}
 
-std::shared_ptr<AST::Pair> AST::InsertLexema() {
-    ReadNext();
+size_t AST::NodeChunkCount() const {
+    return nodes_.ChunkCount();
+}
 
-    curr_->type = ShowTokenType();
+AST::Pair* AST::InsertLexema() {
+    ReadNext();
 
-    if (curr_->type == TokenType::END_OF_FILE) {
-        return nullptr;
-    }
+    switch (ShowTokenType()) {
+        case TokenType::END_OF_FILE:
+            if (!return_stack_.empty()) {
+                throw SyntaxError("ERROR: Unexpected end of input, missing )\n");
+            }
+            return nullptr;
 
-    switch (curr_->type) {
         case TokenType::OPEN_PARENT:
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            return_stack_.push_back(curr_);
-            TurnDown();
+            Nest();
+            return_stack_.push_back({Append(), false, -1});
+            last_->offset = GetTokenOffset();
+            link_ = &last_->child;
             break;
 
-        case TokenType::CLOSE_PARENT:
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            curr_ = return_stack_.back();
+        case TokenType::CLOSE_PARENT: {
+            if (return_stack_.empty() || return_stack_.back().quote) {
+                throw SyntaxError("ERROR: Unexpected )\n");
+            }
+            auto frame = return_stack_.back();
+            if (!frame.after_dot) {
+                throw SyntaxError("ERROR: Malformed dotted list\n");
+            }
             return_stack_.pop_back();
-            TurnNext();
+            last_ = frame.list;
+            link_ = &frame.list->next;
+            EndDatum();
+            }
+            break;
+
+        case TokenType::APOSTROPH: {
+            /* 'datum reads as (quote datum) */
+            Nest();
+            auto quote = Append();
+            quote->type = TokenType::OPEN_PARENT;
+            quote->offset = GetTokenOffset();
+            return_stack_.push_back({quote, true, -1});
+            link_ = &quote->child;
+
+            auto head = Append();
+            head->type = TokenType::BUILTIN;
+            head->value = Value::MakeSymbol(static_cast<Symbol>(Builtins::QUOTE));
+            }
+            break;
+
+        case TokenType::PAIR:
+            if (return_stack_.empty() || return_stack_.back().quote ||
+                !return_stack_.back().list->child || return_stack_.back().after_dot >= 0) {
+                throw SyntaxError("ERROR: Unexpected .\n");
+            }
+            Append();
+            return_stack_.back().after_dot = 0;
             break;
 
         case TokenType::NUM:
-            curr_->value = GetTokenNumber();
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            TurnNext();
+            Append()->value = GetTokenValue();
+            EndDatum();
             break;
 
         case TokenType::NAME:
-            curr_->value = GetTokenName();
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            TurnNext();
+        case TokenType::BUILTIN:
+            Append()->value = Value::MakeSymbol(GetTokenSymbol());
+            last_->offset = GetTokenOffset();
+            EndDatum();
             break;
 
         case TokenType::BOOL:
-            curr_->value = bools_.at(GetTokenName());
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            TurnNext();
+            Append()->value = Value::MakeBool(GetTokenBool());
+            EndDatum();
             break;
 
-        case TokenType::BUILTIN:
-            curr_->value = GetTokenName();
-#ifdef TEST__DUMP
-            TEST_StatusDump();
-#endif
-            TurnNext();
+        case TokenType::UNKNOWN:
+            /* Stands in for the token so the list around it keeps its shape */
+            if (GetTokenView().size() > kMaxNumberLength) {
+                errors_ += "ERROR: Token longer than " + std::to_string(kMaxNumberLength) +
+                           " characters at " + DescribeOffset(GetTokenOffset()) + "\n";
+            } else {
+                errors_ += std::string(IsZeroRatio(GetTokenView()) ? "ERROR: Division by zero in "
+                                                                   : "ERROR: Unknown token ") +
+                           std::string(GetTokenView()) + " at " +
+                           DescribeOffset(GetTokenOffset()) + "\n";
+            }
+            Append();
+            EndDatum();
             break;
 
         default:
-            break;
+            return last_;
     }
 
-    return curr_;
+#ifdef TEST__DUMP
+    TEST_StatusDump();
+#endif
+    return last_;
+}
+
+inline AST::Pair* AST::Append() {
+    auto node = nodes_.New();
+    node->type = ShowTokenType();
+    *link_ = node;
+    link_ = &node->next;
+    last_ = node;
+    return node;
 }
 
-inline void AST::TurnNext() {
-    curr_->next = std::make_shared<Pair>();
-    curr_ = curr_->next;
+void AST::Nest() const {
+    if (return_stack_.size() >= kMaxNesting) {
+        throw SyntaxError("ERROR: Lists nested deeper than " + std::to_string(kMaxNesting) +
+                          " at " + DescribeOffset(GetTokenOffset()) + "\n");
+    }
 }
 
-inline void AST::TurnDown() {
-    curr_->value = std::make_shared<Pair>();
-    curr_ = curr_->value.TakeValue<std::shared_ptr<Pair>>();
+void AST::EndDatum() {
+    while (!return_stack_.empty()) {
+        auto& frame = return_stack_.back();
+        if (frame.after_dot >= 0 && ++frame.after_dot > 1) {
+            throw SyntaxError("ERROR: Malformed dotted list\n");
+        }
+        if (!frame.quote) {
+            return;
+        }
+
+        last_ = frame.list;
+        link_ = &frame.list->next;
+        return_stack_.pop_back();
+    }
 }
 
 void AST::TEST_StatusDump() {
     std::cout << "type: ";
-    switch (curr_->type) {
+    switch (last_->type) {
         case TokenType::OPEN_PARENT:
             std::cout << "OPEN_PARENT" << std::endl;
             std::cout << "no value" << std::endl;
@@ -212,172 +487,164 @@ void AST::TEST_StatusDump() {
             break;
         case TokenType::NUM:
             std::cout << "NUM" << std::endl;
-            std::cout << "value: " << curr_->value.TakeValue<int64_t>() << std::endl;
+            std::cout << "value: " << NumberToString(last_->value) << std::endl;
             break;
         case TokenType::NAME:
             std::cout << "NAME" << std::endl;
-            std::cout << "value: " << curr_->value.TakeValue<std::string>() << std::endl;
+            std::cout << "value: " << Symbols().Name(last_->value.GetSymbol()) << std::endl;
             break;
         case TokenType::BUILTIN:
             std::cout << "BUILTIN" << std::endl;
-            std::cout << "value: " << curr_->value.TakeValue<std::string>() << std::endl;
+            std::cout << "value: " << Symbols().Name(last_->value.GetSymbol()) << std::endl;
             break;
         case TokenType::BOOL:
             std::cout << "BOOL" << std::endl;
-            std::cout << "value: " << curr_->value.TakeValue<int64_t>() << std::endl;
+            std::cout << "value: " << last_->value.GetBool() << std::endl;
             break;
         default:
             std::cout << "DEFAULT" << std::endl;
             std::cout << "no value" << std::endl;
             break;
     }
-    std::cout << "next " << curr_->next << std::endl << std::endl;
+    std::cout << "next " << last_->next << std::endl << std::endl;
 }
 
-Evaluate::Evaluate(const std::string& expr)
-        : AST(std::make_unique<std::stringstream>(expr))
+Evaluate::Evaluate(const std::string& expr, Backend backend)
+        : AST(std::string_view(expr))
         , std::string() {
 
     while (this->InsertLexema()) {}
+    Analyze();
+    Fold();
 
-    auto evaluated = Eval(root_);
-    switch (evaluated.type) {
-        case Tokenizer::TokenType::NUM:
-            this->append(std::to_string(evaluated.value.TakeValue<int64_t>()));
-            break;
-        case Tokenizer::TokenType::BOOL:
-            this->append(((evaluated.value.TakeValue<bool>()) ? "#t" : "#f"));
-            break;
-        default:
-            break;
+    if (backend == Backend::VM) {
+        Print(VM(heap_).Run(Compiler(*this).Compile()));
+        return;
+    }
+    if (backend == Backend::CLOSURE_TREE) {
+        Print(TreeEvaluator(heap_).Run(TreeBuilder(*this).Build()));
+        return;
+    }
+
+    Value result;
+    for (auto node = root_; node; node = node->next) {
+        result = Eval(node);
     }
+    Print(result);
 }
 
-const Evaluate::Pair& Evaluate::Eval(std::shared_ptr<Pair> curr) {
+Evaluate::Evaluate(const std::string& expr, ChunkCache& cache)
+        : AST(std::string_view(expr))
+        , std::string() {
+    Print(VM(heap_).Run(cache.Get(expr)));
+}
+
+void Evaluate::Print(Value value) {
+    this->append(Interpreter::Show(value));
+}
+
+Value Evaluate::Eval(const Pair* curr) {
     switch (curr->type) {
-        case TokenType::OPEN_PARENT: {
-            auto res = Eval(curr->value.TakeValue<std::shared_ptr<Pair>>());
-            curr->value = res.value;
-            curr->type = res.type;
+        case TokenType::OPEN_PARENT:
+            /* Builtins only act at the head of a list, where Analyze counted
+             * their arguments, and nothing else is called here */
+            if (curr->child->type != TokenType::BUILTIN) {
+                throw std::runtime_error("ERROR: The tree walker calls builtins only\n");
             }
-            break;
-        case TokenType::BUILTIN:
-            switch (Tokenizer::builtins_.at(curr->value.TakeValue<std::string>())) {
+            curr = curr->child;
+            switch (ToBuiltin(curr->value.GetSymbol())) {
                     // Integer math
                 case Builtins::ADD:
-                    curr->value = Add(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Add(curr);
                 case Builtins::SUB:
-                    curr->value = Sub(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Sub(curr);
                 case Builtins::MUL:
-                    curr->value = Mul(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Mul(curr);
                 case Builtins::DIV:
-                    curr->value = Div(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Div(curr);
                 case Builtins::EQ:
-                    curr->value = EQ(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(EQ(curr));
                 case Builtins::GT:
-                    curr->value = GT(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(GT(curr));
                 case Builtins::LT:
-                    curr->value = LT(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(LT(curr));
                 case Builtins::GEQ:
-                    curr->value = GEQ(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(GEQ(curr));
                 case Builtins::LEQ:
-                    curr->value = LEQ(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(LEQ(curr));
                 case Builtins::MIN:
-                    curr->value = Min(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Min(curr);
                 case Builtins::MAX:
-                    curr->value = Max(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Max(curr);
                 case Builtins::ABS:
-                    curr->value = Abs(curr);
-                    curr->type = TokenType::NUM;
-                    break;
+                    return Abs(curr);
 
                     // Predicates
                 case Builtins::IS_NULL:
-                    curr->value = is_null(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_null(curr));
                 case Builtins::IS_PAIR:
-                    curr->value = is_pair(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_pair(curr));
                 case Builtins::IS_NUMBER:
-                    curr->value = is_number(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_number(curr));
                 case Builtins::IS_BOOLEAN:
-                    curr->value = is_bool(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_bool(curr));
                 case Builtins::IS_LIST:
-                    curr->value = is_list(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_list(curr));
                 case Builtins::IS_SYMBOL:
-                    curr->value = is_symb(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(is_symb(curr));
                 case Builtins::ARE_EQUAL:
-                    curr->value = ARE_EQUAL(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(ARE_EQUAL(curr));
                 case Builtins::ARE_EQ:
-                    curr->value = ARE_EQ(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(ARE_EQ(curr));
                 case Builtins::INT_EQ:
-                    curr->value = INT_EQ(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(INT_EQ(curr));
 
                     // Logic
                 case Builtins::IF:
-                    If(curr);
-                    break;
+                    return If(curr);
 
                 case Builtins::NOT:
-                    curr->value = NOT(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(NOT(curr));
 
                 case Builtins::AND:
-                    curr->value = AND(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(AND(curr));
 
                 case Builtins::OR:
-                    curr->value = OR(curr);
-                    curr->type = TokenType::BOOL;
-                    break;
+                    return Value::MakeBool(OR(curr));
+
+                    // Lists
+                case Builtins::QUOTE:
+                    return Quote(curr);
+                case Builtins::CONS:
+                    return Cons(curr);
+                case Builtins::CAR:
+                    return Car(curr);
+                case Builtins::CDR:
+                    return Cdr(curr);
+                case Builtins::SET_CAR:
+                    return SetCar(curr);
+                case Builtins::SET_CDR:
+                    return SetCdr(curr);
+                case Builtins::LIST:
+                    return List(curr);
+                case Builtins::LIST_REF:
+                    return ListRef(curr);
+                case Builtins::LIST_TAIL:
+                    return ListTail(curr);
 
                 default:
                     break;
             }
-            break;
+            /* Variables, lambdas, green threads and parallel sections are
+             * left to the other backends */
+            throw std::runtime_error("ERROR: The tree walker cannot evaluate " +
+                                     Symbols().Name(curr->value.GetSymbol()) + "\n");
+        case TokenType::NUM:
+        case TokenType::BOOL:
+            return curr->value;
+        case TokenType::NAME:
+            ThrowUnbound(curr->value.GetSymbol());
         default:
-            break;
+            return Value();
     }
-
-    return *curr;
 }
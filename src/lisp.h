@@ -1,7 +1,8 @@
 #pragma once
 
-#include <istream>
+#include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 
@@ -9,13 +10,40 @@
 #include <functional>
 
 #include <climits>
+#include <stdexcept>
 
-#include "any.h"
+#include "arena.h"
+#include "heap.h"
+#include "scanner.h"
+#include "symbols.h"
+#include "value.h"
+
+/* Malformed programs, reported before anything runs */
+class SyntaxError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* References to variables that were never defined */
+class NameError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/* Evaluations that went over one of their limits, see Limits */
+class BudgetError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
 
 class Tokenizer {
 public:
     explicit Tokenizer(std::unique_ptr<std::istream> input_stream);
 
+    /* Scans the buffer in place, it must outlive the tokenizer. Token
+     * boundaries come from the structural index when one is given. */
+    explicit Tokenizer(std::string_view source, std::unique_ptr<StructuralIndex> index = nullptr);
+
     enum class TokenType {
         UNKNOWN, // 0
         NAME, // 1
@@ -77,149 +105,251 @@ public:
         SET_CDR,
         LIST,
         LIST_REF,
-        LIST_TAIL
+        LIST_TAIL,
+
+        // Parallel
+        PMAP,
+        PFOR_EACH,
+        PREDUCE,
+
+        // Green threads
+        SPAWN,
+        CHANNEL,
+        SEND,
+        RECV
     };
 
     void ReadNext();
 
     TokenType ShowTokenType() const;
 
-    const std::string& GetTokenName() const;
+    /* View into the source (or the stream read buffer) valid until the next ReadNext */
+    std::string_view GetTokenView() const;
 
     int64_t GetTokenNumber() const;
 
+    /* The number a NUM token stands for */
+    Value GetTokenValue() const;
+
+    /* Owns the boxed ones, which code compiled from the tokens has to
+     * keep, null while there are none */
+    const std::shared_ptr<Heap>& GetLiterals() const {
+        return literals_;
+    }
+
+    bool GetTokenBool() const;
+
+    Symbol GetTokenSymbol() const;
+
+    /* Where the current token starts in the source */
+    size_t GetTokenOffset() const;
+    /* Line and column of an offset for error messages, just the offset
+     * when reading a stream */
+    std::string DescribeOffset(size_t offset) const;
+
+    /* Process-wide symbol table, builtins are interned first in Builtins order */
+    static SymbolTable& Symbols();
+
+    static bool IsBuiltin(Symbol symbol);
+    static Builtins ToBuiltin(Symbol symbol);
+
+    static bool IsSpace(char symb);
+    static bool IsSeparator(char symb);
+
+    /* Non-throwing, single pass integer parse */
+    static bool ParseNumber(std::string_view token, int64_t* number);
+
 private:
-    bool IsNumber(const std::string& token);
-    bool IsName(const std::string& token);
-    bool IsBool(const std::string &token);
-    bool IsBuiltin(const std::string &token);
+    void ReadNextFromStream();
+    void ReadNextFromBuffer();
+    void Classify(std::string_view token);
+
+    bool IsName(std::string_view token);
+    bool IsBool(std::string_view token);
 
     std::shared_ptr<std::istream> input_stream_;
-    TokenType type_;
-    std::string name_;
-    int64_t number_;
+    std::string stream_token_;
 
-protected:
-    const std::unordered_map<std::string, bool> bools_ = {
-            {"#t", true}, // +
-            {"#f", false} // +
-    };
+    std::string_view source_;
+    std::unique_ptr<StructuralIndex> index_;
+    size_t position_;
 
-    const std::unordered_map<std::string, Builtins> builtins_ = {
-            // Special forms
-            {"quote", Builtins::QUOTE},
-            {"lambda", Builtins::LAMBDA},
-            {"define", Builtins::DEFINE},
-            {"set!", Builtins::SET},
-
-            //  Predicates
-            {"null?", Builtins::IS_NULL},
-            {"pair?", Builtins::IS_PAIR},
-            {"number?", Builtins::IS_NUMBER}, // +
-            {"boolean?", Builtins::IS_BOOLEAN}, // +
-            {"symbol?", Builtins::IS_SYMBOL},
-            {"list?", Builtins::LIST},
-            {"equal?", Builtins::ARE_EQUAL}, // +
-            {"eq?", Builtins::ARE_EQ}, // +
-            {"integer-equal?", Builtins::INT_EQ}, // +
-
-            //  Logic
-            {"if", Builtins::IF}, // +
-            {"not", Builtins::NOT}, // +
-            {"and", Builtins::AND}, // +
-            {"or", Builtins::OR}, // +
-
-            //  Integer math
-            {"+", Builtins::ADD}, // +
-            {"-", Builtins::SUB}, // +
-            {"*", Builtins::MUL}, // +
-            {"/", Builtins::DIV}, // +
-            {"=", Builtins::EQ}, // +
-            {">", Builtins::GT}, // +
-            {"<", Builtins::LT}, // +
-            {">=", Builtins::GEQ}, // +
-            {"<=", Builtins::LEQ}, // +
-            {"min", Builtins::MIN}, // +
-            {"max", Builtins::MAX}, // +
-            {"abs", Builtins::ABS}, // +
-
-            //  List functions
-            {"cons", Builtins::CONS},
-            {"car", Builtins::CAR},
-            {"cdr", Builtins::CDR},
-            {"set-car!", Builtins::SET_CAR},
-            {"set-cdr!", Builtins::SET_CDR},
-            {"list", Builtins::LIST},
-            {"list-ref", Builtins::LIST_REF},
-            {"list-tail", Builtins::LIST_TAIL},
-    };
+    TokenType type_;
+    std::string_view token_;
+    size_t offset_;
+    int64_t number_;
+    Value literal_;
+    Symbol symbol_;
+    /* Boxed number literals read so far, null until the first one */
+    std::shared_ptr<Heap> literals_;
 };
 
 class AST : protected Tokenizer {
+    friend class Compiler;
+    friend class TreeBuilder;
+    friend class Scope;
+
 protected:
+    /* One node per token but closing parens, lists end with a null next.
+     * A PAIR node stands for the dot of a dotted list and is followed by
+     * its tail. */
     struct Pair {
         Pair();
 
         Tokenizer::TokenType type;
-        Any value;
-
-        std::shared_ptr<Pair> next;
+        /* Builtins never start a list, so the two never meet in one node */
+        union {
+            /* Arguments after a builtin heading a list, set by Analyze */
+            uint32_t argc;
+            /* Where the list or the name starts in the source, for
+             * OPEN_PARENT and for names until Analyze sets argc */
+            uint32_t offset;
+        };
+        union {
+            Value value;
+            /* First node of the list, null for (), for OPEN_PARENT */
+            Pair* child;
+        };
+
+        Pair* next;
     };
 
-    std::shared_ptr<Pair> root_;
+    /* Owns every node of the session, which are released all at once */
+    Arena<Pair> nodes_;
+    /* First top level expression, null for an empty source */
+    Pair* root_;
 
 public:
     AST(std::unique_ptr<std::istream> input_stream);
-    std::shared_ptr<Pair> InsertLexema();
+    explicit AST(std::string_view source, std::unique_ptr<StructuralIndex> index = nullptr);
+    Pair* InsertLexema();
+
+    /* Checks the arity of every builtin and special form once parsing is
+     * done, and records it in the nodes so evaluation does not count
+     * again, and that builtins outside of quotes only head lists. Throws
+     * a SyntaxError listing every problem found, the unknown tokens read
+     * first. */
+    void Analyze();
+
+    /* Replaces calls of pure builtins whose operands are all constants by
+     * their value, combines the constant operands of sums and products and
+     * keeps only the branch of an if a constant condition takes. Whatever
+     * would throw is left as is, to throw at run time. Expects an analyzed
+     * AST, returns how many forms were folded. */
+    size_t Fold();
+
+    /* Nodes allocated by the parser so far */
+    size_t NodeCount() const;
+    size_t NodeChunkCount() const;
+
+    /* Lists, quotes included, open at once at most. Analysis, folding and
+     * compilation recurse on the native stack once per level. */
+    static constexpr size_t kMaxNesting = 1000;
 
 private:
-    inline void TurnNext();
-    inline void TurnDown();
+    /* A list being read, or the (quote datum) an apostrophe stands for,
+     * which ends by itself after one datum */
+    struct Frame {
+        Pair* list;
+        bool quote;
+        /* Data read since the dot, -1 when there was none */
+        int after_dot;
+    };
+
+    /* Links a node for the current token where the next datum goes */
+    inline Pair* Append();
+    void AnalyzeNode(Pair* node, const Pair* list, std::string& errors) const;
+    void AnalyzeList(Pair* list, std::string& errors) const;
+    void AnalyzeBody(Pair* body, const Pair* list, std::string& errors) const;
+    void AnalyzeParams(const Pair* params, const Pair* list, std::string& errors) const;
+    void Report(const Pair* list, const std::string& message, std::string& errors) const;
+    void FoldBody(Pair* body, size_t* folded);
+    void FoldNode(Pair* node, size_t* folded);
+    void FoldIf(Pair* node, size_t* folded);
+    /* For sums and products with operands known at run time only */
+    void FoldOperands(Pair* head, size_t* folded);
+    static bool IsConstant(const Pair* node);
+    static void ReplaceWithConstant(Pair* node, Value value);
+    /* Closes the quotes waiting for the datum just read */
+    void EndDatum();
+    /* Throws before a list would open deeper than kMaxNesting */
+    void Nest() const;
     void TEST_StatusDump();
 
-    std::shared_ptr<Pair> curr_;
-    std::vector<std::shared_ptr<Pair>> return_stack_;
+    /* Slot the next node is linked into */
+    Pair** link_;
+    Pair* last_;
+    std::vector<Frame> return_stack_;
+    /* Unknown tokens read so far, reported by Analyze */
+    std::string errors_;
 };
 
+class ChunkCache;
+
 class Evaluate : protected AST, public std::string {
 public:
-    Evaluate(const std::string &expr);
+    enum class Backend {
+        TREE,
+        VM,
+        CLOSURE_TREE
+    };
+
+    Evaluate(const std::string &expr, Backend backend = Backend::VM);
+    /* Runs the program compiled for an identical earlier expression, if any */
+    Evaluate(const std::string &expr, ChunkCache& cache);
 
 private:
-    const Pair& Eval(std::shared_ptr<Pair> curr);
-
-    int64_t Add(std::shared_ptr<Pair> curr);
-    int64_t Sub(std::shared_ptr<Pair> curr);
-    int64_t Mul(std::shared_ptr<Pair> curr);
-    int64_t Div(std::shared_ptr<Pair> curr);
-    int64_t Abs(std::shared_ptr<Pair> curr);
-    int64_t Min(std::shared_ptr<Pair> curr);
-    int64_t Max(std::shared_ptr<Pair> curr);
-
-    bool EQ(std::shared_ptr<Pair> curr);
-    bool GT(std::shared_ptr<Pair> curr);
-    bool LT(std::shared_ptr<Pair> curr);
-    bool GEQ(std::shared_ptr<Pair> curr);
-    bool LEQ(std::shared_ptr<Pair> curr);
-    bool ARE_EQUAL(std::shared_ptr<Pair> curr);
-    bool ARE_EQ(std::shared_ptr<Pair> curr);
-    bool INT_EQ(std::shared_ptr<Pair> curr);
-
-    bool is_null(std::shared_ptr<Pair> curr);
-    bool is_pair(std::shared_ptr<Pair> curr);
-    bool is_number(std::shared_ptr<Pair> curr);
-    bool is_bool(std::shared_ptr<Pair> curr);
-    bool is_symb(std::shared_ptr<Pair> curr);
-    bool is_list(std::shared_ptr<Pair> curr);
-
-    void If(std::shared_ptr<Pair> curr);
-    bool NOT(std::shared_ptr<Pair> curr);
-    bool AND(std::shared_ptr<Pair> curr);
-    bool OR(std::shared_ptr<Pair> curr);
-
-    void CheckOneArg(std::shared_ptr<Pair> func);
-    void CheckAtLeastOneArg(std::shared_ptr<Pair> func);
-
-    void CheckTwoArgs(std::shared_ptr<Pair> func);
-    void CheckAtLeastTwoArgs(std::shared_ptr<Pair> func);
+    void Print(Value value);
+
+    /* Leaves the tree untouched, so a parsed program can be run again.
+     * Builtins only, anything needing variables or closures throws. */
+    Value Eval(const Pair* curr);
+
+    Value Add(const Pair* curr);
+    Value Sub(const Pair* curr);
+    Value Mul(const Pair* curr);
+    Value Div(const Pair* curr);
+    Value Abs(const Pair* curr);
+    Value Min(const Pair* curr);
+    Value Max(const Pair* curr);
+
+    /* Whether compare orders every two neighbouring arguments */
+    template <class Compare>
+    bool Ordered(const Pair* curr, Compare compare);
+    bool EQ(const Pair* curr);
+    bool GT(const Pair* curr);
+    bool LT(const Pair* curr);
+    bool GEQ(const Pair* curr);
+    bool LEQ(const Pair* curr);
+    bool ARE_EQUAL(const Pair* curr);
+    bool ARE_EQ(const Pair* curr);
+    bool INT_EQ(const Pair* curr);
+
+    bool is_null(const Pair* curr);
+    bool is_pair(const Pair* curr);
+    bool is_number(const Pair* curr);
+    bool is_bool(const Pair* curr);
+    bool is_symb(const Pair* curr);
+    bool is_list(const Pair* curr);
+
+    Value Quote(const Pair* curr);
+    /* The value a quoted node stands for */
+    Value Datum(const Pair* node);
+
+    Value Cons(const Pair* curr);
+    Value Car(const Pair* curr);
+    Value Cdr(const Pair* curr);
+    Value SetCar(const Pair* curr);
+    Value SetCdr(const Pair* curr);
+    Value List(const Pair* curr);
+    Value ListRef(const Pair* curr);
+    Value ListTail(const Pair* curr);
+
+    Value If(const Pair* curr);
+    bool NOT(const Pair* curr);
+    bool AND(const Pair* curr);
+    bool OR(const Pair* curr);
+
+    /* Cells of either backend, only collected when the evaluation is over */
+    Heap heap_;
 };
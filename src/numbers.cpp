@@ -0,0 +1,827 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include "numbers.h"
+
+namespace {
+
+using Limbs = std::vector<uint32_t>;
+
+/* Below this many limbs in the shorter operand schoolbook multiplication wins */
+constexpr size_t kKaratsubaThreshold = 32;
+
+constexpr uint64_t kBase = uint64_t(1) << 32;
+
+/* Either kind of integer, unpacked for the generic path */
+struct Integer {
+    bool negative;
+    Limbs limbs;
+};
+
+[[noreturn]] void ThrowNotNumber() {
+    throw std::runtime_error("ERROR: Expected a number\n");
+}
+
+void Trim(Limbs& limbs) {
+    while (!limbs.empty() && !limbs.back()) {
+        limbs.pop_back();
+    }
+}
+
+Integer MakeInteger(bool negative, uint64_t magnitude) {
+    Limbs limbs;
+    for (; magnitude; magnitude >>= 32) {
+        limbs.push_back(static_cast<uint32_t>(magnitude));
+    }
+    return {negative, std::move(limbs)};
+}
+
+Integer Unpack(Value value) {
+    if (value.IsFixnum()) {
+        auto number = value.GetFixnum();
+        return MakeInteger(number < 0, number < 0 ? 0 - static_cast<uint64_t>(number) : number);
+    }
+
+    auto big = AsBignum(value);
+    if (!big) {
+        ThrowNotNumber();
+    }
+    return {big->negative, big->limbs};
+}
+
+/* A fixnum whenever the result fits one */
+Value Pack(Heap& heap, bool negative, Limbs limbs) {
+    Trim(limbs);
+    if (limbs.size() <= 2) {
+        uint64_t magnitude = 0;
+        for (size_t i = limbs.size(); i-- > 0;) {
+            magnitude = (magnitude << 32) | limbs[i];
+        }
+        if (magnitude <= static_cast<uint64_t>(Value::kFixnumMax) + negative) {
+            auto number = static_cast<int64_t>(magnitude);
+            return Value::MakeFixnum(negative ? -number : number);
+        }
+    }
+
+    return Value::MakeObject(heap.New<Bignum>(negative, std::move(limbs)));
+}
+
+Value Pack(Heap& heap, Integer number) {
+    return Pack(heap, number.negative, std::move(number.limbs));
+}
+
+int CompareMagnitudes(const Limbs& lhs, const Limbs& rhs) {
+    if (lhs.size() != rhs.size()) {
+        return lhs.size() < rhs.size() ? -1 : 1;
+    }
+
+    for (size_t i = lhs.size(); i-- > 0;) {
+        if (lhs[i] != rhs[i]) {
+            return lhs[i] < rhs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+Limbs AddMagnitudes(const Limbs& lhs, const Limbs& rhs) {
+    auto& longer = lhs.size() < rhs.size() ? rhs : lhs;
+    auto& shorter = lhs.size() < rhs.size() ? lhs : rhs;
+
+    Limbs sum(longer.size() + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < longer.size(); ++i) {
+        carry += uint64_t(longer[i]) + (i < shorter.size() ? shorter[i] : 0);
+        sum[i] = static_cast<uint32_t>(carry);
+        carry >>= 32;
+    }
+    sum.back() = static_cast<uint32_t>(carry);
+
+    Trim(sum);
+    return sum;
+}
+
+/* lhs must not be smaller than rhs */
+Limbs SubMagnitudes(const Limbs& lhs, const Limbs& rhs) {
+    Limbs difference(lhs.size());
+    int64_t borrow = 0;
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        int64_t digit = int64_t(lhs[i]) - borrow - (i < rhs.size() ? rhs[i] : 0);
+        borrow = digit < 0;
+        difference[i] = static_cast<uint32_t>(digit + (borrow ? kBase : 0));
+    }
+
+    Trim(difference);
+    return difference;
+}
+
+/* Adds addend shifted by shift limbs into sum, which has room for the carry */
+void AddShifted(Limbs& sum, const Limbs& addend, size_t shift) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < addend.size(); ++i) {
+        carry += uint64_t(sum[i + shift]) + addend[i];
+        sum[i + shift] = static_cast<uint32_t>(carry);
+        carry >>= 32;
+    }
+    for (i += shift; carry; ++i) {
+        carry += sum[i];
+        sum[i] = static_cast<uint32_t>(carry);
+        carry >>= 32;
+    }
+}
+
+Limbs Slice(const Limbs& limbs, size_t begin, size_t end) {
+    begin = std::min(begin, limbs.size());
+    end = std::min(end, limbs.size());
+
+    Limbs slice(limbs.begin() + begin, limbs.begin() + end);
+    Trim(slice);
+    return slice;
+}
+
+Limbs MulSchoolbook(const Limbs& lhs, const Limbs& rhs) {
+    Limbs product(lhs.size() + rhs.size());
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < rhs.size(); ++j) {
+            carry += uint64_t(lhs[i]) * rhs[j] + product[i + j];
+            product[i + j] = static_cast<uint32_t>(carry);
+            carry >>= 32;
+        }
+        product[i + rhs.size()] = static_cast<uint32_t>(carry);
+    }
+
+    Trim(product);
+    return product;
+}
+
+/* Karatsuba: with x = x1 B + x0 and y = y1 B + y0, xy is
+ * x1 y1 B^2 + ((x0 + x1)(y0 + y1) - x0 y0 - x1 y1) B + x0 y0,
+ * three half size products instead of four */
+Limbs MulMagnitudes(const Limbs& lhs, const Limbs& rhs) {
+    if (lhs.empty() || rhs.empty()) {
+        return {};
+    }
+    if (std::min(lhs.size(), rhs.size()) < kKaratsubaThreshold) {
+        return MulSchoolbook(lhs, rhs);
+    }
+
+    auto half = std::max(lhs.size(), rhs.size()) / 2;
+    auto lhs_low = Slice(lhs, 0, half);
+    auto lhs_high = Slice(lhs, half, lhs.size());
+    auto rhs_low = Slice(rhs, 0, half);
+    auto rhs_high = Slice(rhs, half, rhs.size());
+
+    auto low = MulMagnitudes(lhs_low, rhs_low);
+    auto high = MulMagnitudes(lhs_high, rhs_high);
+    auto middle = MulMagnitudes(AddMagnitudes(lhs_low, lhs_high), AddMagnitudes(rhs_low, rhs_high));
+    middle = SubMagnitudes(SubMagnitudes(middle, low), high);
+
+    Limbs product(lhs.size() + rhs.size() + 1);
+    AddShifted(product, low, 0);
+    AddShifted(product, middle, half);
+    AddShifted(product, high, 2 * half);
+
+    Trim(product);
+    return product;
+}
+
+/* limbs * factor + addend in place */
+void MultiplyAddSmall(Limbs& limbs, uint32_t factor, uint32_t addend) {
+    uint64_t carry = addend;
+    for (auto& limb : limbs) {
+        carry += uint64_t(limb) * factor;
+        limb = static_cast<uint32_t>(carry);
+        carry >>= 32;
+    }
+    if (carry) {
+        limbs.push_back(static_cast<uint32_t>(carry));
+    }
+}
+
+/* Quotient by a single limb, the remainder is returned */
+uint32_t DivideBySmall(Limbs& limbs, uint32_t divisor) {
+    uint64_t remainder = 0;
+    for (size_t i = limbs.size(); i-- > 0;) {
+        auto current = (remainder << 32) | limbs[i];
+        limbs[i] = static_cast<uint32_t>(current / divisor);
+        remainder = current % divisor;
+    }
+
+    Trim(limbs);
+    return static_cast<uint32_t>(remainder);
+}
+
+Limbs ShiftLeft(const Limbs& limbs, int shift, size_t size) {
+    Limbs shifted(size);
+    for (size_t i = 0; i < limbs.size(); ++i) {
+        shifted[i] |= limbs[i] << shift;
+        if (shift && i + 1 < size) {
+            shifted[i + 1] = limbs[i] >> (32 - shift);
+        }
+    }
+    return shifted;
+}
+
+/* Truncated quotient of the magnitudes, Knuth's algorithm D, and the
+ * remainder if asked for */
+Limbs DivMagnitudes(const Limbs& dividend, const Limbs& divisor, Limbs* remainder = nullptr) {
+    if (CompareMagnitudes(dividend, divisor) < 0) {
+        if (remainder) {
+            *remainder = dividend;
+        }
+        return {};
+    }
+    if (divisor.size() == 1) {
+        auto quotient = dividend;
+        auto rest = DivideBySmall(quotient, divisor[0]);
+        if (remainder) {
+            *remainder = rest ? Limbs{rest} : Limbs{};
+        }
+        return quotient;
+    }
+
+    /* Normalized so the top limb of the divisor has its high bit set,
+     * which keeps every estimate of a quotient digit at most two off */
+    auto shift = __builtin_clz(divisor.back());
+    auto u = ShiftLeft(dividend, shift, dividend.size() + 1);
+    auto v = ShiftLeft(divisor, shift, divisor.size());
+    auto n = v.size();
+    auto m = dividend.size() - n;
+
+    Limbs quotient(m + 1);
+    for (size_t j = m + 1; j-- > 0;) {
+        auto numerator = (uint64_t(u[j + n]) << 32) | u[j + n - 1];
+        auto estimate = numerator / v[n - 1];
+        auto remainder = numerator % v[n - 1];
+        while (estimate >= kBase ||
+               estimate * v[n - 2] > ((remainder << 32) | u[j + n - 2])) {
+            --estimate;
+            remainder += v[n - 1];
+            if (remainder >= kBase) {
+                break;
+            }
+        }
+
+        /* u -= estimate * v, shifted by j */
+        int64_t borrow = 0;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto product = estimate * v[i] + carry;
+            carry = product >> 32;
+            int64_t digit = int64_t(u[i + j]) - borrow - int64_t(product & 0xffffffff);
+            u[i + j] = static_cast<uint32_t>(digit);
+            borrow = digit < 0;
+        }
+        int64_t top = int64_t(u[j + n]) - borrow - int64_t(carry);
+        u[j + n] = static_cast<uint32_t>(top);
+
+        /* The estimate was one too large, v goes back once */
+        if (top < 0) {
+            --estimate;
+            uint64_t sum = 0;
+            for (size_t i = 0; i < n; ++i) {
+                sum += uint64_t(u[i + j]) + v[i];
+                u[i + j] = static_cast<uint32_t>(sum);
+                sum >>= 32;
+            }
+            u[j + n] += static_cast<uint32_t>(sum);
+        }
+        quotient[j] = static_cast<uint32_t>(estimate);
+    }
+
+    /* What is left of u, normalized back */
+    if (remainder) {
+        remainder->assign(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            (*remainder)[i] = u[i] >> shift;
+            if (shift) {
+                (*remainder)[i] |= static_cast<uint32_t>(uint64_t(u[i + 1]) << (32 - shift));
+            }
+        }
+        Trim(*remainder);
+    }
+
+    Trim(quotient);
+    return quotient;
+}
+
+Limbs GcdMagnitudes(Limbs lhs, Limbs rhs) {
+    while (!rhs.empty()) {
+        if (lhs.size() <= 2 && rhs.size() <= 2) {
+            auto join = [](const Limbs& limbs) {
+                uint64_t value = 0;
+                for (size_t i = limbs.size(); i-- > 0;) {
+                    value = (value << 32) | limbs[i];
+                }
+                return value;
+            };
+            return MakeInteger(false, std::gcd(join(lhs), join(rhs))).limbs;
+        }
+
+        Limbs remainder;
+        DivMagnitudes(lhs, rhs, &remainder);
+        lhs = std::move(rhs);
+        rhs = std::move(remainder);
+    }
+    return lhs;
+}
+
+/* lhs + rhs, rhs negated first for a difference */
+Integer AddIntegers(const Integer& lhs, Integer rhs, bool negate) {
+    if (negate) {
+        rhs.negative = !rhs.negative;
+    }
+
+    if (lhs.negative == rhs.negative) {
+        return {lhs.negative, AddMagnitudes(lhs.limbs, rhs.limbs)};
+    }
+    if (CompareMagnitudes(lhs.limbs, rhs.limbs) >= 0) {
+        return {lhs.negative, SubMagnitudes(lhs.limbs, rhs.limbs)};
+    }
+    return {rhs.negative, SubMagnitudes(rhs.limbs, lhs.limbs)};
+}
+
+Integer MulIntegers(const Integer& lhs, const Integer& rhs) {
+    return {lhs.negative != rhs.negative, MulMagnitudes(lhs.limbs, rhs.limbs)};
+}
+
+int CompareIntegers(const Integer& lhs, const Integer& rhs) {
+    /* Zero may come either way */
+    bool left_negative = lhs.negative && !lhs.limbs.empty();
+    bool right_negative = rhs.negative && !rhs.limbs.empty();
+    if (left_negative != right_negative) {
+        return left_negative ? -1 : 1;
+    }
+
+    auto magnitude = CompareMagnitudes(lhs.limbs, rhs.limbs);
+    return left_negative ? -magnitude : magnitude;
+}
+
+/* Exact numbers as fractions, integers over one */
+struct Rational {
+    Integer numerator;
+    Integer denominator;
+};
+
+Rational UnpackRational(Value value) {
+    if (auto ratio = AsRatio(value)) {
+        return {Unpack(ratio->numerator), Unpack(ratio->denominator)};
+    }
+    return {Unpack(value), MakeInteger(false, 1)};
+}
+
+/* In lowest terms with a positive denominator, an integer if that is one */
+Value PackRational(Heap& heap, Integer numerator, Integer denominator) {
+    bool negative = numerator.negative != denominator.negative;
+    auto divisor = GcdMagnitudes(numerator.limbs, denominator.limbs);
+    if (divisor.size() != 1 || divisor[0] != 1) {
+        numerator.limbs = DivMagnitudes(numerator.limbs, divisor);
+        denominator.limbs = DivMagnitudes(denominator.limbs, divisor);
+    }
+
+    if (denominator.limbs.size() == 1 && denominator.limbs[0] == 1) {
+        return Pack(heap, negative, std::move(numerator.limbs));
+    }
+    auto top = Pack(heap, negative, std::move(numerator.limbs));
+    auto bottom = Pack(heap, false, std::move(denominator.limbs));
+    return Value::MakeObject(heap.New<Ratio>(top, bottom));
+}
+
+/* lhs + rhs over the common denominator, rhs negated for a difference */
+Value AddRationals(Heap& heap, const Rational& lhs, const Rational& rhs, bool negate) {
+    auto numerator = AddIntegers(MulIntegers(lhs.numerator, rhs.denominator),
+                                 MulIntegers(rhs.numerator, lhs.denominator), negate);
+    return PackRational(heap, std::move(numerator),
+                        MulIntegers(lhs.denominator, rhs.denominator));
+}
+
+/* The magnitude as mantissa * 2^exponent, the mantissa from the top three
+ * limbs, which is more than a double keeps */
+double ScaledMagnitude(const Limbs& limbs, int* exponent) {
+    size_t skipped = limbs.size() > 3 ? limbs.size() - 3 : 0;
+    double mantissa = 0;
+    for (size_t i = limbs.size(); i-- > skipped;) {
+        mantissa = mantissa * double(kBase) + limbs[i];
+    }
+    *exponent = static_cast<int>(32 * skipped);
+    return mantissa;
+}
+
+double ToDouble(Value value) {
+    switch (KindOf(value)) {
+        case NumberKind::FIXNUM:
+            return static_cast<double>(value.GetFixnum());
+        case NumberKind::FLONUM:
+            return value.IsFlonum() ? value.GetFlonum() : AsFlonum(value)->value;
+        case NumberKind::BIGNUM: {
+            int exponent;
+            auto big = AsBignum(value);
+            auto mantissa = ScaledMagnitude(big->limbs, &exponent);
+            return std::ldexp(big->negative ? -mantissa : mantissa, exponent);
+            }
+        case NumberKind::RATIO: {
+            /* Scaled separately so huge terms do not overflow on the way */
+            auto fraction = UnpackRational(value);
+            int top_exponent;
+            int bottom_exponent;
+            auto top = ScaledMagnitude(fraction.numerator.limbs, &top_exponent);
+            auto bottom = ScaledMagnitude(fraction.denominator.limbs, &bottom_exponent);
+            auto quotient = std::ldexp(top / bottom, top_exponent - bottom_exponent);
+            return fraction.numerator.negative ? -quotient : quotient;
+            }
+        default:
+            ThrowNotNumber();
+    }
+}
+
+/* The larger kind of the two, throws if either is not a number */
+NumberKind CommonKind(Value lhs, Value rhs) {
+    auto kind = std::max(KindOf(lhs), KindOf(rhs));
+    if (kind == NumberKind::NONE) {
+        ThrowNotNumber();
+    }
+    return kind;
+}
+
+int CompareDoubles(double lhs, double rhs) {
+    return lhs == rhs ? 0 : lhs < rhs ? -1 : lhs > rhs ? 1 : kUnordered;
+}
+
+/* Shortest decimal that reads back as the same double, in fixed notation
+ * for exponents from -4 to 15 and scientific otherwise */
+std::string FormatDouble(double number) {
+    if (std::isnan(number)) {
+        return "+nan.0";
+    }
+    if (std::isinf(number)) {
+        return number > 0 ? "+inf.0" : "-inf.0";
+    }
+
+    char buffer[32];
+    int precision = 0;
+    for (; precision < 17; ++precision) {
+        std::snprintf(buffer, sizeof(buffer), "%.*e", precision, number);
+        if (std::strtod(buffer, nullptr) == number) {
+            break;
+        }
+    }
+
+    int exponent = std::atoi(std::strchr(buffer, 'e') + 1);
+    if (exponent < -4 || exponent >= 16) {
+        return buffer;
+    }
+
+    /* Always marked as inexact, 1.0 rather than 1 */
+    std::snprintf(buffer, sizeof(buffer), "%.*f", std::max(precision - exponent, 1), number);
+    return buffer;
+}
+
+/* Unsigned decimal digits, at least one and as many as it takes. Nine at
+ * a time, which is what fits a limb. */
+bool ParseDigits(std::string_view digits, Limbs* value) {
+    if (digits.empty()) {
+        return false;
+    }
+
+    value->clear();
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (auto symb : digits) {
+        unsigned digit = static_cast<unsigned char>(symb) - '0';
+        if (digit > 9) {
+            return false;
+        }
+        chunk = chunk * 10 + digit;
+        scale *= 10;
+        if (scale == 1000000000) {
+            MultiplyAddSmall(*value, scale, chunk);
+            chunk = 0;
+            scale = 1;
+        }
+    }
+    if (scale > 1) {
+        MultiplyAddSmall(*value, scale, chunk);
+    }
+
+    Trim(*value);
+    return true;
+}
+
+/* digits [. digits] [e [sign] digits] with a point or an exponent, and
+ * a digit somewhere before the exponent */
+bool IsDecimal(std::string_view token) {
+    size_t pos = 0;
+    size_t digits = 0;
+    auto skip_digits = [&token, &pos] {
+        size_t begin = pos;
+        while (pos < token.size() && std::isdigit(static_cast<unsigned char>(token[pos]))) {
+            ++pos;
+        }
+        return pos - begin;
+    };
+
+    digits += skip_digits();
+    bool point = pos < token.size() && token[pos] == '.';
+    if (point) {
+        ++pos;
+        digits += skip_digits();
+    }
+    if (!digits) {
+        return false;
+    }
+
+    bool exponent = pos < token.size() && (token[pos] == 'e' || token[pos] == 'E');
+    if (exponent) {
+        ++pos;
+        if (pos < token.size() && (token[pos] == '+' || token[pos] == '-')) {
+            ++pos;
+        }
+        if (!skip_digits()) {
+            return false;
+        }
+    }
+
+    return pos == token.size() && (point || exponent);
+}
+
+/* Literals are born marked, so the collector of any heap running the code
+ * holding them neither traces nor frees them */
+void MakePermanent(Value value) {
+    if (!value.IsObject()) {
+        return;
+    }
+
+    value.GetObject()->marked = true;
+    if (auto ratio = AsRatio(value)) {
+        MakePermanent(ratio->numerator);
+        MakePermanent(ratio->denominator);
+    }
+}
+
+/* The heap of the literals of a program, made on the first boxed one */
+template <class Make>
+Value MakeLiteral(std::shared_ptr<Heap>* literals, Make make) {
+    if (!*literals) {
+        *literals = std::make_shared<Heap>();
+    }
+
+    auto value = make(**literals);
+    MakePermanent(value);
+    return value;
+}
+
+}
+
+void CheckNumber(Value value) {
+    if (!IsNumber(value)) {
+        ThrowNotNumber();
+    }
+}
+
+int64_t TakeFixnum(Value value) {
+    if (!value.IsFixnum()) {
+        ThrowNotNumber();
+    }
+
+    return value.GetFixnum();
+}
+
+Value BoxFlonum(Heap& heap, double number) {
+    return Value::MakeObject(heap.New<Flonum>(number));
+}
+
+Value CopyNumber(Heap& heap, Value number) {
+    switch (KindOf(number)) {
+        case NumberKind::BIGNUM: {
+            auto big = AsBignum(number);
+            return Value::MakeObject(heap.New<Bignum>(big->negative, big->limbs));
+            }
+        case NumberKind::RATIO: {
+            auto ratio = AsRatio(number);
+            return Value::MakeObject(heap.New<Ratio>(CopyNumber(heap, ratio->numerator),
+                                                     CopyNumber(heap, ratio->denominator)));
+            }
+        case NumberKind::FLONUM:
+            return number.IsFlonum() ? number : BoxFlonum(heap, AsFlonum(number)->value);
+        default:
+            return number;
+    }
+}
+
+Value ToFlonum(Heap& heap, Value value) {
+    if (KindOf(value) == NumberKind::FLONUM) {
+        return value;
+    }
+
+    return MakeFlonum(heap, ToDouble(value));
+}
+
+Value GenericAdd(Heap& heap, Value lhs, Value rhs) {
+    switch (CommonKind(lhs, rhs)) {
+        case NumberKind::FLONUM:
+            return MakeFlonum(heap, ToDouble(lhs) + ToDouble(rhs));
+        case NumberKind::RATIO:
+            return AddRationals(heap, UnpackRational(lhs), UnpackRational(rhs), false);
+        default:
+            return Pack(heap, AddIntegers(Unpack(lhs), Unpack(rhs), false));
+    }
+}
+
+Value GenericSub(Heap& heap, Value lhs, Value rhs) {
+    switch (CommonKind(lhs, rhs)) {
+        case NumberKind::FLONUM:
+            return MakeFlonum(heap, ToDouble(lhs) - ToDouble(rhs));
+        case NumberKind::RATIO:
+            return AddRationals(heap, UnpackRational(lhs), UnpackRational(rhs), true);
+        default:
+            return Pack(heap, AddIntegers(Unpack(lhs), Unpack(rhs), true));
+    }
+}
+
+Value GenericMul(Heap& heap, Value lhs, Value rhs) {
+    switch (CommonKind(lhs, rhs)) {
+        case NumberKind::FLONUM:
+            return MakeFlonum(heap, ToDouble(lhs) * ToDouble(rhs));
+        case NumberKind::RATIO: {
+            auto left = UnpackRational(lhs);
+            auto right = UnpackRational(rhs);
+            return PackRational(heap, MulIntegers(left.numerator, right.numerator),
+                                MulIntegers(left.denominator, right.denominator));
+            }
+        default:
+            return Pack(heap, MulIntegers(Unpack(lhs), Unpack(rhs)));
+    }
+}
+
+Value GenericDiv(Heap& heap, Value lhs, Value rhs) {
+    if (CommonKind(lhs, rhs) == NumberKind::FLONUM) {
+        return MakeFlonum(heap, ToDouble(lhs) / ToDouble(rhs));
+    }
+
+    auto left = UnpackRational(lhs);
+    auto right = UnpackRational(rhs);
+    if (right.numerator.limbs.empty()) {
+        throw std::runtime_error("ERROR: Division by zero\n");
+    }
+
+    return PackRational(heap, MulIntegers(left.numerator, right.denominator),
+                        MulIntegers(left.denominator, right.numerator));
+}
+
+Value GenericAbs(Heap& heap, Value value) {
+    switch (KindOf(value)) {
+        case NumberKind::FLONUM:
+            return MakeFlonum(heap, std::fabs(ToDouble(value)));
+        case NumberKind::RATIO: {
+            auto ratio = AsRatio(value);
+            if (GenericCompare(ratio->numerator, Value::MakeFixnum(0)) > 0) {
+                return value;
+            }
+            auto numerator = GenericAbs(heap, ratio->numerator);
+            return Value::MakeObject(heap.New<Ratio>(numerator, ratio->denominator));
+            }
+        default:
+            return Pack(heap, false, Unpack(value).limbs);
+    }
+}
+
+int GenericCompare(Value lhs, Value rhs) {
+    switch (CommonKind(lhs, rhs)) {
+        case NumberKind::FLONUM:
+            return CompareDoubles(ToDouble(lhs), ToDouble(rhs));
+        case NumberKind::RATIO: {
+            /* Denominators are positive, so cross multiplying keeps the order */
+            auto left = UnpackRational(lhs);
+            auto right = UnpackRational(rhs);
+            return CompareIntegers(MulIntegers(left.numerator, right.denominator),
+                                   MulIntegers(right.numerator, left.denominator));
+            }
+        default:
+            return CompareIntegers(Unpack(lhs), Unpack(rhs));
+    }
+}
+
+bool NumberEqv(Value lhs, Value rhs) {
+    auto kind = KindOf(lhs);
+    if (kind != KindOf(rhs)) {
+        return false;
+    }
+
+    switch (kind) {
+        case NumberKind::FIXNUM:
+            return lhs == rhs;
+        case NumberKind::BIGNUM:
+            return !GenericCompare(lhs, rhs);
+        case NumberKind::RATIO:
+            return NumberEqv(AsRatio(lhs)->numerator, AsRatio(rhs)->numerator) &&
+                   NumberEqv(AsRatio(lhs)->denominator, AsRatio(rhs)->denominator);
+        case NumberKind::FLONUM: {
+            /* Bit for bit, so -0.0 is not 0.0 and a NaN is itself */
+            auto left = ToDouble(lhs);
+            auto right = ToDouble(rhs);
+            return std::memcmp(&left, &right, sizeof(left)) == 0;
+            }
+        default:
+            return false;
+    }
+}
+
+std::string NumberToString(Value value) {
+    switch (KindOf(value)) {
+        case NumberKind::FIXNUM:
+            return std::to_string(value.GetFixnum());
+        case NumberKind::FLONUM:
+            return FormatDouble(ToDouble(value));
+        case NumberKind::RATIO:
+            return NumberToString(AsRatio(value)->numerator) + "/" +
+                   NumberToString(AsRatio(value)->denominator);
+        case NumberKind::BIGNUM:
+            break;
+        default:
+            ThrowNotNumber();
+    }
+
+    /* Nine decimal digits at a time, least significant first */
+    auto number = Unpack(value);
+    std::vector<uint32_t> chunks;
+    while (!number.limbs.empty()) {
+        chunks.push_back(DivideBySmall(number.limbs, 1000000000));
+    }
+
+    /* Bignums are never zero */
+    std::string digits = number.negative ? "-" : "";
+    digits += std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        auto chunk = std::to_string(chunks[i]);
+        digits += std::string(9 - chunk.size(), '0') + chunk;
+    }
+
+    return digits;
+}
+
+bool IsZeroRatio(std::string_view token) {
+    auto unsigned_part = token.substr(token[0] == '-' || token[0] == '+');
+    auto slash = unsigned_part.find('/');
+    Limbs numerator;
+    Limbs denominator;
+    return slash != std::string_view::npos &&
+           ParseDigits(unsigned_part.substr(0, slash), &numerator) &&
+           ParseDigits(unsigned_part.substr(slash + 1), &denominator) && denominator.empty();
+}
+
+bool ParseNumberLiteral(std::string_view token, std::shared_ptr<Heap>* literals, Value* value) {
+    if (token.size() > kMaxNumberLength) {
+        return false;
+    }
+
+    bool negative = token[0] == '-';
+    auto unsigned_part = token.substr(negative || token[0] == '+');
+
+    if (unsigned_part.size() < token.size() && (unsigned_part == "inf.0" || unsigned_part == "nan.0")) {
+        auto number = unsigned_part[0] == 'i' ? HUGE_VAL : std::nan("");
+        number = negative ? -number : number;
+        *value = MakeLiteral(literals, [number](Heap& heap) { return BoxFlonum(heap, number); });
+        return true;
+    }
+
+    auto slash = unsigned_part.find('/');
+    if (slash != std::string_view::npos) {
+        Limbs numerator;
+        Limbs denominator;
+        if (!ParseDigits(unsigned_part.substr(0, slash), &numerator) ||
+            !ParseDigits(unsigned_part.substr(slash + 1), &denominator) || denominator.empty()) {
+            return false;
+        }
+
+        *value = MakeLiteral(literals, [&](Heap& heap) {
+            return PackRational(heap, {negative, std::move(numerator)},
+                                {false, std::move(denominator)});
+        });
+        return true;
+    }
+
+    /* Integers out of the fixnum range */
+    Limbs magnitude;
+    if (ParseDigits(unsigned_part, &magnitude)) {
+        *value = MakeLiteral(literals, [&](Heap& heap) {
+            return Pack(heap, negative, std::move(magnitude));
+        });
+        return true;
+    }
+
+    if (!IsDecimal(unsigned_part)) {
+        return false;
+    }
+    auto number = std::strtod(std::string(token).c_str(), nullptr);
+    if (Value::FitsFlonum(number)) {
+        *value = Value::MakeFlonum(number);
+    } else {
+        *value = MakeLiteral(literals, [number](Heap& heap) { return BoxFlonum(heap, number); });
+    }
+    return true;
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "heap.h"
+#include "value.h"
+
+/* Arithmetic every backend shares. Two fixnums or two immediate flonums
+ * are handled inline, anything else goes through the out of line generic
+ * path, which dispatches on NumberKind: integers promote to bignums and
+ * back, a quotient that is not whole is an exact ratio, and a flonum
+ * operand makes the result a flonum. Operands that are not numbers throw. */
+
+/* In the order of contagion, the result of mixing two kinds is the larger */
+enum class NumberKind : uint8_t {
+    FIXNUM,
+    BIGNUM,
+    RATIO,
+    FLONUM,
+    NONE
+};
+
+inline NumberKind KindOf(Value value) {
+    if (value.IsFixnum()) {
+        return NumberKind::FIXNUM;
+    }
+    if (value.IsFlonum()) {
+        return NumberKind::FLONUM;
+    }
+    if (!value.IsObject()) {
+        return NumberKind::NONE;
+    }
+
+    switch (value.GetObject()->type) {
+        case ObjectType::BIGNUM:
+            return NumberKind::BIGNUM;
+        case ObjectType::RATIO:
+            return NumberKind::RATIO;
+        case ObjectType::FLONUM:
+            return NumberKind::FLONUM;
+        default:
+            return NumberKind::NONE;
+    }
+}
+
+inline bool IsNumber(Value value) {
+    return KindOf(value) != NumberKind::NONE;
+}
+
+/* Throws unless value is a number */
+void CheckNumber(Value value);
+
+/* Throws unless value is a fixnum, for indices and counts */
+int64_t TakeFixnum(Value value);
+
+/* Boxes the doubles an immediate cannot hold */
+Value BoxFlonum(Heap& heap, double number);
+
+inline Value MakeFlonum(Heap& heap, double number) {
+    return Value::FitsFlonum(number) ? Value::MakeFlonum(number) : BoxFlonum(heap, number);
+}
+
+/* The same number as a flonum, rounded if it is exact */
+Value ToFlonum(Heap& heap, Value value);
+
+Value GenericAdd(Heap& heap, Value lhs, Value rhs);
+Value GenericSub(Heap& heap, Value lhs, Value rhs);
+Value GenericMul(Heap& heap, Value lhs, Value rhs);
+/* Exact for exact operands and throws on an exact zero divisor */
+Value GenericDiv(Heap& heap, Value lhs, Value rhs);
+Value GenericAbs(Heap& heap, Value value);
+int GenericCompare(Value lhs, Value rhs);
+
+/* Same kind and same value, for equal? on boxed numbers */
+bool NumberEqv(Value lhs, Value rhs);
+
+/* Decimal digits, n/d for a ratio, and a point or an exponent for a flonum */
+std::string NumberToString(Value value);
+
+/* Longest number literal read, converting the digits takes time quadratic
+ * in their count */
+constexpr size_t kMaxNumberLength = 10000;
+
+/* Flonum, ratio and integer literals like 1.5, -2e10, .5, +inf.0, 3/4 and
+ * 100000000000000000000, integers of any size and ratios of them. The
+ * boxed ones go to literals, made on first use, which is never collected
+ * and whose objects are born marked, so compiled code can hold them across
+ * heaps. Running code takes a CopyNumber of them. False for tokens longer
+ * than kMaxNumberLength. */
+bool ParseNumberLiteral(std::string_view token, std::shared_ptr<Heap>* literals, Value* value);
+
+/* The same number, boxed on heap if it is boxed at all */
+Value CopyNumber(Heap& heap, Value number);
+
+/* A ratio literal with a zero denominator like 1/0, which ParseNumberLiteral
+ * rejects */
+bool IsZeroRatio(std::string_view token);
+
+inline Value NumberAdd(Heap& heap, Value lhs, Value rhs) {
+    if (lhs.IsFixnum() && rhs.IsFixnum()) {
+        /* Two fixnums are at most 63 bits, their sum fits an int64_t */
+        auto res = lhs.GetFixnum() + rhs.GetFixnum();
+        if (Value::FitsFixnum(res)) {
+            return Value::MakeFixnum(res);
+        }
+    } else if (lhs.IsFlonum() && rhs.IsFlonum()) {
+        return MakeFlonum(heap, lhs.GetFlonum() + rhs.GetFlonum());
+    }
+
+    return GenericAdd(heap, lhs, rhs);
+}
+
+inline Value NumberSub(Heap& heap, Value lhs, Value rhs) {
+    if (lhs.IsFixnum() && rhs.IsFixnum()) {
+        auto res = lhs.GetFixnum() - rhs.GetFixnum();
+        if (Value::FitsFixnum(res)) {
+            return Value::MakeFixnum(res);
+        }
+    } else if (lhs.IsFlonum() && rhs.IsFlonum()) {
+        return MakeFlonum(heap, lhs.GetFlonum() - rhs.GetFlonum());
+    }
+
+    return GenericSub(heap, lhs, rhs);
+}
+
+inline Value NumberMul(Heap& heap, Value lhs, Value rhs) {
+    int64_t res;
+    if (lhs.IsFixnum() && rhs.IsFixnum()) {
+        if (!__builtin_mul_overflow(lhs.GetFixnum(), rhs.GetFixnum(), &res) &&
+            Value::FitsFixnum(res)) {
+            return Value::MakeFixnum(res);
+        }
+    } else if (lhs.IsFlonum() && rhs.IsFlonum()) {
+        return MakeFlonum(heap, lhs.GetFlonum() * rhs.GetFlonum());
+    }
+
+    return GenericMul(heap, lhs, rhs);
+}
+
+inline Value NumberDiv(Heap& heap, Value lhs, Value rhs) {
+    /* Whole quotients only, the smallest fixnum over -1 is the one out of range */
+    if (lhs.IsFixnum() && rhs.IsFixnum()) {
+        if (rhs.GetFixnum() > 0 && lhs.GetFixnum() % rhs.GetFixnum() == 0) {
+            return Value::MakeFixnum(lhs.GetFixnum() / rhs.GetFixnum());
+        }
+    } else if (lhs.IsFlonum() && rhs.IsFlonum()) {
+        return MakeFlonum(heap, lhs.GetFlonum() / rhs.GetFlonum());
+    }
+
+    return GenericDiv(heap, lhs, rhs);
+}
+
+inline Value NumberAbs(Heap& heap, Value value) {
+    if (value.IsFixnum() && value.GetFixnum() > Value::kFixnumMin) {
+        auto number = value.GetFixnum();
+        return Value::MakeFixnum(number > 0 ? number : -number);
+    }
+
+    return GenericAbs(heap, value);
+}
+
+/* What NumberCompare returns when either side is a NaN */
+constexpr int kUnordered = 2;
+
+/* Negative, zero or positive as lhs is less, equal or greater */
+inline int NumberCompare(Value lhs, Value rhs) {
+    if (lhs.IsFixnum() && rhs.IsFixnum()) {
+        return (lhs.GetFixnum() > rhs.GetFixnum()) - (lhs.GetFixnum() < rhs.GetFixnum());
+    }
+    if (lhs.IsFlonum() && rhs.IsFlonum()) {
+        auto left = lhs.GetFlonum();
+        auto right = rhs.GetFlonum();
+        return left == right ? 0 : left < right ? -1 : left > right ? 1 : kUnordered;
+    }
+
+    return GenericCompare(lhs, rhs);
+}
+
+/* Whether the ordering NumberCompare found satisfies compare against
+ * zero, which no comparison is for unordered operands */
+template <class Compare>
+bool NumberOrdered(int order, Compare compare) {
+    return order != kUnordered && compare(order, 0);
+}
+
+/* Whether every two neighbours of args are ordered by compare. Throws if
+ * any of them is not a number, whichever pair decides. */
+template <class Compare>
+bool NumbersOrdered(const Value* args, size_t argc, Compare compare) {
+    size_t i = 1;
+    while (i < argc && NumberOrdered(NumberCompare(args[i - 1], args[i]), compare)) {
+        ++i;
+    }
+    for (auto j = argc == 1 ? 0 : i + 1; j < argc; ++j) {
+        CheckNumber(args[j]);
+    }
+    return i >= argc;
+}
+
+/* The n-ary builtins, args holds argc values. Difference and quotient take
+ * at least one. */
+
+inline Value NumberSum(Heap& heap, const Value* args, size_t argc) {
+    auto res = Value::MakeFixnum(0);
+    for (size_t i = 0; i < argc; ++i) {
+        res = NumberAdd(heap, res, args[i]);
+    }
+    return res;
+}
+
+inline Value NumberDifference(Heap& heap, const Value* args, size_t argc) {
+    auto res = args[0];
+    if (argc == 1) {
+        CheckNumber(res);
+    }
+    for (size_t i = 1; i < argc; ++i) {
+        res = NumberSub(heap, res, args[i]);
+    }
+    return res;
+}
+
+inline Value NumberProduct(Heap& heap, const Value* args, size_t argc) {
+    auto res = Value::MakeFixnum(1);
+    for (size_t i = 0; i < argc; ++i) {
+        res = NumberMul(heap, res, args[i]);
+    }
+    return res;
+}
+
+inline Value NumberQuotient(Heap& heap, const Value* args, size_t argc) {
+    auto res = args[0];
+    if (argc == 1) {
+        CheckNumber(res);
+    }
+    for (size_t i = 1; i < argc; ++i) {
+        res = NumberDiv(heap, res, args[i]);
+    }
+    return res;
+}
+
+/* Minimum for a negative sign, maximum for a positive one, a flonum if
+ * any of the arguments is */
+inline Value NumberExtremum(Heap& heap, const Value* args, size_t argc, int sign) {
+    auto res = args[0];
+    CheckNumber(res);
+    bool inexact = KindOf(res) == NumberKind::FLONUM;
+    for (size_t i = 1; i < argc; ++i) {
+        auto order = NumberCompare(args[i], res);
+        if (order != kUnordered && order * sign > 0) {
+            res = args[i];
+        }
+        inexact |= KindOf(args[i]) == NumberKind::FLONUM;
+    }
+    return inexact ? ToFlonum(heap, res) : res;
+}
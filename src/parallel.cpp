@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "parallel.h"
+#include "pool.h"
+#include "vm.h"
+
+namespace {
+
+/* Below this many elements starting the threads costs more than it saves */
+constexpr size_t kSequentialCutoff = 8;
+/* Chunks per slot, more of them let thieves even out uneven elements */
+constexpr size_t kChunksPerSlot = 4;
+
+enum class Mode {
+    MAP,
+    FOR_EACH,
+    REDUCE
+};
+
+WorkStealingPool& SharedPool() {
+    static WorkStealingPool pool;
+    return pool;
+}
+
+/* What the builtin holds across calls, a root of the heap since calls made
+ * outside of a section may collect and move cells */
+struct State {
+    Value procedure;
+    Value initial;
+    std::vector<Value> elements;
+    /* One per element for a map, one per chunk for a reduction */
+    std::vector<Value> results;
+};
+
+class Roots {
+public:
+    Roots(Heap& heap, State& state)
+            : heap_(heap)
+            , id_(heap.AddRoots([&state](Heap& heap) {
+                heap.Mark(state.procedure);
+                heap.Mark(state.initial);
+                for (auto& value : state.elements) {
+                    heap.Mark(value);
+                }
+                for (auto& value : state.results) {
+                    heap.Mark(value);
+                }
+            })) {}
+
+    ~Roots() {
+        heap_.RemoveRoots(id_);
+    }
+
+private:
+    Heap& heap_;
+    size_t id_;
+};
+
+/* Calls procedure on the elements from begin to end, for a reduction
+ * into accumulator. Returns where it stopped, early once the section it
+ * runs in is full. */
+size_t RunChunk(const Heap& heap, Mode mode, State& state, Caller& caller, size_t begin,
+                size_t end, Value* accumulator) {
+    for (auto i = begin; i < end; ++i) {
+        if (heap.InParallel() && heap.SectionFull()) {
+            return i;
+        }
+        if (mode == Mode::REDUCE) {
+            Value args[] = {*accumulator, state.elements[i]};
+            *accumulator = caller.Call(state.procedure, args, 2);
+        } else {
+            auto result = caller.Call(state.procedure, &state.elements[i], 1);
+            if (mode == Mode::MAP) {
+                state.results[i] = result;
+            }
+        }
+    }
+    return end;
+}
+
+/* Leaves the results in state, a single one for a reduction */
+void Run(Heap& heap, Mode mode, State& state, const CallerFactory& callers) {
+    auto count = state.elements.size();
+    if (count < kSequentialCutoff || heap.InParallel()) {
+        state.results.assign(mode == Mode::REDUCE ? 1 : mode == Mode::MAP ? count : 0,
+                             state.initial);
+        RunChunk(heap, mode, state, *callers(), 0, count, state.results.data());
+        return;
+    }
+
+    auto& pool = SharedPool();
+    auto chunks = std::min(count, pool.Slots() * kChunksPerSlot);
+    state.results.assign(mode == Mode::REDUCE ? chunks : mode == Mode::MAP ? count : 0,
+                         state.initial);
+
+    /* Where each chunk stopped */
+    std::vector<size_t> stops(chunks);
+    auto begin = [count, chunks](size_t chunk) {
+        return count * chunk / chunks;
+    };
+    {
+        /* Made on first use, a slot may never get a chunk */
+        std::vector<std::unique_ptr<Caller>> slot_callers(pool.Slots());
+        struct Section {
+            explicit Section(Heap& heap)
+                    : heap(heap) {
+                heap.BeginParallel();
+            }
+            ~Section() {
+                heap.EndParallel();
+            }
+            Heap& heap;
+        } section(heap);
+
+        pool.ParallelFor(chunks, 1, [&](size_t slot, size_t chunk) {
+            auto& caller = slot_callers[slot];
+            if (!caller) {
+                caller = callers();
+            }
+            auto accumulator = mode == Mode::REDUCE ? &state.results[chunk] : nullptr;
+            stops[chunk] =
+                    RunChunk(heap, mode, state, *caller, begin(chunk), begin(chunk + 1), accumulator);
+        });
+    }
+
+    /* Collections are fine again, for what a full section left and for
+     * the chunks of a reduction in order */
+    auto caller = callers();
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        auto accumulator = mode == Mode::REDUCE ? &state.results[chunk] : nullptr;
+        RunChunk(heap, mode, state, *caller, stops[chunk], begin(chunk + 1), accumulator);
+    }
+    if (mode == Mode::REDUCE) {
+        for (size_t chunk = 1; chunk < chunks; ++chunk) {
+            Value args[] = {state.results[0], state.results[chunk]};
+            state.results[0] = caller->Call(state.procedure, args, 2);
+        }
+    }
+}
+
+Value Run(Heap& heap, Mode mode, Value procedure, Value initial, Value list,
+          const CallerFactory& callers) {
+    CheckCallee(procedure, mode == Mode::REDUCE ? 2 : 1);
+    if (!IsList(list)) {
+        throw std::runtime_error("ERROR: Expected a list\n");
+    }
+
+    State state{procedure, initial, {}, {}};
+    for (; list.IsPair(); list = list.GetCell()->cdr) {
+        state.elements.push_back(list.GetCell()->car);
+    }
+    Roots roots(heap, state);
+    Run(heap, mode, state, callers);
+
+    if (mode == Mode::REDUCE) {
+        return state.results[0];
+    }
+    if (mode == Mode::FOR_EACH) {
+        return Value();
+    }
+
+    /* Cells go to the old space once the nursery is full, nothing collects */
+    auto result = Value::MakeNil();
+    for (auto i = state.results.size(); i-- > 0;) {
+        result = Value::MakePair(heap.NewCell(state.results[i], result));
+    }
+    return result;
+}
+
+}
+
+Value ParallelMap(Heap& heap, Value procedure, Value list, const CallerFactory& callers) {
+    return Run(heap, Mode::MAP, procedure, Value(), list, callers);
+}
+
+void ParallelForEach(Heap& heap, Value procedure, Value list, const CallerFactory& callers) {
+    Run(heap, Mode::FOR_EACH, procedure, Value(), list, callers);
+}
+
+Value ParallelReduce(Heap& heap, Value procedure, Value initial, Value list,
+                     const CallerFactory& callers) {
+    return Run(heap, Mode::REDUCE, procedure, initial, list, callers);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "heap.h"
+#include "value.h"
+
+/* pmap, pfor-each and preduce, which both closure backends share. The
+ * elements of the list are split in chunks run on a work stealing pool
+ * shared by the process, each thread calling the procedure through an
+ * evaluator of its own sharing the globals of the one calling the builtin.
+ * Short lists and calls made inside a parallel section run sequentially
+ * on the calling thread instead.
+ *
+ * A section keeps the heap from collecting until it is over, see
+ * Heap::BeginParallel, and throws on assignments to globals. Procedures
+ * assigning captured variables or mutating shared lists race. */
+
+/* Calls procedures for one thread */
+class Caller {
+public:
+    virtual ~Caller() = default;
+
+    virtual Value Call(Value procedure, const Value* args, size_t argc) = 0;
+};
+
+/* Called on the thread that is going to use the caller */
+using CallerFactory = std::function<std::unique_ptr<Caller>()>;
+
+/* The values of procedure on every element, in order */
+Value ParallelMap(Heap& heap, Value procedure, Value list, const CallerFactory& callers);
+
+void ParallelForEach(Heap& heap, Value procedure, Value list, const CallerFactory& callers);
+
+/* Chunks are reduced from initial on their own and then together in
+ * order, so procedure has to be associative and initial its identity */
+Value ParallelReduce(Heap& heap, Value procedure, Value initial, Value list,
+                     const CallerFactory& callers);
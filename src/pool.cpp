@@ -0,0 +1,171 @@
+#include <algorithm>
+#include "pool.h"
+
+namespace {
+
+/* Which pool the current thread works for and in which slot */
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_slot = 0;
+
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+        : queued_(0)
+        , stop_(false) {
+    if (!threads) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+    for (size_t i = 0; i <= threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t slot = 0; slot < threads; ++slot) {
+        threads_.emplace_back([this, slot] { WorkerLoop(slot); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+size_t WorkStealingPool::Slots() const {
+    return queues_.size();
+}
+
+void WorkStealingPool::ParallelFor(size_t count, size_t grain, const Body& body) {
+    if (!count) {
+        return;
+    }
+
+    /* A worker running a nested loop keeps its slot, anyone else gets the
+     * last one */
+    bool nested = current_pool == this;
+    std::unique_lock<std::mutex> caller;
+    if (!nested) {
+        caller = std::unique_lock<std::mutex>(caller_mutex_);
+    }
+    auto slot = nested ? current_slot : queues_.size() - 1;
+
+    Job job;
+    job.body = &body;
+    job.grain = std::max<size_t>(grain, 1);
+    job.left = count;
+    Push(slot, {&job, 0, count});
+
+    /* Helps until every index ran, which may be on other slots still */
+    while (job.left.load(std::memory_order_acquire)) {
+        if (!RunOne(slot)) {
+            std::this_thread::yield();
+        }
+    }
+
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+}
+
+void WorkStealingPool::WorkerLoop(size_t slot) {
+    current_pool = this;
+    current_slot = slot;
+
+    for (;;) {
+        if (RunOne(slot)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return stop_ || queued_.load(); });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+bool WorkStealingPool::RunOne(size_t slot) {
+    Range range;
+    if (!Pop(slot, &range) && !Steal(slot, &range)) {
+        return false;
+    }
+
+    Execute(slot, range);
+    return true;
+}
+
+void WorkStealingPool::Execute(size_t slot, Range range) {
+    auto& job = *range.job;
+    while (range.end - range.begin > job.grain) {
+        auto middle = range.begin + (range.end - range.begin) / 2;
+        Push(slot, {range.job, middle, range.end});
+        range.end = middle;
+    }
+
+    for (auto index = range.begin; index < range.end; ++index) {
+        try {
+            (*job.body)(slot, index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job.error_mutex);
+            if (!job.error) {
+                job.error = std::current_exception();
+            }
+        }
+    }
+
+    /* The job lives on the stack of its caller, which may return as soon
+     * as this reaches zero */
+    job.left.fetch_sub(range.end - range.begin, std::memory_order_release);
+}
+
+void WorkStealingPool::Push(size_t slot, Range range) {
+    {
+        std::lock_guard<std::mutex> lock(queues_[slot]->mutex);
+        queues_[slot]->ranges.push_back(range);
+    }
+
+    queued_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+bool WorkStealingPool::Pop(size_t slot, Range* range) {
+    std::lock_guard<std::mutex> lock(queues_[slot]->mutex);
+    auto& ranges = queues_[slot]->ranges;
+    if (ranges.empty()) {
+        return false;
+    }
+
+    *range = ranges.back();
+    ranges.pop_back();
+    queued_.fetch_sub(1);
+    return true;
+}
+
+bool WorkStealingPool::Steal(size_t slot, Range* range) {
+    if (!queued_.load()) {
+        return false;
+    }
+
+    /* Starting after the own slot spreads the thieves over the victims */
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        auto& victim = *queues_[(slot + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.ranges.empty()) {
+            continue;
+        }
+
+        *range = victim.ranges.front();
+        victim.ranges.pop_front();
+        queued_.fetch_sub(1);
+        return true;
+    }
+
+    return false;
+}
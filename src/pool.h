@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fork-join over index ranges. Every worker owns a deque of ranges, pops
+ * from its back and splits what it pops in halves until a grain is left,
+ * pushing the upper halves back, and idle workers steal from the front of
+ * the others, which is where the largest ranges are. The thread calling
+ * ParallelFor works on its own job as well instead of blocking. */
+class WorkStealingPool {
+public:
+    /* Called once per index with the slot of the thread running it, so
+     * callers can keep per slot state that no other thread touches */
+    using Body = std::function<void(size_t slot, size_t index)>;
+
+    /* Zero for one worker per hardware thread */
+    explicit WorkStealingPool(size_t threads = 0);
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool();
+
+    /* The workers and one more for the thread calling ParallelFor */
+    size_t Slots() const;
+
+    /* Runs body for every index below count and returns once all of them
+     * ran. The first exception body throws is rethrown once the others
+     * are done. Callers outside of the pool take turns. */
+    void ParallelFor(size_t count, size_t grain, const Body& body);
+
+private:
+    struct Job {
+        const Body* body;
+        size_t grain;
+        /* Indices not run yet */
+        std::atomic<size_t> left;
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct Range {
+        Job* job;
+        size_t begin;
+        size_t end;
+    };
+
+    /* Padded so the owner and the thieves of one deque do not share a
+     * cache line with the next one */
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    void WorkerLoop(size_t slot);
+    /* Runs one range from the own deque or a stolen one, false if there
+     * was none */
+    bool RunOne(size_t slot);
+    void Execute(size_t slot, Range range);
+
+    void Push(size_t slot, Range range);
+    bool Pop(size_t slot, Range* range);
+    bool Steal(size_t slot, Range* range);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    /* Only one thread from outside uses the last slot at a time */
+    std::mutex caller_mutex_;
+
+    /* Ranges pushed and not popped yet, idle workers sleep while it is zero */
+    std::atomic<size_t> queued_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_;
+};
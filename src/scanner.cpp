@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstring>
+#include "scanner.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LISP_X86_64
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using BlockKernel = void (*)(const char* block, uint64_t* spaces, uint64_t* punctuation);
+
+bool IsSpaceByte(char symb) {
+    return symb == ' ' || static_cast<unsigned char>(symb - '\t') <= '\r' - '\t';
+}
+
+bool IsPunctuationByte(char symb) {
+    return symb == '(' || symb == ')' || symb == '\'';
+}
+
+void ScalarBlock(const char* block, uint64_t* spaces, uint64_t* punctuation) {
+    uint64_t space_bits = 0;
+    uint64_t punctuation_bits = 0;
+    for (size_t i = 0; i < 64; ++i) {
+        space_bits |= uint64_t(IsSpaceByte(block[i])) << i;
+        punctuation_bits |= uint64_t(IsPunctuationByte(block[i])) << i;
+    }
+
+    *spaces = space_bits;
+    *punctuation = punctuation_bits;
+}
+
+#ifdef LISP_X86_64
+
+void Sse2Block(const char* block, uint64_t* spaces, uint64_t* punctuation) {
+    const auto blank = _mm_set1_epi8(' ');
+    const auto tab = _mm_set1_epi8('\t');
+    const auto control_range = _mm_set1_epi8('\r' - '\t');
+    const auto open = _mm_set1_epi8('(');
+    const auto close = _mm_set1_epi8(')');
+    const auto quote = _mm_set1_epi8('\'');
+
+    uint64_t space_bits = 0;
+    uint64_t punctuation_bits = 0;
+    for (size_t i = 0; i < 64; i += 16) {
+        auto chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+
+        /* '\t'..'\r' is a contiguous range, test it with one unsigned min */
+        auto shifted = _mm_sub_epi8(chars, tab);
+        auto is_control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, control_range), shifted);
+        auto is_space = _mm_or_si128(_mm_cmpeq_epi8(chars, blank), is_control);
+
+        auto is_punctuation = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chars, open), _mm_cmpeq_epi8(chars, close)),
+                _mm_cmpeq_epi8(chars, quote));
+
+        space_bits |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(is_space))) << i;
+        punctuation_bits |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(is_punctuation))) << i;
+    }
+
+    *spaces = space_bits;
+    *punctuation = punctuation_bits;
+}
+
+__attribute__((target("avx2")))
+void Avx2Block(const char* block, uint64_t* spaces, uint64_t* punctuation) {
+    const auto blank = _mm256_set1_epi8(' ');
+    const auto tab = _mm256_set1_epi8('\t');
+    const auto control_range = _mm256_set1_epi8('\r' - '\t');
+    const auto open = _mm256_set1_epi8('(');
+    const auto close = _mm256_set1_epi8(')');
+    const auto quote = _mm256_set1_epi8('\'');
+
+    uint64_t space_bits = 0;
+    uint64_t punctuation_bits = 0;
+    for (size_t i = 0; i < 64; i += 32) {
+        auto chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+
+        auto shifted = _mm256_sub_epi8(chars, tab);
+        auto is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, control_range), shifted);
+        auto is_space = _mm256_or_si256(_mm256_cmpeq_epi8(chars, blank), is_control);
+
+        auto is_punctuation = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, open), _mm256_cmpeq_epi8(chars, close)),
+                _mm256_cmpeq_epi8(chars, quote));
+
+        space_bits |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(is_space))) << i;
+        punctuation_bits |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(is_punctuation))) << i;
+    }
+
+    *spaces = space_bits;
+    *punctuation = punctuation_bits;
+}
+
+#endif
+
+BlockKernel SelectKernel(StructuralIndex::Kernel kernel) {
+    switch (kernel) {
+#ifdef LISP_X86_64
+        case StructuralIndex::Kernel::AVX2:
+            return Avx2Block;
+        case StructuralIndex::Kernel::SSE2:
+            return Sse2Block;
+#endif
+        default:
+            return ScalarBlock;
+    }
+}
+
+inline size_t CountTrailingZeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    size_t count = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+}
+
+StructuralIndex::StructuralIndex(std::string_view source)
+        : StructuralIndex(source, BestKernel()) {}
+
+StructuralIndex::StructuralIndex(std::string_view source, Kernel kernel)
+        : size_(source.size()) {
+    if (!IsSupported(kernel)) {
+        kernel = Kernel::SCALAR;
+    }
+    auto block_kernel = SelectKernel(kernel);
+
+    auto blocks = (size_ + 63) / 64;
+    spaces_.resize(blocks);
+    punctuation_.resize(blocks);
+    separators_.resize(blocks);
+
+    size_t block = 0;
+    for (; (block + 1) * 64 <= size_; ++block) {
+        block_kernel(source.data() + block * 64, &spaces_[block], &punctuation_[block]);
+    }
+
+    /* The tail is padded with whitespace, positions past the end are never returned */
+    if (block < blocks) {
+        char tail[64];
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, source.data() + block * 64, size_ - block * 64);
+        block_kernel(tail, &spaces_[block], &punctuation_[block]);
+    }
+
+    for (block = 0; block < blocks; ++block) {
+        separators_[block] = spaces_[block] | punctuation_[block];
+    }
+}
+
+StructuralIndex::Kernel StructuralIndex::BestKernel() {
+    if (IsSupported(Kernel::AVX2)) {
+        return Kernel::AVX2;
+    }
+
+    if (IsSupported(Kernel::SSE2)) {
+        return Kernel::SSE2;
+    }
+
+    return Kernel::SCALAR;
+}
+
+bool StructuralIndex::IsSupported(Kernel kernel) {
+    switch (kernel) {
+#ifdef LISP_X86_64
+        case Kernel::AVX2:
+            return __builtin_cpu_supports("avx2");
+        case Kernel::SSE2:
+            return true;
+#endif
+        case Kernel::SCALAR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char* StructuralIndex::KernelName(Kernel kernel) {
+    switch (kernel) {
+        case Kernel::AVX2:
+            return "avx2";
+        case Kernel::SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+size_t StructuralIndex::SkipSpaces(size_t pos) const {
+    return NextSet(spaces_, pos, true);
+}
+
+size_t StructuralIndex::TokenEnd(size_t pos) const {
+    if (IsPunctuation(pos)) {
+        return pos + 1;
+    }
+
+    return NextSet(separators_, pos + 1, false);
+}
+
+bool StructuralIndex::IsPunctuation(size_t pos) const {
+    return (punctuation_[pos / 64] >> (pos % 64)) & 1;
+}
+
+size_t StructuralIndex::NextSet(const std::vector<uint64_t>& bits, size_t pos, bool inverted) const {
+    if (pos >= size_) {
+        return size_;
+    }
+
+    auto word = pos / 64;
+    auto flip = inverted ? ~uint64_t(0) : uint64_t(0);
+    auto mask = (bits[word] ^ flip) & (~uint64_t(0) << (pos % 64));
+
+    while (!mask) {
+        if (++word == bits.size()) {
+            return size_;
+        }
+        mask = bits[word] ^ flip;
+    }
+
+    return std::min(word * 64 + CountTrailingZeros(mask), size_);
+}
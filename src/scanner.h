@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/* Bitmaps of whitespace and punctuation ('(', ')', '\'') positions, one bit
+ * per source byte, built 64 bytes at a time with the widest vector unit the
+ * CPU supports. Token boundaries are then found with bit scans instead of
+ * testing every character. */
+class StructuralIndex {
+public:
+    enum class Kernel {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    explicit StructuralIndex(std::string_view source);
+    StructuralIndex(std::string_view source, Kernel kernel);
+
+    /* The fastest kernel supported by the running CPU */
+    static Kernel BestKernel();
+    static bool IsSupported(Kernel kernel);
+    static const char* KernelName(Kernel kernel);
+
+    /* First position >= pos that is not whitespace, or the source size */
+    size_t SkipSpaces(size_t pos) const;
+
+    /* End of the token starting at pos */
+    size_t TokenEnd(size_t pos) const;
+
+    bool IsPunctuation(size_t pos) const;
+
+private:
+    size_t NextSet(const std::vector<uint64_t>& bits, size_t pos, bool inverted) const;
+
+    size_t size_;
+    std::vector<uint64_t> spaces_;
+    std::vector<uint64_t> punctuation_;
+    std::vector<uint64_t> separators_;
+};
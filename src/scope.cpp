@@ -0,0 +1,136 @@
+#include <algorithm>
+#include "scope.h"
+
+namespace {
+
+using TokenType = Tokenizer::TokenType;
+using Builtins = Tokenizer::Builtins;
+
+}
+
+Scope::Scope(Scope* parent, const AST::Pair* params, const AST::Pair* body)
+        : parent_(parent) {
+    for (auto param = params; param; param = param->next) {
+        AddLocal(param->value.GetSymbol());
+    }
+    ScanList(body, 0);
+
+    for (size_t slot = 0; slot < locals_.size(); ++slot) {
+        boxed_.push_back(assigned_.count(locals_[slot]) && used_nested_.count(locals_[slot]));
+    }
+}
+
+Address Scope::Resolve(Scope* scope, Symbol symbol) {
+    if (!scope) {
+        return Address{Address::Kind::GLOBAL, false, symbol};
+    }
+
+    return scope->Resolve(symbol);
+}
+
+Address Scope::Resolve(Symbol symbol) {
+    auto local = std::find(locals_.begin(), locals_.end(), symbol);
+    if (local != locals_.end()) {
+        uint32_t slot = local - locals_.begin();
+        return Address{Address::Kind::LOCAL, boxed_[slot], slot};
+    }
+
+    auto captured = std::find(captured_.begin(), captured_.end(), symbol);
+    if (captured != captured_.end()) {
+        uint32_t index = captured - captured_.begin();
+        return Address{Address::Kind::FREE, captures_[index].boxed, index};
+    }
+
+    auto outer = Resolve(parent_, symbol);
+    if (outer.kind == Address::Kind::GLOBAL) {
+        return outer;
+    }
+
+    captured_.push_back(symbol);
+    captures_.push_back(outer);
+    return Address{Address::Kind::FREE, outer.boxed, static_cast<uint32_t>(captures_.size() - 1)};
+}
+
+uint32_t Scope::LocalCount() const {
+    return locals_.size();
+}
+
+std::vector<uint32_t> Scope::BoxedLocals() const {
+    std::vector<uint32_t> slots;
+    for (uint32_t slot = 0; slot < boxed_.size(); ++slot) {
+        if (boxed_[slot]) {
+            slots.push_back(slot);
+        }
+    }
+
+    return slots;
+}
+
+std::vector<Address> Scope::Captures() const {
+    return captures_;
+}
+
+uint32_t Scope::AddLocal(Symbol symbol) {
+    auto local = std::find(locals_.begin(), locals_.end(), symbol);
+    if (local != locals_.end()) {
+        return local - locals_.begin();
+    }
+
+    locals_.push_back(symbol);
+    return locals_.size() - 1;
+}
+
+void Scope::ScanList(const Pair* node, int depth) {
+    for (; node; node = node->next) {
+        Scan(node, depth);
+    }
+}
+
+void Scope::Scan(const Pair* node, int depth) {
+    if (node->type == TokenType::NAME) {
+        if (depth) {
+            used_nested_.insert(node->value.GetSymbol());
+        }
+        return;
+    }
+    if (node->type != TokenType::OPEN_PARENT || !node->child) {
+        return;
+    }
+
+    auto head = node->child;
+    if (head->type != TokenType::BUILTIN) {
+        ScanList(head, depth);
+        return;
+    }
+
+    switch (Tokenizer::ToBuiltin(head->value.GetSymbol())) {
+        case Builtins::QUOTE:
+            return;
+        case Builtins::LAMBDA:
+            ScanList(head->next->next, depth + 1);
+            return;
+        case Builtins::DEFINE: {
+            auto target = head->next;
+            auto name = target->type == TokenType::OPEN_PARENT ? target->child : target;
+            /* Defines in nested lambdas make their own locals */
+            if (!depth) {
+                AddLocal(name->value.GetSymbol());
+            }
+            assigned_.insert(name->value.GetSymbol());
+            if (target->type == TokenType::OPEN_PARENT) {
+                ScanList(target->next, depth + 1);
+            } else {
+                Scan(target->next, depth);
+            }
+            }
+            return;
+        case Builtins::SET:
+            assigned_.insert(head->next->value.GetSymbol());
+            Scan(head->next, depth);
+            Scan(head->next->next, depth);
+            return;
+        default:
+            ScanList(head->next, depth);
+            return;
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include "lisp.h"
+
+/* Where a variable lives, resolved once when compiling */
+struct Address {
+    enum class Kind : uint8_t {
+        /* Slot of the running call's frame, parameters first */
+        LOCAL,
+        /* Value the running closure captured when it was made */
+        FREE,
+        /* Looked up by symbol in the global environment */
+        GLOBAL
+    };
+
+    Kind kind;
+    /* Boxed variables are assigned after some closure captured them, the
+     * slot holds a Box shared with those closures */
+    bool boxed;
+    /* Slot, capture or symbol */
+    uint32_t index;
+};
+
+/* Variables of one lambda: its parameters and internal defines get frame
+ * slots, and whatever it refers to from enclosing lambdas is captured by
+ * value when the closure is made. Variables both captured and assigned
+ * are boxed so every closure sees the assignments. */
+class Scope {
+public:
+    /* A null parent stands for the top level, where every variable is global */
+    Scope(Scope* parent, const AST::Pair* params, const AST::Pair* body);
+
+    /* Captures the variable when it comes from an enclosing lambda */
+    Address Resolve(Symbol symbol);
+    static Address Resolve(Scope* scope, Symbol symbol);
+
+    uint32_t LocalCount() const;
+    /* Slots to be boxed when the call starts */
+    std::vector<uint32_t> BoxedLocals() const;
+    /* Where each captured value is found in the frame of the enclosing
+     * lambda, in capture order */
+    std::vector<Address> Captures() const;
+
+private:
+    using Pair = AST::Pair;
+
+    /* Depth 0 is the body of this lambda, nested lambdas are deeper */
+    void Scan(const Pair* node, int depth);
+    void ScanList(const Pair* node, int depth);
+    uint32_t AddLocal(Symbol symbol);
+
+    Scope* parent_;
+    std::vector<Symbol> locals_;
+    std::vector<bool> boxed_;
+    std::vector<Symbol> captured_;
+    std::vector<Address> captures_;
+
+    /* Names set! or defined anywhere in the body, and names used inside
+     * nested lambdas, shadowing aside */
+    std::unordered_set<Symbol> assigned_;
+    std::unordered_set<Symbol> used_nested_;
+};
@@ -0,0 +1,609 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+
+namespace {
+
+/* Tokens of the epoll events, connections are numbered after them */
+constexpr uint64_t kListenerToken = 0;
+constexpr uint64_t kWakeToken = 1;
+constexpr uint64_t kFirstConnection = 2;
+
+/* Requests of one connection in flight before the loop stops reading it */
+constexpr size_t kMaxPipeline = 256;
+/* Response bytes a connection leaves unread before the loop stops reading it */
+constexpr size_t kMaxUnsent = 1 << 20;
+constexpr size_t kReadSize = 64 << 10;
+constexpr int kMaxEvents = 64;
+
+std::system_error SystemError(const char* what) {
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+sockaddr_un SocketAddress(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+/* A socket file nothing listens on any more, left by a server that died */
+bool IsStaleSocket(const std::string& path, const sockaddr_un& address) {
+    struct stat status;
+    if (lstat(path.c_str(), &status) < 0 || !S_ISSOCK(status.st_mode)) {
+        return false;
+    }
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    bool listening = connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    close(fd);
+    return !listening;
+}
+
+void Control(int epoll, int operation, int fd, uint32_t events, uint64_t token) {
+    epoll_event event{};
+    event.events = events;
+    event.data.u64 = token;
+    epoll_ctl(epoll, operation, fd, &event);
+}
+
+void Poke(int fd) {
+    uint64_t one = 1;
+    /* Fails only when the counter is about to overflow, awake anyway */
+    (void)!write(fd, &one, sizeof(one));
+}
+
+}
+
+void AppendMessage(std::string& out, MessageKind kind, std::string_view body) {
+    auto length = static_cast<uint32_t>(body.size() + 1);
+    char header[5] = {static_cast<char>(length), static_cast<char>(length >> 8),
+                      static_cast<char>(length >> 16), static_cast<char>(length >> 24),
+                      static_cast<char>(kind)};
+    out.append(header, sizeof(header));
+    out.append(body);
+}
+
+bool TakeMessage(std::string_view* input, Message* message) {
+    if (input->size() < 4) {
+        return false;
+    }
+
+    auto bytes = reinterpret_cast<const unsigned char*>(input->data());
+    size_t length = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+    if (!length || length > kMaxMessageSize) {
+        throw std::runtime_error("Bad message length " + std::to_string(length));
+    }
+    if (input->size() < 4 + length) {
+        return false;
+    }
+
+    message->kind = static_cast<MessageKind>(bytes[4]);
+    message->body.assign(input->data() + 5, length - 1);
+    input->remove_prefix(4 + length);
+    return true;
+}
+
+void LatencyHistogram::Record(uint64_t nanoseconds) {
+    ++buckets_[Bucket(nanoseconds)];
+    ++count_;
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const {
+    if (!count_) {
+        return 0;
+    }
+
+    auto rank = std::max<uint64_t>(std::ceil(fraction * count_), 1);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets_.size(); ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= rank) {
+            return Representative(bucket);
+        }
+    }
+    return Representative(buckets_.size() - 1);
+}
+
+uint64_t LatencyHistogram::Count() const {
+    return count_;
+}
+
+size_t LatencyHistogram::Bucket(uint64_t nanoseconds) {
+    if (nanoseconds < (1u << kSubBits)) {
+        return nanoseconds;
+    }
+
+    /* The bits below the highest one pick the linear bucket */
+    int high = 63 - __builtin_clzll(nanoseconds);
+    int shift = high - kSubBits;
+    return ((high - kSubBits + 1) << kSubBits) +
+           ((nanoseconds >> shift) & ((1u << kSubBits) - 1));
+}
+
+uint64_t LatencyHistogram::Representative(size_t bucket) {
+    if (bucket < (1u << kSubBits)) {
+        return bucket;
+    }
+
+    int shift = int(bucket >> kSubBits) - 1;
+    uint64_t sub = bucket & ((1u << kSubBits) - 1);
+    return (((1u << kSubBits) + sub) << shift) + ((uint64_t(1) << shift) >> 1);
+}
+
+std::string ServerStats::Format() const {
+    char text[256];
+    std::snprintf(text, sizeof(text),
+                  "requests %llu\nerrors %llu\nbudget_exceeded %llu\nconnections %llu\n"
+                  "p50_us %.1f\np99_us %.1f\nrequests_per_second %.1f\nuptime_seconds %.1f\n",
+                  (unsigned long long)requests, (unsigned long long)errors,
+                  (unsigned long long)budget_exceeded, (unsigned long long)connections, p50_ns / 1e3, p99_ns / 1e3,
+                  requests_per_second, uptime_seconds);
+    return text;
+}
+
+EvalServer::EvalServer(std::string path, size_t sessions, Interpreter::Backend backend,
+                       const Limits& limits)
+        : path_(std::move(path))
+        , socket_(0, 0)
+        , listener_(-1)
+        , epoll_(-1)
+        , wake_(-1)
+        , stop_(false)
+        , started_(Clock::now())
+        , next_connection_(kFirstConnection)
+        , workers_stop_(false)
+        , requests_(0)
+        , errors_(0)
+        , budget_exceeded_(0)
+        , connections_served_(0) {
+    auto address = SocketAddress(path_);
+    struct Cleanup {
+        EvalServer& server;
+        bool armed = true;
+        ~Cleanup() {
+            for (auto fd : {server.listener_, server.epoll_, server.wake_}) {
+                if (armed && fd >= 0) {
+                    close(fd);
+                }
+            }
+            if (armed) {
+                server.RemoveSocket();
+            }
+        }
+    } cleanup{*this};
+
+    listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener_ < 0) {
+        throw SystemError("socket");
+    }
+    if (IsStaleSocket(path_, address)) {
+        unlink(path_.c_str());
+    }
+    if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        throw SystemError("bind");
+    }
+    struct stat status;
+    if (lstat(path_.c_str(), &status) == 0) {
+        socket_ = {status.st_dev, status.st_ino};
+    }
+    if (listen(listener_, SOMAXCONN) < 0) {
+        throw SystemError("listen");
+    }
+
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_ < 0 || wake_ < 0) {
+        throw SystemError("epoll");
+    }
+    Control(epoll_, EPOLL_CTL_ADD, listener_, EPOLLIN, kListenerToken);
+    Control(epoll_, EPOLL_CTL_ADD, wake_, EPOLLIN, kWakeToken);
+    cleanup.armed = false;
+
+    if (!sessions) {
+        sessions = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    for (size_t i = 0; i < sessions; ++i) {
+        interpreters_.push_back(std::make_unique<Interpreter>(1024, backend));
+        interpreters_.back()->SetLimits(limits);
+    }
+    for (auto& interpreter : interpreters_) {
+        workers_.emplace_back([this, &interpreter] { WorkerLoop(*interpreter); });
+    }
+}
+
+EvalServer::~EvalServer() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        workers_stop_ = true;
+    }
+    queue_ready_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+
+    for (auto& entry : connections_) {
+        close(entry.second.fd);
+    }
+    close(listener_);
+    close(epoll_);
+    close(wake_);
+    RemoveSocket();
+}
+
+void EvalServer::RemoveSocket() {
+    struct stat status;
+    if (socket_.second && lstat(path_.c_str(), &status) == 0 && S_ISSOCK(status.st_mode) &&
+        std::make_pair(status.st_dev, status.st_ino) == socket_) {
+        unlink(path_.c_str());
+    }
+}
+
+void EvalServer::Run() {
+    epoll_event events[kMaxEvents];
+    while (!stop_.load()) {
+        auto count = epoll_wait(epoll_, events, kMaxEvents, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw SystemError("epoll_wait");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            auto token = events[i].data.u64;
+            if (token == kListenerToken) {
+                Accept();
+                continue;
+            }
+            if (token == kWakeToken) {
+                Complete();
+                continue;
+            }
+
+            auto found = connections_.find(token);
+            if (found == connections_.end()) {
+                continue;
+            }
+            auto& connection = found->second;
+            auto flags = events[i].events;
+            /* Whoever hung up cannot read the responses anymore */
+            bool open = !(flags & (EPOLLERR | EPOLLHUP));
+            if (open && (flags & EPOLLIN)) {
+                open = Read(connection);
+            }
+            if (open) {
+                open = Serve(connection);
+            }
+            if (open) {
+                Watch(connection);
+            } else {
+                Close(token);
+            }
+        }
+    }
+}
+
+void EvalServer::Stop() {
+    stop_.store(true);
+    Poke(wake_);
+}
+
+ServerStats EvalServer::Stats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    double uptime = std::chrono::duration<double>(Clock::now() - started_).count();
+    return {requests_,
+            errors_,
+            budget_exceeded_,
+            connections_served_,
+            latencies_.Percentile(0.5),
+            latencies_.Percentile(0.99),
+            uptime > 0 ? requests_ / uptime : 0,
+            uptime};
+}
+
+size_t EvalServer::Sessions() const {
+    return interpreters_.size();
+}
+
+void EvalServer::WorkerLoop(Interpreter& interpreter) {
+    for (;;) {
+        std::shared_ptr<Request> request;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_ready_.wait(lock, [this] { return workers_stop_ || !queue_.empty(); });
+            if (workers_stop_) {
+                return;
+            }
+            request = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        try {
+            request->response = {MessageKind::VALUE, interpreter.Eval(request->expr)};
+        } catch (BudgetError& error) {
+            request->response = {MessageKind::ERROR, error.what()};
+            request->over_budget = true;
+        } catch (std::exception& error) {
+            request->response = {MessageKind::ERROR, error.what()};
+        }
+        interpreter.Reset();
+
+        /* The loop drains every request once poked, only the first one
+         * since its last drain pokes it */
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(done_mutex_);
+            first = done_.empty();
+            done_.push_back(std::move(request));
+        }
+        if (first) {
+            Poke(wake_);
+        }
+    }
+}
+
+void EvalServer::Accept() {
+    for (;;) {
+        auto fd = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            /* Out of descriptors and such, the next connection may work */
+            return;
+        }
+
+        auto id = next_connection_++;
+        auto& connection = connections_[id];
+        connection.id = id;
+        connection.fd = fd;
+        connection.events = EPOLLIN;
+        Control(epoll_, EPOLL_CTL_ADD, fd, connection.events, id);
+
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        ++connections_served_;
+    }
+}
+
+void EvalServer::Complete() {
+    /* Drained before taking the requests, or a poke may be lost */
+    uint64_t pokes;
+    (void)!read(wake_, &pokes, sizeof(pokes));
+
+    std::vector<std::shared_ptr<Request>> done;
+    {
+        std::lock_guard<std::mutex> lock(done_mutex_);
+        done.swap(done_);
+    }
+
+    for (auto& request : done) {
+        request->done = true;
+    }
+    for (auto& request : done) {
+        auto found = connections_.find(request->connection);
+        if (found == connections_.end()) {
+            continue;
+        }
+        if (Serve(found->second)) {
+            Watch(found->second);
+        } else {
+            Close(found->first);
+        }
+    }
+}
+
+bool EvalServer::Read(Connection& connection) {
+    char buffer[kReadSize];
+    for (;;) {
+        auto count = read(connection.fd, buffer, sizeof(buffer));
+        if (count > 0) {
+            connection.in.append(buffer, count);
+            continue;
+        }
+        if (!count) {
+            connection.closing = true;
+            return true;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+bool EvalServer::Serve(Connection& connection) {
+    /* Answering and writing first makes room for the requests the limits
+     * left in the buffer, no event comes for those */
+    Answer(connection);
+    if (!Write(connection) || !Parse(connection)) {
+        return false;
+    }
+    Answer(connection);
+
+    if (!Write(connection)) {
+        return false;
+    }
+    /* Requests left in the buffer after a shutdown are answered as well */
+    return !connection.closing || !connection.pending.empty() ||
+           connection.Unsent();
+}
+
+bool EvalServer::Parse(Connection& connection) {
+    std::string_view input = connection.in;
+    Message message;
+    while (connection.pending.size() < kMaxPipeline && connection.Unsent() <= kMaxUnsent) {
+        try {
+            if (!TakeMessage(&input, &message)) {
+                break;
+            }
+        } catch (std::exception&) {
+            return false;
+        }
+
+        auto request = std::make_shared<Request>();
+        request->connection = connection.id;
+        request->kind = message.kind;
+        request->start = Clock::now();
+        connection.pending.push_back(request);
+
+        if (message.kind == MessageKind::EVAL) {
+            request->expr = std::move(message.body);
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                queue_.push_back(request);
+            }
+            queue_ready_.notify_one();
+        } else {
+            /* The loop answers the rest itself, stats once they count the
+             * requests before them */
+            request->done = true;
+            request->response = {MessageKind::ERROR, "ERROR: Unknown request\n"};
+        }
+    }
+
+    connection.in.erase(0, connection.in.size() - input.size());
+    return true;
+}
+
+void EvalServer::Answer(Connection& connection) {
+    while (!connection.pending.empty() && connection.pending.front()->done) {
+        auto& request = *connection.pending.front();
+        if (request.kind == MessageKind::STATS) {
+            request.response = {MessageKind::VALUE, Stats().Format()};
+        }
+        AppendMessage(connection.out, request.response.kind, request.response.body);
+        if (request.kind == MessageKind::EVAL) {
+            auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - request.start);
+            std::lock_guard<std::mutex> lock(stats_mutex_);
+            ++requests_;
+            errors_ += request.response.kind == MessageKind::ERROR;
+            budget_exceeded_ += request.over_budget;
+            latencies_.Record(latency.count());
+        }
+        connection.pending.pop_front();
+    }
+}
+
+bool EvalServer::Write(Connection& connection) {
+    while (connection.written < connection.out.size()) {
+        auto count = send(connection.fd, connection.out.data() + connection.written,
+                          connection.out.size() - connection.written, MSG_NOSIGNAL);
+        if (count >= 0) {
+            connection.written += count;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        return false;
+    }
+
+    if (connection.written == connection.out.size()) {
+        connection.out.clear();
+        connection.written = 0;
+    }
+    return true;
+}
+
+void EvalServer::Watch(Connection& connection) {
+    uint32_t events = 0;
+    if (!connection.closing && connection.pending.size() < kMaxPipeline &&
+        connection.Unsent() <= kMaxUnsent) {
+        events |= EPOLLIN;
+    }
+    if (connection.Unsent()) {
+        events |= EPOLLOUT;
+    }
+    if (events != connection.events) {
+        connection.events = events;
+        Control(epoll_, EPOLL_CTL_MOD, connection.fd, events, connection.id);
+    }
+}
+
+void EvalServer::Close(uint64_t id) {
+    auto found = connections_.find(id);
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, found->second.fd, nullptr);
+    close(found->second.fd);
+    /* Requests still evaluating find no connection when done */
+    connections_.erase(found);
+}
+
+EvalClient::EvalClient(const std::string& path)
+        : fd_(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+    if (fd_ < 0) {
+        throw SystemError("socket");
+    }
+    auto address = SocketAddress(path);
+    if (connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        auto error = SystemError("connect");
+        close(fd_);
+        throw error;
+    }
+}
+
+EvalClient::~EvalClient() {
+    close(fd_);
+}
+
+void EvalClient::Send(MessageKind kind, std::string_view body) {
+    std::string message;
+    AppendMessage(message, kind, body);
+    for (size_t sent = 0; sent < message.size();) {
+        auto count = send(fd_, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw SystemError("send");
+        }
+        sent += count;
+    }
+}
+
+Message EvalClient::Receive() {
+    Message message;
+    for (;;) {
+        std::string_view input = in_;
+        if (TakeMessage(&input, &message)) {
+            in_.erase(0, in_.size() - input.size());
+            return message;
+        }
+
+        char buffer[kReadSize];
+        auto count = read(fd_, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw SystemError("read");
+        }
+        if (!count) {
+            throw std::runtime_error("Connection closed by the server");
+        }
+        in_.append(buffer, count);
+    }
+}
+
+Message EvalClient::Eval(std::string_view expr) {
+    Send(MessageKind::EVAL, expr);
+    return Receive();
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+#include "interpreter.h"
+
+/* Evaluation over a Unix domain socket, so a process embedding the
+ * interpreter pays neither a spawn nor a cold session per expression.
+ *
+ * Both ways a message is a 4 byte little endian length, then a kind byte and
+ * length - 1 bytes of body. Clients may send any number of requests before
+ * reading the responses, which come back in the order of the requests. */
+
+enum class MessageKind : uint8_t {
+    /* Requests */
+    EVAL = 0,
+    STATS = 1,
+    /* Responses, the printed value or the error message */
+    VALUE = 2,
+    ERROR = 3
+};
+
+struct Message {
+    MessageKind kind;
+    std::string body;
+};
+
+/* Larger messages close the connection */
+constexpr size_t kMaxMessageSize = 16 << 20;
+
+void AppendMessage(std::string& out, MessageKind kind, std::string_view body);
+
+/* Takes one message off the front of input, false if it is not complete yet.
+ * Throws on messages that are empty or too large. */
+bool TakeMessage(std::string_view* input, Message* message);
+
+/* Latencies in nanoseconds, bucketed so that percentiles are within about
+ * 6% of the exact ones: 16 linear buckets per power of two */
+class LatencyHistogram {
+public:
+    void Record(uint64_t nanoseconds);
+
+    /* The latency below which fraction of the samples fall, 0 if empty */
+    uint64_t Percentile(double fraction) const;
+    uint64_t Count() const;
+
+private:
+    static constexpr int kSubBits = 4;
+
+    static size_t Bucket(uint64_t nanoseconds);
+    /* Middle of the range of the bucket */
+    static uint64_t Representative(size_t bucket);
+
+    std::array<uint64_t, 64 << kSubBits> buckets_{};
+    uint64_t count_ = 0;
+};
+
+struct ServerStats {
+    uint64_t requests;
+    uint64_t errors;
+    /* Errors that were a BudgetError */
+    uint64_t budget_exceeded;
+    uint64_t connections;
+    /* From reading the request to queueing its response */
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    double requests_per_second;
+    double uptime_seconds;
+
+    /* One "name value" line per counter, the body of a STATS response */
+    std::string Format() const;
+};
+
+/* One epoll thread does all the socket work and a pool of workers the
+ * evaluations, every worker with an interpreter of its own that stays warm
+ * between requests. Each request starts with no globals, like a fresh
+ * Evaluate would. */
+class EvalServer {
+public:
+    /* Zero sessions for one per hardware thread, each request gets all of
+     * limits. Throws if the socket cannot be bound, a socket file at path
+     * nothing listens on is replaced. */
+    EvalServer(std::string path, size_t sessions = 0,
+               Interpreter::Backend backend = Interpreter::Backend::VM,
+               const Limits& limits = Limits());
+
+    EvalServer(const EvalServer&) = delete;
+    EvalServer& operator=(const EvalServer&) = delete;
+
+    ~EvalServer();
+
+    /* Serves until Stop */
+    void Run();
+    /* From any thread, and from signal handlers */
+    void Stop();
+
+    ServerStats Stats() const;
+    size_t Sessions() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Request {
+        uint64_t connection;
+        MessageKind kind;
+        std::string expr;
+        Clock::time_point start;
+        /* Set by the loop once a worker handed the response over */
+        bool done = false;
+        Message response;
+        bool over_budget = false;
+    };
+
+    struct Connection {
+        uint64_t id;
+        int fd;
+        std::string in;
+        std::string out;
+        size_t written = 0;
+        /* Oldest first, answered in this order as they get done */
+        std::deque<std::shared_ptr<Request>> pending;
+        /* The client shut down its side, close once everything is answered */
+        bool closing = false;
+        /* What epoll watches for */
+        uint32_t events = 0;
+
+        size_t Unsent() const {
+            return out.size() - written;
+        }
+    };
+
+    void WorkerLoop(Interpreter& interpreter);
+
+    void Accept();
+    /* Takes the finished requests from the workers */
+    void Complete();
+    /* Each false once the connection is to be closed */
+    bool Read(Connection& connection);
+    /* Parses the requests read, queues the responses done and writes.
+     * Reading stops at the pipeline limit and while a client leaves too
+     * much of the responses unread. */
+    bool Serve(Connection& connection);
+    /* Hands the requests read to the workers, up to the pipeline limit */
+    bool Parse(Connection& connection);
+    /* Queues the responses at the front that are done */
+    void Answer(Connection& connection);
+    bool Write(Connection& connection);
+    void Watch(Connection& connection);
+    void Close(uint64_t id);
+    /* Unlinks path if it still is the socket this server bound */
+    void RemoveSocket();
+
+    std::string path_;
+    /* Device and inode of the socket file bound, zeros before */
+    std::pair<dev_t, ino_t> socket_;
+    int listener_;
+    int epoll_;
+    /* Workers and Stop poke the loop through it */
+    int wake_;
+    std::atomic<bool> stop_;
+    Clock::time_point started_;
+
+    std::unordered_map<uint64_t, Connection> connections_;
+    uint64_t next_connection_;
+
+    std::vector<std::unique_ptr<Interpreter>> interpreters_;
+    std::vector<std::thread> workers_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_ready_;
+    std::deque<std::shared_ptr<Request>> queue_;
+    bool workers_stop_;
+    /* Evaluated, waiting for the loop */
+    std::mutex done_mutex_;
+    std::vector<std::shared_ptr<Request>> done_;
+
+    mutable std::mutex stats_mutex_;
+    LatencyHistogram latencies_;
+    uint64_t requests_;
+    uint64_t errors_;
+    uint64_t budget_exceeded_;
+    uint64_t connections_served_;
+};
+
+/* Blocking client, for tools and tests */
+class EvalClient {
+public:
+    /* Throws if nothing listens at path */
+    explicit EvalClient(const std::string& path);
+
+    EvalClient(const EvalClient&) = delete;
+    EvalClient& operator=(const EvalClient&) = delete;
+
+    ~EvalClient();
+
+    /* Sends without waiting for the response, to pipeline requests */
+    void Send(MessageKind kind, std::string_view body);
+    /* The response to the oldest request not received yet */
+    Message Receive();
+
+    /* Send and Receive */
+    Message Eval(std::string_view expr);
+
+private:
+    int fd_;
+    std::string in_;
+};
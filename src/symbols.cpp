@@ -0,0 +1,74 @@
+#include <atomic>
+#include "symbols.h"
+
+namespace {
+
+/* Symbols this thread looked up, keyed by views into the names of the
+ * table, which never move */
+struct LocalSymbols {
+    uint64_t table = 0;
+    std::unordered_map<std::string_view, Symbol> ids;
+};
+
+thread_local LocalSymbols local_symbols;
+
+std::atomic<uint64_t> next_table_serial{1};
+
+}
+
+SymbolTable::SymbolTable()
+        : serial_(next_table_serial++) {}
+
+Symbol SymbolTable::Intern(std::string_view name) {
+    Symbol symbol;
+    if (Find(name, &symbol)) {
+        return symbol;
+    }
+
+    /* Someone else may have interned it in between */
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto iter = ids_.find(name);
+    if (iter != ids_.end()) {
+        return iter->second;
+    }
+
+    symbol = static_cast<Symbol>(names_.size());
+    names_.emplace_back(name);
+    ids_.emplace(names_.back(), symbol);
+
+    return symbol;
+}
+
+bool SymbolTable::Find(std::string_view name, Symbol* symbol) const {
+    auto& local = local_symbols;
+    if (local.table != serial_) {
+        local.table = serial_;
+        local.ids.clear();
+    }
+
+    auto cached = local.ids.find(name);
+    if (cached != local.ids.end()) {
+        *symbol = cached->second;
+        return true;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto iter = ids_.find(name);
+    if (iter == ids_.end()) {
+        return false;
+    }
+
+    local.ids.emplace(iter->first, iter->second);
+    *symbol = iter->second;
+    return true;
+}
+
+const std::string& SymbolTable::Name(Symbol symbol) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return names_.at(symbol);
+}
+
+size_t SymbolTable::Size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return names_.size();
+}
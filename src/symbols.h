@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using Symbol = uint32_t;
+
+/* Maps every identifier to a small integer once, so that the evaluator
+ * compares and looks up symbols without touching strings. Safe to share
+ * between threads: every thread looks names up in a cache of its own
+ * first, and only takes the lock, shared, for names new to it. */
+class SymbolTable {
+public:
+    SymbolTable();
+
+    Symbol Intern(std::string_view name);
+    bool Find(std::string_view name, Symbol* symbol) const;
+
+    const std::string& Name(Symbol symbol) const;
+    size_t Size() const;
+
+private:
+    /* Tells the tables apart in the thread local caches */
+    const uint64_t serial_;
+    mutable std::shared_mutex mutex_;
+    /* Keys view into names_, whose elements never move */
+    std::unordered_map<std::string_view, Symbol> ids_;
+    std::deque<std::string> names_;
+};
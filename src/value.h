@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "symbols.h"
+
+struct Object;
+struct Cell;
+
+/* One machine word per value, no allocation and no RTTI for anything but
+ * heap objects:
+ *
+ *   ...xxxxxxx0  fixnum, the integer shifted left by one (63 bits)
+ *   ...xxxxx001  heap object pointer, objects are 8 byte aligned
+ *   ...xxxxx101  cons cell pointer, cells are 16 byte aligned
+ *   ...kkkkk011  immediate of kind k, payload in the upper 32 bits
+ *   ...xxxxx111  flonum, a double rotated so its sign is the lowest bit,
+ *                with its exponent rebased to 8 bits
+ *
+ * Only doubles with an exponent within 2^-126 to 2^128 and the zeros are
+ * immediate, which covers what numeric code computes, the others are boxed.
+ */
+class Value {
+public:
+    enum class Tag : uint8_t {
+        FIXNUM,
+        OBJECT,
+        PAIR,
+        FLONUM,
+        BOOL,
+        NIL,
+        SYMBOL,
+        UNSPECIFIED,
+        /* Left by the collector in a nursery cell that was moved away */
+        MOVED
+    };
+
+    Value()
+            : raw_(Immediate(Tag::UNSPECIFIED, 0)) {}
+
+    static Value MakeFixnum(int64_t number) {
+        return Value(static_cast<uint64_t>(number) << 1);
+    }
+
+    /* Only for doubles that FitsFlonum */
+    static Value MakeFlonum(double number) {
+        auto rotated = RotatedBits(number);
+        if (rotated > 1) {
+            rotated -= kFlonumExponentOffset;
+        }
+        return Value((rotated << 3) | kFlonumTag);
+    }
+
+    static Value MakeBool(bool boolean) {
+        return Value(Immediate(Tag::BOOL, boolean));
+    }
+
+    static Value MakeNil() {
+        return Value(Immediate(Tag::NIL, 0));
+    }
+
+    static Value MakeSymbol(Symbol symbol) {
+        return Value(Immediate(Tag::SYMBOL, symbol));
+    }
+
+    static Value MakeObject(Object* object) {
+        return Value(reinterpret_cast<uint64_t>(object) | kObjectTag);
+    }
+
+    static Value MakePair(Cell* cell) {
+        return Value(reinterpret_cast<uint64_t>(cell) | kPairTag);
+    }
+
+    static Value MakeMoved() {
+        return Value(Immediate(Tag::MOVED, 0));
+    }
+
+    /* Whether the integer survives the round trip through a fixnum */
+    static bool FitsFixnum(int64_t number) {
+        return number >= kFixnumMin && number <= kFixnumMax;
+    }
+
+    /* Whether the double is representable as an immediate */
+    static bool FitsFlonum(double number) {
+        auto rotated = RotatedBits(number);
+        return rotated <= 1 || (rotated >> 53) - kFlonumMinExponent < 255;
+    }
+
+    Tag GetTag() const {
+        if (!(raw_ & 1)) {
+            return Tag::FIXNUM;
+        }
+
+        if ((raw_ & 7) == kFlonumTag) {
+            return Tag::FLONUM;
+        }
+
+        if ((raw_ & 7) == kImmediateTag) {
+            return static_cast<Tag>((raw_ >> 3) & 31);
+        }
+
+        if ((raw_ & 7) == kObjectTag) {
+            return Tag::OBJECT;
+        }
+
+        return Tag::PAIR;
+    }
+
+    bool IsFixnum() const {
+        return !(raw_ & 1);
+    }
+
+    bool IsObject() const {
+        return (raw_ & 7) == kObjectTag;
+    }
+
+    bool IsPair() const {
+        return (raw_ & 7) == kPairTag;
+    }
+
+    bool IsFlonum() const {
+        return (raw_ & 7) == kFlonumTag;
+    }
+
+    bool IsMoved() const {
+        return raw_ == Immediate(Tag::MOVED, 0);
+    }
+
+    bool IsBool() const {
+        return (raw_ & kKindMask) == Immediate(Tag::BOOL, 0);
+    }
+
+    bool IsNil() const {
+        return raw_ == Immediate(Tag::NIL, 0);
+    }
+
+    bool IsSymbol() const {
+        return (raw_ & kKindMask) == Immediate(Tag::SYMBOL, 0);
+    }
+
+    /* Only #f is false */
+    bool IsFalse() const {
+        return raw_ == Immediate(Tag::BOOL, 0);
+    }
+
+    int64_t GetFixnum() const {
+        return static_cast<int64_t>(raw_) >> 1;
+    }
+
+    double GetFlonum() const {
+        auto rotated = raw_ >> 3;
+        if (rotated > 1) {
+            rotated += kFlonumExponentOffset;
+        }
+        auto bits = (rotated >> 1) | (rotated << 63);
+        double number;
+        std::memcpy(&number, &bits, sizeof(number));
+        return number;
+    }
+
+    bool GetBool() const {
+        return raw_ >> 32;
+    }
+
+    Symbol GetSymbol() const {
+        return static_cast<Symbol>(raw_ >> 32);
+    }
+
+    Object* GetObject() const {
+        return reinterpret_cast<Object*>(raw_ & ~kObjectTag);
+    }
+
+    Cell* GetCell() const {
+        return reinterpret_cast<Cell*>(raw_ & ~kPairTag);
+    }
+
+    uint64_t Raw() const {
+        return raw_;
+    }
+
+    /* Identity, which is what eq? means for immediates */
+    bool operator==(const Value& rhs) const {
+        return raw_ == rhs.raw_;
+    }
+
+    bool operator!=(const Value& rhs) const {
+        return raw_ != rhs.raw_;
+    }
+
+    static constexpr int64_t kFixnumMax = INT64_MAX >> 1;
+    static constexpr int64_t kFixnumMin = INT64_MIN >> 1;
+
+private:
+    explicit Value(uint64_t raw)
+            : raw_(raw) {}
+
+    /* Sign first, then the mantissa, then the exponent on top */
+    static uint64_t RotatedBits(double number) {
+        uint64_t bits;
+        std::memcpy(&bits, &number, sizeof(bits));
+        return (bits << 1) | (bits >> 63);
+    }
+
+    static constexpr uint64_t Immediate(Tag tag, uint32_t payload) {
+        return (uint64_t(payload) << 32) | (uint64_t(tag) << 3) | kImmediateTag;
+    }
+
+    static constexpr uint64_t kObjectTag = 1;
+    static constexpr uint64_t kImmediateTag = 3;
+    static constexpr uint64_t kPairTag = 5;
+    static constexpr uint64_t kFlonumTag = 7;
+    /* Biased exponents 897 to 1151 are stored as 1 to 255, 0 is left for
+     * the zeros */
+    static constexpr uint64_t kFlonumMinExponent = 897;
+    static constexpr uint64_t kFlonumExponentOffset = (kFlonumMinExponent - 1) << 53;
+    static constexpr uint64_t kKindMask = 0xffffffff;
+
+    uint64_t raw_;
+};
@@ -0,0 +1,736 @@
+#include <algorithm>
+#include <functional>
+#include "numbers.h"
+#include "parallel.h"
+#include "vm.h"
+
+namespace {
+
+inline Value Bool(bool value) {
+    return Value::MakeBool(value);
+}
+
+/* The closure whose call owns the frame */
+inline Closure* Running(const Value* fp) {
+    return static_cast<Closure*>(fp[-1].GetObject());
+}
+
+/* A VM of its own for each thread of a parallel section */
+class VMCaller : public Caller {
+public:
+    VMCaller(Heap& heap, Environment* globals, const VM& parent)
+            : vm_(heap, globals) {
+        vm_.ShareBudget(parent);
+    }
+
+    Value Call(Value procedure, const Value* args, size_t argc) override {
+        return vm_.Apply(procedure, args, argc);
+    }
+
+private:
+    VM vm_;
+};
+
+}
+
+[[noreturn]] void ThrowUnbound(Symbol symbol) {
+    throw NameError("ERROR: Unbound variable " + Tokenizer::Symbols().Name(symbol) + "\n");
+}
+
+Closure* CheckCallee(Value callee, size_t argc) {
+    auto closure = AsClosure(callee);
+    if (!closure) {
+        throw std::runtime_error("ERROR: Not a procedure\n");
+    }
+
+    auto params = closure->function->params.size();
+    if (argc != params) {
+        throw std::runtime_error("ERROR: Wrong number of arguments, expected " +
+                                 std::to_string(params) + " but got " + std::to_string(argc) +
+                                 ".\n");
+    }
+
+    return closure;
+}
+
+void CheckAssignable(const Heap& heap, Symbol symbol) {
+    if (heap.InParallel()) {
+        throw std::runtime_error("ERROR: Cannot assign global " +
+                                 Tokenizer::Symbols().Name(symbol) + " in a parallel section\n");
+    }
+}
+
+Channel* CheckChannel(const Heap& heap, Value value) {
+    auto channel = AsChannel(value);
+    if (!channel) {
+        throw std::runtime_error("ERROR: Expected a channel\n");
+    }
+    if (heap.InParallel()) {
+        throw std::runtime_error("ERROR: Channels cannot be used in a parallel section\n");
+    }
+
+    return channel;
+}
+
+Value MakeChannel(Heap& heap, Value capacity) {
+    auto size = TakeFixnum(capacity);
+    if (size < 1) {
+        throw std::runtime_error("ERROR: Channel capacity must be positive\n");
+    }
+
+    return Value::MakeObject(heap.New<Channel>(size));
+}
+
+std::vector<const GlobalSite*> Chunk::GlobalSites() const {
+    std::vector<const GlobalSite*> sites;
+    for (auto& site : globals) {
+        sites.push_back(&site);
+    }
+    for (auto& function : functions) {
+        auto nested = function->chunk.GlobalSites();
+        sites.insert(sites.end(), nested.begin(), nested.end());
+    }
+
+    return sites;
+}
+
+VM::VM(Heap& heap, Environment* globals)
+        : heap_(heap)
+        , roots_id_(heap.AddRoots([this](Heap& heap) { MarkRoots(heap); }))
+        , globals_(globals ? globals : heap.New<Environment>())
+        , sp_(nullptr)
+        , running_(&main_)
+        , worker_(globals) {
+    spawn_.code = {{OpCode::CALL, 0}, {OpCode::THREAD_EXIT, 0}};
+    spawn_.max_stack = 1;
+}
+
+VM::~VM() {
+    heap_.RemoveRoots(roots_id_);
+}
+
+void VM::ResetGlobals() {
+    globals_ = heap_.New<Environment>();
+
+    /* Main is not parked between runs, whoever waits on a channel goes */
+    for (auto& thread : threads_) {
+        if (thread->channel) {
+            thread->channel->senders.clear();
+            thread->channel->receivers.clear();
+        }
+    }
+    threads_.clear();
+    ready_.clear();
+}
+
+size_t VM::GreenThreads() const {
+    return threads_.size();
+}
+
+void VM::Unpark(GreenThread* thread) {
+    auto remove = [thread](std::deque<GreenThread*>& queue) {
+        queue.erase(std::remove(queue.begin(), queue.end(), thread), queue.end());
+    };
+    if (thread->channel) {
+        remove(thread->channel->senders);
+        remove(thread->channel->receivers);
+        thread->channel = nullptr;
+    }
+    remove(ready_);
+}
+
+void VM::DropThread(GreenThread* thread) {
+    auto index = thread->index;
+    std::swap(threads_[index], threads_.back());
+    threads_[index]->index = index;
+    threads_.pop_back();
+}
+
+Value VM::Apply(Value procedure, const Value* args, size_t argc) {
+    if (apply_.constants.size() != argc + 1) {
+        apply_.code.clear();
+        for (uint32_t i = 0; i <= argc; ++i) {
+            apply_.code.push_back({OpCode::PUSH_CONST, i});
+        }
+        apply_.code.push_back({OpCode::CALL, static_cast<uint32_t>(argc)});
+        apply_.code.push_back({OpCode::RETURN, 0});
+        apply_.max_stack = argc + 1;
+    }
+
+    apply_.constants.assign(1, procedure);
+    apply_.constants.insert(apply_.constants.end(), args, args + argc);
+    return Run(apply_);
+}
+
+CallerFactory VM::Callers() const {
+    return [this] {
+        return std::make_unique<VMCaller>(heap_, globals_, *this);
+    };
+}
+
+void VM::SetLimits(const Limits& limits) {
+    limits_ = limits;
+    budget_.Start(limits);
+}
+
+void VM::ShareBudget(const VM& parent) {
+    budget_.Join(parent.budget_, parent.frames_.size());
+}
+
+void VM::Safepoint(Value* sp, size_t cells) {
+    if (!budget_.Step(heap_)) {
+        sp_ = sp;
+        budget_.Check(heap_);
+    }
+    if (heap_.ShouldCollect()) {
+        sp_ = sp;
+        heap_.Collect();
+    }
+    if (!heap_.HasRoom(cells)) {
+        sp_ = sp;
+        heap_.CollectNursery();
+    }
+}
+
+void VM::MarkRoots(Heap& heap) {
+    heap.Mark(globals_);
+    /* Locals are stack slots too */
+    for (auto value = stack_.data(); value < sp_; ++value) {
+        heap.Mark(*value);
+    }
+
+    /* And so are those of the threads switched out */
+    auto mark = [&heap](GreenThread& thread) {
+        for (size_t i = 0; i < thread.sp; ++i) {
+            heap.Mark(thread.stack[i]);
+        }
+    };
+    if (running_ != &main_) {
+        mark(main_);
+    }
+    for (auto& thread : threads_) {
+        if (thread.get() != running_) {
+            mark(*thread);
+        }
+    }
+}
+
+Value VM::Run(const Chunk& chunk) {
+    if (stack_.size() < chunk.max_stack) {
+        stack_.resize(chunk.max_stack);
+    }
+
+    /* Nothing but the globals and the threads switched out is live once
+     * the run is over. A thread that threw is dropped, and main with it. */
+    struct Finish {
+        ~Finish() {
+            if (vm->running_ != &vm->main_) {
+                vm->DropThread(vm->running_);
+                vm->Unpark(&vm->main_);
+                vm->running_ = &vm->main_;
+            }
+            vm->main_.sp = 0;
+            vm->frames_.clear();
+            vm->sp_ = nullptr;
+        }
+        VM* vm;
+    } finish{this};
+    frames_.clear();
+    if (!worker_) {
+        budget_.Start(limits_);
+    }
+
+    const Chunk* current = &chunk;
+    const Instruction* code = current->code.data();
+    const Instruction* ip = code;
+    Value* sp = stack_.data();
+    /* The top level has no locals, its callee slot would be 0 */
+    Value* fp = stack_.data() + 1;
+
+    /* Sets up the frame of a call whose callee and arguments are at base */
+    auto enter = [&](size_t base, const Function& function) {
+        current = &function.chunk;
+        code = current->code.data();
+        auto frame_size = 1 + function.locals + current->max_stack;
+        if (base + frame_size > stack_.size()) {
+            stack_.resize(std::max(base + frame_size, 2 * stack_.size()));
+        }
+        fp = stack_.data() + base + 1;
+        sp = fp + function.locals;
+        std::fill(fp + function.params.size(), sp, Value());
+    };
+
+    /* Switches to the thread, the running one was saved or dropped */
+    auto resume = [&](GreenThread* thread) {
+        running_ = thread;
+        stack_.swap(thread->stack);
+        frames_.swap(thread->frames);
+        current = thread->chunk;
+        code = current->code.data();
+        ip = thread->ip;
+        sp = stack_.data() + thread->sp;
+        fp = stack_.data() + thread->fp;
+    };
+
+    /* The next ready thread, unless every one is blocked */
+    auto next_ready = [&] {
+        if (ready_.empty()) {
+            throw std::runtime_error("ERROR: Deadlock, every green thread is blocked\n");
+        }
+        auto thread = ready_.front();
+        ready_.pop_front();
+        return thread;
+    };
+
+    /* Parks the running thread on the channel and switches to the next
+     * ready one. It runs ip again once woken, finding the channel as it
+     * is by then. */
+    auto park = [&](Channel* channel, std::deque<GreenThread*>& waiting) {
+        auto next = next_ready();
+        auto& thread = *running_;
+        thread.chunk = current;
+        thread.ip = ip;
+        thread.sp = sp - stack_.data();
+        thread.fp = fp - stack_.data();
+        thread.channel = channel;
+        thread.stack.swap(stack_);
+        thread.frames.swap(frames_);
+        waiting.push_back(&thread);
+        resume(next);
+    };
+
+    auto wake = [&](std::deque<GreenThread*>& waiting) {
+        if (!waiting.empty()) {
+            waiting.front()->channel = nullptr;
+            ready_.push_back(waiting.front());
+            waiting.pop_front();
+        }
+    };
+
+#ifdef LISP_COMPUTED_GOTO
+#define LISP_OPCODE_LABEL(name) &&op_##name,
+    static void* const dispatch_table[] = {LISP_OPCODES(LISP_OPCODE_LABEL)};
+#undef LISP_OPCODE_LABEL
+#define VM_CASE(name) op_##name:
+#define VM_DISPATCH() goto *dispatch_table[static_cast<size_t>(ip->op)]
+#define VM_CONTINUE() VM_DISPATCH()
+#define VM_NEXT() { ++ip; VM_DISPATCH(); }
+#define VM_JUMP(target) { ip = code + (target); VM_DISPATCH(); }
+
+    VM_DISPATCH();
+#else
+#define VM_CASE(name) case OpCode::name:
+#define VM_CONTINUE() continue
+#define VM_NEXT() { ++ip; continue; }
+#define VM_JUMP(target) { ip = code + (target); continue; }
+
+    for (;;) switch (ip->op) {
+#endif
+
+    VM_CASE(PUSH_CONST)
+        *sp++ = current->constants[ip->arg];
+        VM_NEXT();
+
+    VM_CASE(PUSH_LITERAL)
+        *sp++ = CopyNumber(heap_, current->constants[ip->arg]);
+        VM_NEXT();
+
+    VM_CASE(PUSH_BOOL)
+        *sp++ = Bool(ip->arg);
+        VM_NEXT();
+
+    VM_CASE(ADD)
+        sp -= ip->arg;
+        *sp = NumberSum(heap_, sp, ip->arg);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(SUB)
+        sp -= ip->arg;
+        *sp = NumberDifference(heap_, sp, ip->arg);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(MUL)
+        sp -= ip->arg;
+        *sp = NumberProduct(heap_, sp, ip->arg);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(DIV)
+        sp -= ip->arg;
+        *sp = NumberQuotient(heap_, sp, ip->arg);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(MIN)
+        sp -= ip->arg;
+        *sp = NumberExtremum(heap_, sp, ip->arg, -1);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(MAX)
+        sp -= ip->arg;
+        *sp = NumberExtremum(heap_, sp, ip->arg, 1);
+        ++sp;
+        VM_NEXT();
+
+    VM_CASE(ABS)
+        sp[-1] = NumberAbs(heap_, sp[-1]);
+        VM_NEXT();
+
+#define VM_COMPARISON(name, compare)                            \
+    VM_CASE(name) {                                             \
+        sp -= ip->arg;                                          \
+        bool res = NumbersOrdered(sp, ip->arg, compare<int>()); \
+        *sp++ = Bool(res);                                      \
+        }                                                       \
+        VM_NEXT();
+
+    VM_COMPARISON(EQ, std::equal_to)
+    VM_COMPARISON(GT, std::greater)
+    VM_COMPARISON(LT, std::less)
+    VM_COMPARISON(GEQ, std::greater_equal)
+    VM_COMPARISON(LEQ, std::less_equal)
+#undef VM_COMPARISON
+
+    VM_CASE(NOT)
+        sp[-1] = Bool(sp[-1].IsFalse());
+        VM_NEXT();
+
+    VM_CASE(IS_NUMBER)
+        sp[-1] = Bool(IsNumber(sp[-1]));
+        VM_NEXT();
+
+    VM_CASE(IS_BOOLEAN)
+        sp[-1] = Bool(sp[-1].IsBool());
+        VM_NEXT();
+
+    VM_CASE(ARE_EQ)
+        --sp;
+        sp[-1] = Bool(sp[-1] == sp[0]);
+        VM_NEXT();
+
+    VM_CASE(ARE_EQUAL)
+        --sp;
+        sp[-1] = Bool(Equal(sp[-1], sp[0]));
+        VM_NEXT();
+
+    VM_CASE(IS_SYMBOL)
+        sp[-1] = Bool(sp[-1].IsSymbol());
+        VM_NEXT();
+
+    VM_CASE(IS_NULL)
+        sp[-1] = Bool(sp[-1].IsNil());
+        VM_NEXT();
+
+    VM_CASE(IS_PAIR)
+        sp[-1] = Bool(sp[-1].IsPair());
+        VM_NEXT();
+
+    VM_CASE(IS_LIST)
+        sp[-1] = Bool(IsList(sp[-1]));
+        VM_NEXT();
+
+    VM_CASE(CONS)
+        Safepoint(sp, 1);
+        --sp;
+        sp[-1] = Value::MakePair(heap_.NewCell(sp[-1], sp[0]));
+        VM_NEXT();
+
+    VM_CASE(CAR)
+        sp[-1] = CheckPair(sp[-1])->car;
+        VM_NEXT();
+
+    VM_CASE(CDR)
+        sp[-1] = CheckPair(sp[-1])->cdr;
+        VM_NEXT();
+
+    VM_CASE(SET_CAR) {
+        --sp;
+        auto cell = CheckPair(sp[-1]);
+        cell->car = sp[0];
+        heap_.WriteBarrier(cell, sp[0]);
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(SET_CDR) {
+        --sp;
+        auto cell = CheckPair(sp[-1]);
+        cell->cdr = sp[0];
+        heap_.WriteBarrier(cell, sp[0]);
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(LIST) {
+        Safepoint(sp, ip->arg);
+        auto list = Value::MakeNil();
+        for (auto arg = sp; arg != sp - ip->arg;) {
+            --arg;
+            list = Value::MakePair(heap_.NewCell(*arg, list));
+        }
+        sp -= ip->arg;
+        *sp++ = list;
+        }
+        VM_NEXT();
+
+    VM_CASE(LIST_REF)
+        --sp;
+        sp[-1] = ListRef(sp[-1], TakeFixnum(sp[0]));
+        VM_NEXT();
+
+    VM_CASE(LIST_TAIL)
+        --sp;
+        sp[-1] = ListTail(sp[-1], TakeFixnum(sp[0]));
+        VM_NEXT();
+
+    /* Run by VMs of their own on other threads, which see what is below
+     * sp as roots of this one */
+    VM_CASE(PMAP)
+        sp_ = sp;
+        --sp;
+        sp[-1] = ParallelMap(heap_, sp[-1], sp[0], Callers());
+        VM_NEXT();
+
+    VM_CASE(PFOR_EACH)
+        sp_ = sp;
+        --sp;
+        ParallelForEach(heap_, sp[-1], sp[0], Callers());
+        sp[-1] = Value();
+        VM_NEXT();
+
+    VM_CASE(PREDUCE)
+        sp_ = sp;
+        sp -= 2;
+        sp[-1] = ParallelReduce(heap_, sp[-1], sp[0], sp[1], Callers());
+        VM_NEXT();
+
+    VM_CASE(SPAWN) {
+        if (worker_) {
+            throw std::runtime_error("ERROR: Cannot spawn inside pmap\n");
+        }
+        CheckCallee(sp[-1], 0);
+        auto thread = std::make_unique<GreenThread>();
+        thread->stack.assign(1, sp[-1]);
+        thread->chunk = &spawn_;
+        thread->ip = spawn_.code.data();
+        thread->sp = 1;
+        thread->fp = 1;
+        thread->index = threads_.size();
+        ready_.push_back(thread.get());
+        threads_.push_back(std::move(thread));
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(MAKE_CHANNEL)
+        Safepoint(sp);
+        sp[-1] = MakeChannel(heap_, sp[-1]);
+        VM_NEXT();
+
+    VM_CASE(SEND) {
+        auto channel = CheckChannel(heap_, sp[-2]);
+        if (channel->values.size() == channel->capacity) {
+            park(channel, channel->senders);
+            VM_CONTINUE();
+        }
+        channel->values.push_back(sp[-1]);
+        heap_.Charge(sizeof(Value));
+        heap_.WriteBarrier(channel, sp[-1]);
+        wake(channel->receivers);
+        --sp;
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(RECV) {
+        auto channel = CheckChannel(heap_, sp[-1]);
+        if (channel->values.empty()) {
+            park(channel, channel->receivers);
+            VM_CONTINUE();
+        }
+        sp[-1] = channel->values.front();
+        channel->values.pop_front();
+        wake(channel->senders);
+        }
+        VM_NEXT();
+
+    VM_CASE(THREAD_EXIT) {
+        auto finished = running_;
+        resume(next_ready());
+        DropThread(finished);
+        }
+        VM_CONTINUE();
+
+    VM_CASE(JUMP)
+        VM_JUMP(ip->arg);
+
+    VM_CASE(JUMP_IF_FALSE)
+        if ((--sp)->IsFalse()) {
+            VM_JUMP(ip->arg);
+        }
+        VM_NEXT();
+
+    VM_CASE(JUMP_IF_TRUE)
+        if (!(--sp)->IsFalse()) {
+            VM_JUMP(ip->arg);
+        }
+        VM_NEXT();
+
+    VM_CASE(NO_ELSE)
+        throw std::runtime_error("ERROR: No else part to execute\n");
+
+    VM_CASE(GET_LOCAL)
+        *sp++ = fp[ip->arg];
+        VM_NEXT();
+
+    VM_CASE(SET_LOCAL)
+        fp[ip->arg] = sp[-1];
+        sp[-1] = Value();
+        VM_NEXT();
+
+    VM_CASE(GET_BOXED_LOCAL)
+        *sp++ = GetBox(fp[ip->arg])->value;
+        VM_NEXT();
+
+    VM_CASE(SET_BOXED_LOCAL) {
+        auto box = GetBox(fp[ip->arg]);
+        box->value = sp[-1];
+        heap_.WriteBarrier(box, sp[-1]);
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(BOX_LOCAL) {
+        Safepoint(sp);
+        auto box = heap_.New<Box>(fp[ip->arg]);
+        heap_.WriteBarrier(box, box->value);
+        fp[ip->arg] = Value::MakeObject(box);
+        }
+        VM_NEXT();
+
+    VM_CASE(GET_FREE)
+        *sp++ = Running(fp)->free[ip->arg];
+        VM_NEXT();
+
+    VM_CASE(GET_BOXED_FREE)
+        *sp++ = GetBox(Running(fp)->free[ip->arg])->value;
+        VM_NEXT();
+
+    VM_CASE(SET_BOXED_FREE) {
+        auto box = GetBox(Running(fp)->free[ip->arg]);
+        box->value = sp[-1];
+        heap_.WriteBarrier(box, sp[-1]);
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(GET_GLOBAL) {
+        auto& site = current->globals[ip->arg];
+        auto binding = globals_->Find(site);
+        if (!binding) {
+            ThrowUnbound(site.symbol);
+        }
+        *sp++ = binding->value;
+        }
+        VM_NEXT();
+
+    VM_CASE(SET_GLOBAL) {
+        auto& site = current->globals[ip->arg];
+        CheckAssignable(heap_, site.symbol);
+        auto binding = globals_->Find(site);
+        if (!binding) {
+            ThrowUnbound(site.symbol);
+        }
+        Environment::Assign(binding, site, sp[-1]);
+        heap_.WriteBarrier(globals_, sp[-1]);
+        sp[-1] = Value();
+        }
+        VM_NEXT();
+
+    VM_CASE(DEFINE_GLOBAL)
+        CheckAssignable(heap_, ip->arg);
+        if (globals_->Define(ip->arg, sp[-1])) {
+            heap_.Charge(Environment::kBindingBytes);
+        }
+        heap_.WriteBarrier(globals_, sp[-1]);
+        sp[-1] = Value();
+        VM_NEXT();
+
+    VM_CASE(MAKE_CLOSURE) {
+        Safepoint(sp);
+        auto& function = current->functions[ip->arg];
+        auto closure = heap_.New<Closure>(function);
+        closure->free.reserve(function->captures.size());
+        heap_.Charge(closure->free.capacity() * sizeof(Value));
+        for (auto& from : function->captures) {
+            auto value = from.kind == Address::Kind::LOCAL ? fp[from.index]
+                                                           : Running(fp)->free[from.index];
+            closure->free.push_back(value);
+            heap_.WriteBarrier(closure, value);
+        }
+        *sp++ = Value::MakeObject(closure);
+        }
+        VM_NEXT();
+
+    VM_CASE(CALL) {
+        Safepoint(sp);
+        auto argc = ip->arg;
+        auto callee = sp - argc - 1;
+        auto& function = *CheckCallee(*callee, argc)->function;
+        budget_.Enter(frames_.size() + 1);
+
+        size_t base = callee - stack_.data();
+        frames_.push_back({current, ip + 1, base, static_cast<size_t>(fp - stack_.data())});
+        /* The callee stays in its slot while it runs, which keeps its code
+         * alive, and the arguments are its first locals already */
+        enter(base, function);
+        }
+        VM_JUMP(0);
+
+    VM_CASE(TAIL_CALL) {
+        Safepoint(sp);
+        auto argc = ip->arg;
+        auto callee = sp - argc - 1;
+        auto& function = *CheckCallee(*callee, argc)->function;
+
+        /* The caller's frame is replaced, the result goes straight to its caller */
+        size_t base = fp - stack_.data() - 1;
+        std::move(callee, sp, stack_.data() + base);
+        enter(base, function);
+        }
+        VM_JUMP(0);
+
+    VM_CASE(POP)
+        --sp;
+        VM_NEXT();
+
+    VM_CASE(RETURN) {
+        auto result = sp[-1];
+        if (frames_.empty()) {
+            return result;
+        }
+
+        auto& frame = frames_.back();
+        sp = stack_.data() + frame.base;
+        *sp++ = result;
+        fp = stack_.data() + frame.fp;
+        current = frame.chunk;
+        code = current->code.data();
+        ip = frame.ip;
+        frames_.pop_back();
+        }
+        VM_CONTINUE();
+
+#ifndef LISP_COMPUTED_GOTO
+    }
+#endif
+
+#undef VM_CASE
+#undef VM_CONTINUE
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_DISPATCH
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "budget.h"
+#include "heap.h"
+#include "lisp.h"
+#include "parallel.h"
+#include "scope.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LISP_COMPUTED_GOTO
+#endif
+
+/* Every opcode the compiler can emit, in dispatch table order */
+#define LISP_OPCODES(X) \
+    X(PUSH_CONST)       \
+    X(PUSH_LITERAL)     \
+    X(PUSH_BOOL)        \
+    X(ADD)              \
+    X(SUB)              \
+    X(MUL)              \
+    X(DIV)              \
+    X(MIN)              \
+    X(MAX)              \
+    X(ABS)              \
+    X(EQ)               \
+    X(GT)               \
+    X(LT)               \
+    X(GEQ)              \
+    X(LEQ)              \
+    X(NOT)              \
+    X(IS_NUMBER)        \
+    X(IS_BOOLEAN)       \
+    X(ARE_EQ)           \
+    X(ARE_EQUAL)        \
+    X(IS_SYMBOL)        \
+    X(IS_NULL)          \
+    X(IS_PAIR)          \
+    X(IS_LIST)          \
+    X(CONS)             \
+    X(CAR)              \
+    X(CDR)              \
+    X(SET_CAR)          \
+    X(SET_CDR)          \
+    X(LIST)             \
+    X(LIST_REF)         \
+    X(LIST_TAIL)        \
+    X(PMAP)             \
+    X(PFOR_EACH)        \
+    X(PREDUCE)          \
+    X(SPAWN)            \
+    X(MAKE_CHANNEL)     \
+    X(SEND)             \
+    X(RECV)             \
+    X(THREAD_EXIT)      \
+    X(JUMP)             \
+    X(JUMP_IF_FALSE)    \
+    X(JUMP_IF_TRUE)     \
+    X(NO_ELSE)          \
+    X(GET_LOCAL)        \
+    X(SET_LOCAL)        \
+    X(GET_BOXED_LOCAL)  \
+    X(SET_BOXED_LOCAL)  \
+    X(BOX_LOCAL)        \
+    X(GET_FREE)         \
+    X(GET_BOXED_FREE)   \
+    X(SET_BOXED_FREE)   \
+    X(GET_GLOBAL)       \
+    X(SET_GLOBAL)       \
+    X(DEFINE_GLOBAL)    \
+    X(MAKE_CLOSURE)     \
+    X(CALL)             \
+    X(TAIL_CALL)        \
+    X(POP)              \
+    X(RETURN)
+
+enum class OpCode : uint8_t {
+#define LISP_OPCODE_ENUM(name) name,
+    LISP_OPCODES(LISP_OPCODE_ENUM)
+#undef LISP_OPCODE_ENUM
+};
+
+struct Instruction {
+    OpCode op;
+    /* Argument count for n-ary builtins and calls, jump target, frame
+     * slot, capture, symbol, constant, global site or function index */
+    uint32_t arg;
+};
+
+struct Function;
+struct TreeNode;
+
+struct Chunk {
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    /* Owns the boxed literals among the constants, which PUSH_LITERAL
+     * copies to the heap running the chunk */
+    std::shared_ptr<Heap> literals;
+    /* Bodies of the lambdas created by this chunk */
+    std::vector<std::shared_ptr<const Function>> functions;
+    /* One per global referenced or assigned, filled as the chunk runs */
+    mutable std::vector<GlobalSite> globals;
+    size_t max_stack = 0;
+
+    /* Sites of this chunk and of the lambdas it creates */
+    std::vector<const GlobalSite*> GlobalSites() const;
+};
+
+struct Function {
+    std::vector<Symbol> params;
+    /* Frame slots, the parameters first */
+    uint32_t locals = 0;
+    /* Where the values a closure captures are in the frame making it */
+    std::vector<Address> captures;
+    Chunk chunk;
+    /* What the closure tree evaluator runs instead of the chunk */
+    std::shared_ptr<const TreeNode> body;
+};
+
+/* Calling conventions the VM shares with the closure tree evaluator */
+[[noreturn]] void ThrowUnbound(Symbol symbol);
+/* The closure to call, throws unless callee is one taking argc arguments */
+Closure* CheckCallee(Value callee, size_t argc);
+/* Globals are read only while a parallel section runs */
+void CheckAssignable(const Heap& heap, Symbol symbol);
+/* The channel to send to or receive from, which the threads of a
+ * parallel section cannot */
+Channel* CheckChannel(const Heap& heap, Value value);
+/* A channel of the capacity given, throws unless it is positive */
+Value MakeChannel(Heap& heap, Value capacity);
+
+/* Expects an analyzed AST, which has the arity of every form checked */
+class Compiler {
+public:
+    /* Compiles the body of the lambda scope stands for, the top level if null */
+    explicit Compiler(const AST& ast, Scope* scope = nullptr);
+
+    Chunk Compile();
+
+    static Chunk CompileExpression(const std::string& expr);
+
+private:
+    using Pair = AST::Pair;
+    using TokenType = Tokenizer::TokenType;
+    using Builtins = Tokenizer::Builtins;
+
+    /* Expressions up to the end of the list, the value of the last one is
+     * kept. Tail is set when that value is returned right away, so calls
+     * there replace the current frame. */
+    void CompileSequence(const Pair* node, bool tail);
+    void CompileNode(const Pair* node, bool tail = false);
+    void CompileForm(const Pair* head, bool tail);
+    void CompileArgs(const Pair* head);
+    /* Pushes a number, boolean, symbol or the unspecified value */
+    void CompileConstant(Value value);
+    /* Pushes what a quoted node stands for */
+    void CompileDatum(const Pair* node);
+    void CompileIf(const Pair* head, size_t argc, bool tail);
+    void CompileLogic(const Pair* head, bool is_and);
+    void CompileCall(const Pair* head, bool tail);
+    void CompileLambda(const Pair* params, const Pair* body);
+    void CompileDefine(const Pair* head);
+    void CompileSet(const Pair* head);
+    void CompileGet(Symbol symbol);
+    /* Leaves the unspecified value of the assignment */
+    void CompileAssign(Symbol symbol, bool define);
+    Chunk CompileBody(const Pair* body);
+
+    size_t Emit(OpCode op, uint32_t arg = 0);
+    uint32_t AddGlobalSite(Symbol symbol);
+    void Patch(size_t jump);
+    void Push(int64_t count);
+
+    const AST& ast_;
+    Scope* scope_;
+    Chunk chunk_;
+    int64_t depth_;
+};
+
+/* A call's frame is the callee slot followed by the local slots, its
+ * operands go right above */
+struct Frame {
+    const Chunk* chunk;
+    const Instruction* ip;
+    /* Stack slot of the callee, where the result goes */
+    size_t base;
+    /* First local slot of the caller */
+    size_t fp;
+};
+
+/* A green thread switched out. The VM runs the one switched in on its
+ * own stack and frames, which a switch swaps with those kept here, so a
+ * thread costs a few hundred bytes and a switch no system call. */
+struct GreenThread {
+    std::vector<Value> stack;
+    std::vector<Frame> frames;
+    /* Where it resumes, the stack and frame pointers as offsets */
+    const Chunk* chunk = nullptr;
+    const Instruction* ip = nullptr;
+    size_t sp = 0;
+    size_t fp = 0;
+    /* Parked on the channel until it is woken, nullptr otherwise */
+    Channel* channel = nullptr;
+    /* In VM::threads_ */
+    size_t index = 0;
+};
+
+class VM {
+public:
+    /* Closures, boxes and cons cells are allocated on the heap, which
+     * sees the stack and the globals as roots. The globals are shared
+     * with another VM when given, like the workers of pmap do. */
+    explicit VM(Heap& heap, Environment* globals = nullptr);
+    ~VM();
+
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
+    /* Runs a chunk in the global environment, which persists between runs */
+    Value Run(const Chunk& chunk);
+
+    /* Calls a procedure with argc arguments from outside of a run */
+    Value Apply(Value procedure, const Value* args, size_t argc);
+
+    /* Starts over with no globals defined, the old ones become garbage,
+     * and drops the green threads */
+    void ResetGlobals();
+
+    /* Green threads spawned and not finished yet */
+    size_t GreenThreads() const;
+
+    /* Every run from now on gets all of limits, a worker gets them once
+     * for everything it calls */
+    void SetLimits(const Limits& limits);
+
+    /* For a worker, runs everything it calls on what is left of the
+     * budget of parent, which goes on counting the steps */
+    void ShareBudget(const VM& parent);
+
+private:
+    /* Collects if the heap asks for it or the nursery has no room for the
+     * cells about to be allocated, live state is published first */
+    void Safepoint(Value* sp, size_t cells = 0);
+    void MarkRoots(Heap& heap);
+    /* For the workers of pmap, which get what is left of the budget */
+    CallerFactory Callers() const;
+
+    /* Takes a thread off the channel it is parked on or the ready queue */
+    void Unpark(GreenThread* thread);
+    /* For the running thread, which is in no queue */
+    void DropThread(GreenThread* thread);
+
+    Heap& heap_;
+    size_t roots_id_;
+    Environment* globals_;
+    std::vector<Value> stack_;
+    std::vector<Frame> frames_;
+
+    /* Top of the stack of the running code as of the last safepoint */
+    Value* sp_;
+    /* Pushes what Apply was given and calls it */
+    Chunk apply_;
+
+    /* Green threads are scheduled cooperatively: the running one keeps
+     * going until it blocks on a channel or finishes. Every run starts as
+     * main and returns once main's code is done, threads still ready run
+     * whenever a later one blocks. */
+    GreenThread main_;
+    /* The one whose stack and frames are switched in */
+    GreenThread* running_;
+    std::vector<std::unique_ptr<GreenThread>> threads_;
+    std::deque<GreenThread*> ready_;
+    /* Calls the thunk a thread starts with, then finishes the thread */
+    Chunk spawn_;
+    /* Shares the globals of another VM, which owns the threads */
+    bool worker_;
+
+    Limits limits_;
+    /* Of the run, every green thread draws from it */
+    Budget budget_;
+};
@@ -0,0 +1,414 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include "../src/any.h"
+#include "../src/batch.h"
+#include "../src/interpreter.h"
+
+/* Every heap allocation made by the benchmarked code is counted, per
+ * thread so that pool workers do not contend on the counter */
+thread_local size_t allocations = 0;
+thread_local size_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+    ++allocations;
+    allocated_bytes += size;
+    if (auto memory = std::malloc(size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+template <class Body>
+size_t CountAllocations(Body body) {
+    auto before = allocations;
+    body();
+    return allocations - before;
+}
+
+template <class Body>
+void Bench(const std::string &name, size_t iterations, Body body) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        body();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    std::cout << name << ": " << ns / static_cast<int64_t>(iterations) << " ns/op" << std::endl;
+}
+
+/* Balanced arithmetic tree with 2^depth leaves */
+std::string Nested(size_t depth) {
+    if (!depth) {
+        return "1";
+    }
+
+    static const char *ops[] = {"+", "-", "*", "max"};
+    auto inner = Nested(depth - 1);
+    return std::string("(") + ops[depth % 4] + " " + inner + " " + inner + ")";
+}
+
+/* Roughly `bytes` of generated source mixing every kind of token */
+std::string Source(size_t bytes) {
+    std::string source;
+    for (size_t i = 0; source.size() < bytes; ++i) {
+        source += "(define (f" + std::to_string(i % 97) + " x y) (if (> x " +
+                  std::to_string(i * 7919 % 100000) + ") (+ x y -42) (max x y #t)))\n";
+    }
+
+    return source;
+}
+
+size_t CountTokens(Tokenizer &tokenizer) {
+    size_t count = 0;
+    do {
+        tokenizer.ReadNext();
+        ++count;
+    } while (tokenizer.ShowTokenType() != Tokenizer::TokenType::END_OF_FILE);
+
+    return count;
+}
+
+template <class Body>
+void Throughput(const std::string &name, size_t bytes, size_t iterations, Body body) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        body();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << name << ": " << bytes * iterations / elapsed.count() / (1 << 20) << " MB/s"
+              << std::endl;
+}
+
+int main() {
+    volatile size_t sink = 0;
+
+    /* Tree walker vs bytecode VM vs closure tree */
+    for (auto depth : {4, 8, 12}) {
+        auto expr = Nested(depth);
+        auto iterations = (size_t(1) << 20) >> depth;
+        auto suffix = " (depth " + std::to_string(depth) + ")";
+
+        Bench("tree parse+eval" + suffix, iterations, [&] {
+            sink += Evaluate(expr, Evaluate::Backend::TREE).size();
+        });
+        Bench("vm parse+compile+run" + suffix, iterations, [&] {
+            sink += Evaluate(expr, Evaluate::Backend::VM).size();
+        });
+
+        /* Not folded, which would leave nothing to dispatch */
+        AST ast{std::string_view(expr)};
+        while (ast.InsertLexema()) {}
+        ast.Analyze();
+
+        auto chunk = Compiler(ast).Compile();
+        Heap heap;
+        VM vm(heap);
+        Bench("vm run" + suffix, iterations, [&] {
+            sink += vm.Run(chunk).Raw();
+        });
+
+        auto folded = Compiler::CompileExpression(expr);
+        Bench("vm run folded" + suffix, iterations, [&] {
+            sink += vm.Run(folded).Raw();
+        });
+
+        auto tree = TreeBuilder(ast).Build();
+        TreeEvaluator evaluator(heap);
+        Bench("closure tree run" + suffix, iterations, [&] {
+            sink += evaluator.Run(tree).Raw();
+        });
+    }
+
+    /* A service answering a handful of templated expressions */
+    {
+        std::vector<std::string> scripts;
+        for (size_t i = 0; i < 16; ++i) {
+            scripts.push_back("(+ " + std::to_string(i) + " " + Nested(6) + ")");
+        }
+
+        size_t request = 0;
+        Bench("uncached requests (depth 6)", 1 << 14, [&] {
+            sink += Evaluate(scripts[request++ % scripts.size()]).size();
+        });
+
+        ChunkCache cache;
+        Bench("cached requests (depth 6)", 1 << 14, [&] {
+            sink += Evaluate(scripts[request++ % scripts.size()], cache).size();
+        });
+        std::cout << "cache hit rate: " << 100.0 * cache.Hits() / (cache.Hits() + cache.Misses())
+                  << "%" << std::endl;
+    }
+
+    /* Short expressions, one shot vs a session */
+    {
+        Bench("one shot (+ 1 2)", 1 << 18, [&] {
+            sink += Evaluate("(+ 1 2)").size();
+        });
+
+        Interpreter session;
+        Bench("session (+ 1 2)", 1 << 18, [&] {
+            sink += session.Eval("(+ 1 2)").size();
+        });
+
+        session.Eval("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        Bench("session call (fib 15)", 1 << 8, [&] {
+            sink += session.Eval("(fib 15)").size();
+        });
+
+        /* Tail calls must run in constant memory however long the loop */
+        session.Eval("(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))");
+        auto heap_before = session.HeapSize();
+        size_t count = 0;
+        Bench("tail loop (10M iterations)", 1, [&] {
+            count = CountAllocations([&] {
+                sink += session.Eval("(loop 10000000 0)").size();
+            });
+        });
+        std::cout << "tail loop: " << count << " allocations, "
+                  << static_cast<int64_t>(session.HeapSize() - heap_before) << " heap objects"
+                  << std::endl;
+
+        /* Calls, closures and lists per session backend */
+        for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+            Interpreter compared(1024, backend);
+            auto suffix = backend == Interpreter::Backend::VM ? " (vm)" : " (closure tree)";
+            std::string fib = "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))";
+            compared.Eval(fib);
+            compared.Eval("(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1))))");
+            compared.Eval("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+            compared.Eval("(define (sum l) (if (null? l) 0 (+ (car l) (sum (cdr l)))))");
+            compared.Eval("(define (adder n) (lambda (x) (+ x n)))");
+            compared.Eval("(define (mix n acc) (if (= n 0) acc (mix (- n 1) (- (* acc 3) (* acc 2) n))))");
+            compared.Eval("(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))");
+            compared.Eval("(define big (fact 2000))");
+            compared.Eval("(define (harmonic n acc) (if (= n 0) acc (harmonic (- n 1) (+ acc (/ 1. n)))))");
+            compared.Eval("(define (exact-harmonic n acc) (if (= n 0) acc (exact-harmonic (- n 1) (+ acc (/ 1 n)))))");
+            Bench(std::string("session call (fib 20)") + suffix, 8, [&] {
+                sink += compared.Eval("(fib 20)").size();
+            });
+            size_t hits = 0;
+            size_t misses = 0;
+            for (auto site : compared.GlobalSites(fib)) {
+                hits += site->hits;
+                misses += site->misses;
+            }
+            std::cout << "global sites" << suffix << ": " << hits << " hits, " << misses
+                      << " misses" << std::endl;
+            Bench(std::string("tail loop (1M iterations)") + suffix, 4, [&] {
+                sink += compared.Eval("(count 1000000 0)").size();
+            });
+            /* The same with every limit on, which costs a decrement per step */
+            Limits limits;
+            limits.steps = size_t(1) << 40;
+            limits.heap_bytes = size_t(1) << 30;
+            limits.depth = 100000;
+            compared.SetLimits(limits);
+            Bench(std::string("session call (fib 20) with limits") + suffix, 8, [&] {
+                sink += compared.Eval("(fib 20)").size();
+            });
+            Bench(std::string("tail loop (1M iterations) with limits") + suffix, 4, [&] {
+                sink += compared.Eval("(count 1000000 0)").size();
+            });
+            compared.SetLimits(Limits());
+            /* Overflow checks on the fixnum fast path, and the bignum slow path */
+            Bench(std::string("fixnum arithmetic (1M iterations)") + suffix, 4, [&] {
+                sink += compared.Eval("(mix 1000000 0)").size();
+            });
+            Bench(std::string("bignum factorial (fact 1000)") + suffix, 16, [&] {
+                sink += compared.Eval("(fact 1000)").size();
+            });
+            Bench(std::string("bignum square (5736 digits)") + suffix, 256, [&] {
+                sink += compared.Eval("(= (* big big) 0)").size();
+            });
+            /* Mixed fixnum and flonum operands, and exact fractions */
+            Bench(std::string("flonum arithmetic (1M iterations)") + suffix, 4, [&] {
+                sink += compared.Eval("(harmonic 1000000 0.)").size();
+            });
+            Bench(std::string("ratio arithmetic (200 terms)") + suffix, 64, [&] {
+                sink += compared.Eval("(exact-harmonic 200 0)").size();
+            });
+            /* The same per element work spread over the shared pool */
+            compared.Eval("(define (map f l) (if (null? l) '() (cons (f (car l)) (map f (cdr l)))))");
+            compared.Eval("(define (repeat n x acc) (if (= n 0) acc (repeat (- n 1) x (cons x acc))))");
+            compared.Eval("(define jobs (repeat 64 15 '()))");
+            Bench(std::string("map (64 x fib 15)") + suffix, 8, [&] {
+                sink += compared.Eval("(map (lambda (n) (fib n)) jobs)").size();
+            });
+            Bench(std::string("pmap (64 x fib 15)") + suffix, 8, [&] {
+                sink += compared.Eval("(pmap (lambda (n) (fib n)) jobs)").size();
+            });
+            Bench(std::string("list build+sum (1000 cells)") + suffix, 256, [&] {
+                sink += compared.Eval("(sum (build 1000 '()))").size();
+            });
+            Bench(std::string("closure calls") + suffix, 1 << 16, [&] {
+                sink += compared.Eval("((adder 1) (if (and #t #f) 1 2))").size();
+            });
+        }
+
+        /* Green threads parked on a channel at once, and the cost of a
+         * switch as two threads play ping-pong, two switches a round */
+        {
+            Interpreter green;
+            green.Eval("(define gate (channel 1))");
+            green.Eval("(define (spawn-all n) (if (= n 0) 'done ((lambda () (spawn (lambda () (recv gate))) (spawn-all (- n 1))))))");
+            green.Eval("(define (open n) (if (= n 0) 'done ((lambda () (send gate n) (open (- n 1))))))");
+            auto bytes = allocated_bytes;
+            Bench("spawn (100k green threads)", 1, [&] {
+                sink += green.Eval("(spawn-all 100000) (send gate 0)").size();
+            });
+            std::cout << "green threads: " << green.GreenThreads() << " parked, "
+                      << (allocated_bytes - bytes) / green.GreenThreads()
+                      << " bytes allocated each" << std::endl;
+            green.Eval("(open 99999)");
+
+            green.Eval("(define ping (channel 1))");
+            green.Eval("(define pong (channel 1))");
+            green.Eval("(define (serve) (send pong (recv ping)) (serve))");
+            green.Eval("(define (play n) (if (= n 0) 'done ((lambda () (send ping n) (recv pong) (play (- n 1))))))");
+            green.Eval("(spawn serve)");
+            Bench("green thread switch (1M rounds)", 1, [&] {
+                sink += green.Eval("(play 1000000)").size();
+            });
+        }
+
+        /* Collector pauses under a call heavy load, per threshold */
+        for (size_t threshold : {size_t(64) << 10, size_t(1) << 20, size_t(16) << 20}) {
+            Interpreter collected;
+            collected.SetCollectionThreshold(threshold, 2.0);
+            collected.Eval("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+            Bench("gc fib 20 (threshold " + std::to_string(threshold >> 10) + " KB)", 4, [&] {
+                sink += collected.Eval("(fib 20)").size();
+            });
+
+            auto& stats = collected.GetHeapStats();
+            std::cout << "gc: " << stats.collections << " collections, max pause "
+                      << stats.max_pause.count() << " ns, mean pause "
+                      << stats.total_pause.count() / std::max<size_t>(stats.collections, 1)
+                      << " ns, heap " << stats.bytes << " bytes in " << stats.objects
+                      << " objects" << std::endl;
+        }
+
+        /* Cons heavy loads per nursery size: garbage lists that die young,
+         * and a long list that survives every minor collection */
+        for (size_t nursery : {size_t(256) << 10, size_t(4) << 20}) {
+            Interpreter lists;
+            lists.SetNurserySize(nursery);
+            lists.Eval("(define (churn n) (list n n n n) (if (= n 0) 0 (churn (- n 1))))");
+            lists.Eval("(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+            auto suffix = " (nursery " + std::to_string(nursery >> 10) + " KB)";
+
+            Bench("cons churn, 4M cells" + suffix, 1, [&] {
+                sink += lists.Eval("(churn 1000000)").size();
+            });
+            Bench("cons build, 1M live cells" + suffix, 1, [&] {
+                sink += lists.Eval("(null? (build 1000000 (list)))").size();
+            });
+
+            auto& stats = lists.GetHeapStats();
+            std::cout << "minor gc: " << stats.minor_collections << " collections, max pause "
+                      << stats.max_minor_pause.count() << " ns, mean pause "
+                      << stats.total_minor_pause.count() /
+                         std::max<size_t>(stats.minor_collections, 1)
+                      << " ns, " << stats.promoted_cells << " cells promoted" << std::endl;
+        }
+    }
+
+    /* Heap allocations of a parse */
+    for (auto depth : {2, 6, 10}) {
+        auto expr = Nested(depth);
+        size_t nodes = 0;
+        size_t chunks = 0;
+        auto count = CountAllocations([&] {
+            AST ast{std::string_view(expr)};
+            while (ast.InsertLexema()) {}
+            nodes = ast.NodeCount();
+            chunks = ast.NodeChunkCount();
+        });
+        std::cout << "parse (depth " << depth << "): " << count << " allocations for " << nodes
+                  << " nodes in " << chunks << " chunks" << std::endl;
+    }
+
+    /* Heap allocations of passing a result up through Any, one level at a time */
+    for (size_t levels : {1, 16, 256}) {
+        auto count = CountAllocations([&] {
+            Any result = int64_t(1);
+            for (size_t i = 0; i < levels; ++i) {
+                Any parent = std::move(result);
+                result = parent;
+            }
+            sink += result.TakeValue<int64_t>();
+        });
+        std::cout << "any propagation (" << levels << " levels): " << count << " allocations"
+                  << std::endl;
+    }
+
+    /* Independent sources spread over a pool, a corpus of test expressions
+     * replicated many times */
+    std::vector<std::string> corpus = {
+            "(+ 800 (- 100 230 (* 21 31 (/ 10 (- 3 2) 10))))",
+            "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 15)",
+            "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc)))) (build 50 '())",
+            "(define (curry a) (lambda (b) (lambda (c) (+ a b c)))) (((curry 1) 2) 3)",
+            "(define (fact n) (if (= n 0) 1 (* n (fact (- n 1))))) (fact 40)",
+            "(list-ref '(1 2 3 4 5) 3)",
+            "(max 1 2.5 (/ 7 3))",
+            "(car 1)",
+    };
+    std::vector<std::string> sources;
+    for (size_t i = 0; i < 4000; ++i) {
+        sources.push_back(corpus[i % corpus.size()]);
+    }
+    for (size_t threads : {size_t(1), size_t(2), size_t(4), size_t(0)}) {
+        BatchEvaluator batch(threads);
+        batch.Evaluate(sources);
+        auto start = std::chrono::steady_clock::now();
+        sink += batch.Evaluate(sources).size();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "batch (" << batch.Threads() << " threads): "
+                  << static_cast<size_t>(sources.size() / elapsed.count()) << " sources/s"
+                  << std::endl;
+    }
+
+    /* Tokenizer throughput */
+    auto source = Source(size_t(8) << 20);
+    Throughput("stream tokenizer", source.size(), 1, [&] {
+        Tokenizer tokenizer(std::make_unique<std::stringstream>(source));
+        sink += CountTokens(tokenizer);
+    });
+    Throughput("buffer tokenizer", source.size(), 4, [&] {
+        Tokenizer tokenizer{std::string_view(source)};
+        sink += CountTokens(tokenizer);
+    });
+
+    for (auto kernel : {StructuralIndex::Kernel::SCALAR, StructuralIndex::Kernel::SSE2,
+                        StructuralIndex::Kernel::AVX2}) {
+        if (!StructuralIndex::IsSupported(kernel)) {
+            continue;
+        }
+
+        Throughput(std::string("structural index (") + StructuralIndex::KernelName(kernel) + ")",
+                   source.size(), 16, [&] {
+            sink += StructuralIndex(source, kernel).SkipSpaces(0);
+        });
+        Throughput(std::string("structural tokenizer (") + StructuralIndex::KernelName(kernel) + ")",
+                   source.size(), 4, [&] {
+            Tokenizer tokenizer(source, std::make_unique<StructuralIndex>(source, kernel));
+            sink += CountTokens(tokenizer);
+        });
+    }
+
+    return 0;
+}
@@ -1,16 +1,251 @@
+#include <cmath>
+#include <fstream>
 #include <iostream>
-#include "../src/lisp.h"
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include "../src/any.h"
+#include "../src/batch.h"
+#include "../src/interpreter.h"
+#include "../src/server.h"
+
+struct Token {
+    Tokenizer::TokenType type;
+    int64_t number;
+    Symbol symbol;
+
+    bool operator==(const Token &rhs) const {
+        return type == rhs.type && number == rhs.number && symbol == rhs.symbol;
+    }
+};
+
+std::vector<Token> ReadTokens(Tokenizer &tokenizer) {
+    std::vector<Token> tokens;
+    do {
+        tokenizer.ReadNext();
+        Token token{tokenizer.ShowTokenType(), 0, 0};
+        if (token.type == Tokenizer::TokenType::NUM) {
+            token.number = tokenizer.GetTokenNumber();
+        } else if (token.type == Tokenizer::TokenType::BOOL) {
+            token.number = tokenizer.GetTokenBool();
+        } else if (token.type == Tokenizer::TokenType::NAME ||
+                   token.type == Tokenizer::TokenType::BUILTIN) {
+            token.symbol = tokenizer.GetTokenSymbol();
+        }
+        tokens.push_back(token);
+    } while (tokens.back().type != Tokenizer::TokenType::END_OF_FILE);
+
+    return tokens;
+}
+
+void ExpectSameTokens(const std::string &expr) {
+    Tokenizer from_stream(std::make_unique<std::stringstream>(expr));
+    Tokenizer from_buffer{std::string_view(expr)};
+
+    auto expected = ReadTokens(from_stream);
+    if (!(ReadTokens(from_buffer) == expected)) {
+        std::cerr << "TEST FAILED: " + expr + " is tokenized differently from a stream";
+        std::cerr << std::endl;
+    }
+
+    for (auto kernel : {StructuralIndex::Kernel::SCALAR, StructuralIndex::Kernel::SSE2,
+                        StructuralIndex::Kernel::AVX2}) {
+        if (!StructuralIndex::IsSupported(kernel)) {
+            continue;
+        }
+
+        Tokenizer structural(expr, std::make_unique<StructuralIndex>(expr, kernel));
+        if (!(ReadTokens(structural) == expected)) {
+            std::cerr << "TEST FAILED: " + expr + " is tokenized differently by the " +
+                         StructuralIndex::KernelName(kernel) + " structural index";
+            std::cerr << std::endl;
+        }
+    }
+}
 
 void ExpectEq(const std::string &expr, const std::string &ans) {
-    auto res = Evaluate(expr);
+    ExpectSameTokens(expr);
+
+    /* Every expression runs through every backend side by side */
+    for (auto backend : {Evaluate::Backend::TREE, Evaluate::Backend::VM,
+                         Evaluate::Backend::CLOSURE_TREE}) {
+        auto res = Evaluate(expr, backend);
+
+        if (res != ans) {
+            std::cerr << "TEST FAILED: " + expr + " must be " + ans + " but got " + res;
+            std::cerr << (backend == Evaluate::Backend::TREE ? " (tree)" :
+                          backend == Evaluate::Backend::VM ? " (vm)" : " (closure tree)");
+            std::cerr << std::endl;
+        }
+    }
+}
+
+void ExpectTrue(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cerr << "TEST FAILED: " + what << std::endl;
+    }
+}
+
+/* Session tests, state carries over from one expression to the next */
+void ExpectEq(Interpreter &session, const std::string &expr, const std::string &ans) {
+    std::string res;
+    try {
+        res = session.Eval(expr);
+    } catch (std::exception &error) {
+        res = error.what();
+    }
 
     if (res != ans) {
-        std::cerr << "TEST FAILED: " + expr + " must be " + ans + " but got " + res;
-        std::cerr << std::endl;
+        std::cerr << "TEST FAILED: " + expr + " must be " + ans + " but got " + res << std::endl;
     }
 }
 
+template <class Error>
+void ExpectError(Interpreter &session, const std::string &expr, const std::string &kind) {
+    try {
+        session.Eval(expr);
+    } catch (Error &) {
+        return;
+    } catch (std::exception &error) {
+        std::cerr << "TEST FAILED: " + expr + " must raise a " + kind + " but raised " +
+                     error.what() << std::endl;
+        return;
+    }
+
+    std::cerr << "TEST FAILED: " + expr + " must raise a " + kind << std::endl;
+}
+
+void ExpectNoError(Interpreter &session, const std::string &expr) {
+    try {
+        session.Eval(expr);
+    } catch (std::exception &error) {
+        std::cerr << "TEST FAILED: " + expr + " raised " + error.what() << std::endl;
+    }
+}
+
+void ExpectSyntaxError(Interpreter &session, const std::string &expr) {
+    ExpectError<SyntaxError>(session, expr, "syntax error");
+}
+
+void ExpectNameError(Interpreter &session, const std::string &expr) {
+    ExpectError<NameError>(session, expr, "name error");
+}
+
+void ExpectRuntimeError(Interpreter &session, const std::string &expr) {
+    ExpectError<std::runtime_error>(session, expr, "runtime error");
+}
+
+void ExpectBudgetError(Interpreter &session, const std::string &expr) {
+    ExpectError<BudgetError>(session, expr, "budget error");
+}
+
 int main() {
+    /* Symbols */
+    auto &symbols = Tokenizer::Symbols();
+    ExpectTrue(symbols.Intern("+") == static_cast<Symbol>(Tokenizer::Builtins::ADD),
+               "builtins are interned in Builtins order");
+    ExpectTrue(symbols.Intern("list?") == static_cast<Symbol>(Tokenizer::Builtins::IS_LIST),
+               "list? resolves to IS_LIST");
+    ExpectTrue(symbols.Intern("counter") == symbols.Intern("counter"),
+               "names are interned once");
+    ExpectTrue(!Tokenizer::IsBuiltin(symbols.Intern("counter")), "names are not builtins");
+    ExpectTrue(symbols.Name(symbols.Intern("counter")) == "counter", "symbols keep their names");
+
+    /* Tokenizer */
+    ExpectSameTokens("  (+ 1\t2)\n ");
+    ExpectSameTokens("'(a . b) 'x");
+    ExpectSameTokens("+14 -14 9223372036854775807 -9223372036854775808 9223372036854775808 1a");
+    /* Tokens straddling 64 byte blocks and tabs */
+    ExpectSameTokens(std::string(61, ' ') + "(abc\t(+ 12345 67)\f" + std::string(60, '\n') + "x')");
+    int64_t number = 0;
+    ExpectTrue(Tokenizer::ParseNumber("-9223372036854775808", &number) && number == INT64_MIN,
+               "INT64_MIN is parsed");
+    ExpectTrue(!Tokenizer::ParseNumber("9223372036854775808", &number), "overflow is rejected");
+    ExpectTrue(!Tokenizer::ParseNumber("-", &number), "a lone sign is not a number");
+    ExpectEq("+14", "14");
+    ExpectEq("(+ 1 2) ", "3");
+
+    /* Parser nodes come from one arena chunk */
+    AST ast{std::string_view("(+ 1 (* 2 3) (- 4 5))")};
+    while (ast.InsertLexema()) {}
+    ExpectTrue(ast.NodeCount() == 11, "every token but the closing parens gets one node");
+    ExpectTrue(ast.NodeChunkCount() == 1, "small expressions fit one chunk");
+
+    /* Values are one word, immediates need no allocation */
+    ExpectTrue(sizeof(Value) == 8, "values fit one machine word");
+    ExpectTrue(Value::MakeFixnum(Value::kFixnumMin).GetFixnum() == Value::kFixnumMin,
+               "fixnums keep their sign");
+    ExpectTrue(!Value::FitsFixnum(INT64_MAX), "INT64_MAX does not fit a fixnum");
+    ExpectTrue(Value::MakeBool(false).IsFalse() && !Value::MakeFixnum(0).IsFalse(),
+               "only #f is false");
+    ExpectTrue(Value::MakeSymbol(7).GetSymbol() == 7 && !Value::MakeSymbol(7).IsFixnum(),
+               "symbols are immediates");
+    ExpectTrue(Value::MakeBool(true) != Value::MakeFixnum(1), "#t is not 1");
+    for (double number : {0.0, -0.0, 1.5, -2.25, 1e-30, 3e38, 0.1}) {
+        auto flonum = Value::MakeFlonum(number);
+        ExpectTrue(Value::FitsFlonum(number) && flonum.IsFlonum() && !flonum.IsFixnum() &&
+                   std::signbit(flonum.GetFlonum()) == std::signbit(number) &&
+                   flonum.GetFlonum() == number, "common doubles are immediate flonums");
+    }
+    ExpectTrue(!Value::FitsFlonum(1e300) && !Value::FitsFlonum(1e-320) &&
+               !Value::FitsFlonum(HUGE_VAL), "extreme doubles are boxed");
+
+    /* Any keeps small payloads inline and checks its casts */
+    Any small = int64_t(42);
+    ExpectTrue(small.IsInline(), "small trivially copyable payloads are inline");
+    Any moved = std::move(small);
+    ExpectTrue(small.Empty() && moved.TakeValue<int64_t>() == 42, "moving leaves the source empty");
+    Any text = std::string("heap");
+    Any copy = text;
+    ExpectTrue(!text.IsInline() && copy.TakeValue<std::string>() == "heap",
+               "other payloads are copied through the heap");
+    copy = std::move(moved);
+    ExpectTrue(copy.TryTakeValue<std::string>() == nullptr && *copy.TryTakeValue<int64_t>() == 42,
+               "checked casts return nullptr on a mismatch");
+    bool thrown = false;
+    try {
+        copy.TakeValue<bool>();
+    } catch (std::runtime_error&) {
+        thrown = true;
+    }
+    ExpectTrue(thrown, "a wrong cast throws");
+    text.Swap(copy);
+    ExpectTrue(text.TakeValue<int64_t>() == 42 && copy.TakeValue<std::string>() == "heap",
+               "swap exchanges inline and heap payloads");
+
+    /* Identical expressions are compiled once */
+    ChunkCache cache(2);
+    ExpectTrue(Evaluate("(+ 1 (* 2 3))", cache) == "7" && Evaluate("(+ 1 (* 2 3))", cache) == "7",
+               "cached programs give the same result");
+    ExpectTrue(Evaluate("(if #f 1 2)", cache) == "2", "different sources get different programs");
+    ExpectTrue(cache.Hits() == 1 && cache.Misses() == 2, "repeated sources hit the cache");
+    Evaluate("(- 5)", cache);
+    ExpectTrue(cache.Size() == 2, "the cache keeps at most its capacity");
+    Evaluate("(+ 1 (* 2 3))", cache);
+    ExpectTrue(cache.Misses() == 4, "the least recently used program is dropped");
+
+    /* Constant subtrees are folded before anything runs, errors are left to run time */
+    AST constant{std::string_view("(+ 800 (- 100 230 (* 21 31 (/ 10 (- 3 2) 10))))")};
+    while (constant.InsertLexema()) {}
+    constant.Analyze();
+    ExpectTrue(constant.Fold() == 5, "every call with constant operands is folded");
+    ExpectTrue(Compiler::CompileExpression("(+ 800 (- 100 230 (* 21 31 (/ 10 (- 3 2) 10))))")
+                       .code.size() == 2, "a constant expression compiles to its value");
+    ExpectTrue(Compiler::CompileExpression("(if (and #t (< 3 2)) x (max 1 2))").code.size() == 2,
+               "constant conditions keep only the branch taken");
+    ExpectTrue(Compiler::CompileExpression("(* 2 3 x (+ 1 2 y))").code.size() == 7,
+               "constant operands of sums and products are combined");
+    ExpectEq("(if (> 3 2) (+ 1 2) (- 1 2))", "3");
+    ExpectEq("(- 5)", "5");
+    ExpectEq("(not (boolean? 2))", "#t");
+
+    /* Long lists are released without recursion */
+    std::string long_sum = "(+";
+    for (size_t i = 0; i < 100000; ++i) {
+        long_sum += " 1";
+    }
+    ExpectEq(long_sum + ")", "100000");
+
     /* Output tests */
     ExpectEq("#f", "#f");
     ExpectEq("#t", "#t");
@@ -66,6 +301,114 @@ int main() {
     ExpectEq("(<= 1 1 3)", "#t");
     ExpectEq("(<= 1 0 3)", "#f");
 
+    /* Fixnums that overflow become bignums, and come back once they fit */
+    ExpectEq("(+ 4611686018427387903 1)", "4611686018427387904");
+    ExpectEq("4611686018427387904", "4611686018427387904");
+    ExpectEq("(- -4611686018427387905 1)", "-4611686018427387906");
+    ExpectEq("(+ 9223372036854775807 1)", "9223372036854775808");
+    ExpectEq("9223372036854775808", "9223372036854775808");
+    ExpectEq("-9223372036854775809", "-9223372036854775809");
+    ExpectEq("(+ 1 10000000000000000000000000)", "10000000000000000000000001");
+    ExpectEq("(- 10000000000000000000000000 9999999999999999999999999)", "1");
+    ExpectEq("'(1 99999999999999999999999)", "(1 99999999999999999999999)");
+    ExpectEq("(- -4611686018427387904 1)", "-4611686018427387905");
+    ExpectEq("(- (+ 4611686018427387903 1) 1)", "4611686018427387903");
+    ExpectEq("(abs -4611686018427387904)", "4611686018427387904");
+    ExpectEq("(/ -4611686018427387904 -1)", "4611686018427387904");
+    ExpectEq("(* 4611686018427387903 4611686018427387903)", "21267647932558653957237540927630737409");
+    ExpectEq("(/ (* -4611686018427387904 -4611686018427387904) 4611686018427387903)",
+             "21267647932558653966460912964485513216/4611686018427387903");
+    ExpectEq("(/ (* -4611686018427387904 -4611686018427387904) -7)",
+             "-21267647932558653966460912964485513216/7");
+    ExpectEq("(/ (* -4611686018427387904 4611686018427387903) (* 4611686018427387903 4611686018427387903))",
+             "-4611686018427387904/4611686018427387903");
+    ExpectEq("(> (* -4611686018427387904 -2) 4611686018427387903 (- -4611686018427387904 1))", "#t");
+    ExpectEq("(= (+ 4611686018427387903 1) (+ 4611686018427387902 2))", "#t");
+    ExpectEq("(max 1 (+ 4611686018427387903 1) 2)", "4611686018427387904");
+    ExpectEq("(number? (+ 4611686018427387903 1))", "#t");
+    ExpectEq("(equal? (+ 4611686018427387903 1) (+ 4611686018427387902 2))", "#t");
+
+    /* Exact fractions in lowest terms, flonums once anything is inexact */
+    ExpectEq("(/ 1 2)", "1/2");
+    ExpectEq("(/ 6 -4)", "-3/2");
+    ExpectEq("(/ 6 4 3)", "1/2");
+    ExpectEq("-3/6", "-1/2");
+    ExpectEq("4/2", "2");
+    ExpectEq("(+ 1/2 1/3)", "5/6");
+    ExpectEq("(- 1/2 1/2)", "0");
+    ExpectEq("(* 2/3 3/2)", "1");
+    ExpectEq("(/ 1/2 1/4)", "2");
+    ExpectEq("(abs -1/2)", "1/2");
+    ExpectEq("(< 1/3 1/2 2/3)", "#t");
+    ExpectEq("(equal? 1/2 (/ 2 4))", "#t");
+    ExpectEq("(+ 18446744073709551615/2 1/2)", "9223372036854775808");
+    ExpectEq("100000000000000000000/30000000000000000000000", "1/300");
+    ExpectEq("1.5", "1.5");
+    ExpectEq("-2.", "-2.0");
+    ExpectEq(".25", "0.25");
+    ExpectEq("1e3", "1000.0");
+    ExpectEq("1e300", "1e+300");
+    ExpectEq("1e-320", "1e-320");
+    ExpectEq("(+ 0.1 0.2)", "0.30000000000000004");
+    ExpectEq("(+ 1 0.5)", "1.5");
+    ExpectEq("(* 1/2 0.5)", "0.25");
+    ExpectEq("(- 1.5 (* 4611686018427387903 2))", "-9.223372036854776e+18");
+    ExpectEq("(/ 3 2.)", "1.5");
+    ExpectEq("(* 1e200 1e200)", "+inf.0");
+    ExpectEq("(/ 1.0 0)", "+inf.0");
+    ExpectEq("(- (/ 0. 0.))", "+nan.0");
+    ExpectEq("(abs -1.5)", "1.5");
+    ExpectEq("(max 1 2.5 2)", "2.5");
+    ExpectEq("(min 1 2.5)", "1.0");
+    ExpectEq("(= 1/2 0.5)", "#t");
+    ExpectEq("(= 1 1.0)", "#t");
+    ExpectEq("(< 1/3 0.34 1/2)", "#t");
+    ExpectEq("(< +nan.0 1)", "#f");
+    ExpectEq("(>= +nan.0 1)", "#f");
+    ExpectEq("(= +nan.0 +nan.0)", "#f");
+    ExpectEq("(number? 1.5)", "#t");
+    ExpectEq("(number? 1/2)", "#t");
+    ExpectEq("(equal? 1.0 1)", "#f");
+    ExpectEq("(equal? (* 1e200 1e200) +inf.0)", "#t");
+    ExpectEq("(eq? 1.5 1.5)", "#t");
+
+    /* Comparisons check every argument, whichever pair decides */
+    for (auto backend : {Evaluate::Backend::TREE, Evaluate::Backend::VM,
+                         Evaluate::Backend::CLOSURE_TREE}) {
+        for (auto expr : {"(> 1 2 #t)", "(< 1 2 #t)", "(= 1 2 'x)", "(>= +nan.0 1 '())", "(<= #t)"}) {
+            bool thrown = false;
+            try {
+                Evaluate(expr, backend);
+            } catch (const std::runtime_error &) {
+                thrown = true;
+            }
+            ExpectTrue(thrown, std::string(expr) + " must raise an error");
+        }
+    }
+
+    /* The tree walker has no variables, closures or threads, and says so */
+    for (auto expr : {"(define x 1)", "(lambda (x) x)", "x", "(1 2 3)", "((lambda () 1))",
+                      "(pmap (lambda (x) x) '(1))", "(spawn (lambda () 1))", "(channel 1)"}) {
+        std::string res;
+        try {
+            res = Evaluate(expr, Evaluate::Backend::TREE);
+        } catch (const std::runtime_error &error) {
+            res = error.what();
+        }
+        ExpectTrue(res.find("ERROR: ") == 0, std::string(expr) + " must fail on the tree walker");
+    }
+
+    /* Boxed literals belong to the compiled code, values made of them outlive it */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        Interpreter session(1, backend);
+        ExpectNoError(session, "(define big 100000000000000000000) (define third 1/3)");
+        ExpectNoError(session, "(define (quoted) '(1/3 100000000000000000000))");
+        ExpectEq(session, "(+ 1 2)", "3");
+        session.Collect();
+        ExpectEq(session, "(list big third (quoted))", "(100000000000000000000 1/3 (1/3 100000000000000000000))");
+        ExpectEq(session, "(equal? (quoted) (quoted))", "#t");
+    }
+
     
     /* Predicates */
 
@@ -92,6 +435,9 @@ int main() {
 
     /* If */
     ExpectEq("(if #t 1 2)", "1");
+    ExpectEq("(if #f 1 2)", "2");
+    ExpectEq("(if (> 3 2) (+ 1 2) (- 1 2))", "3");
+    ExpectEq("(if (and #t (< 3 2)) 1 (if #t 5 6))", "5");
 
     ExpectEq("(not 2)", "#f");
     ExpectEq("(not #t)", "#f");
@@ -108,6 +454,602 @@ int main() {
     ExpectEq("(or #f #f)", "#f");
     ExpectEq("(or (boolean? #t) (boolean? 1))", "#t");
 
+    /* Evaluation stops at the first argument deciding the result */
+    ExpectEq("(and #f (car 1))", "#f");
+    ExpectEq("(or 1 (car 1))", "#t");
+
+    /* Lambdas, every session runs on both backends */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        Interpreter session(1024, backend);
+        ExpectEq(session, "((lambda (x) (+ 1 x)) 5)", "6");
+
+        ExpectNoError(session, "(define test (lambda (x) (set! x (* x 2)) (+ 1 x)))");
+        ExpectEq(session, "(test 20)", "41");
+
+        ExpectNoError(session, "(define slow-add (lambda (x y) (if (= x 0) y (slow-add (- x 1) (+ y 1)))))");
+        ExpectEq(session, "(slow-add 3 3)", "6");
+        ExpectEq(session, "(slow-add 100 100)", "200");
+
+        ExpectNoError(session, "(define x 1)");
+
+        ExpectNoError(session, R"(
+            (define range
+              (lambda (x)
+                (lambda ()
+                  (set! x (+ x 1))
+                  x)))
+                        )");
+
+        ExpectNoError(session, "(define my-range (range 10))");
+        ExpectEq(session, "(my-range)", "11");
+        ExpectEq(session, "(my-range)", "12");
+        ExpectEq(session, "(my-range)", "13");
+
+        ExpectEq(session, "x", "1");
+
+        ExpectSyntaxError(session, "(lambda)");
+        ExpectSyntaxError(session, "(lambda x)");
+        ExpectSyntaxError(session, "(lambda (x))");
+        ExpectSyntaxError(session, "(lambda (x x) x)");
+
+        ExpectNoError(session, "(define (inc x) (+ x 1))");
+        ExpectEq(session, "(inc -1)", "0");
+
+        ExpectNoError(session, "(define (add x y) (+ x y 1))");
+        ExpectEq(session, "(add -10 10)", "1");
+
+        ExpectNoError(session, "(define (zero) 0)");
+        ExpectEq(session, "(zero)", "0");
+
+        ExpectRuntimeError(session, "(inc)");
+        ExpectRuntimeError(session, "(1 2 3)");
+        ExpectRuntimeError(session, "()");
+        ExpectEq(session, "inc", "#<procedure>");
+
+        /* A library is loaded once, later calls see its definitions */
+        ExpectEq(session, "(define (square x) (* x x)) (define (cube x) (* x (square x))) (cube 3)", "27");
+        ExpectEq(session, "(cube (square 2))", "64");
+
+        /* Calls in tail position run in constant space */
+        ExpectNoError(session, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1))))");
+        ExpectEq(session, "(loop 10 0)", "10");
+        auto heap_size = session.HeapSize();
+        ExpectEq(session, "(loop 1000000 0)", "1000000");
+        ExpectTrue(session.HeapSize() <= heap_size + 1, "a tail recursive loop reuses its environment");
+
+        ExpectNoError(session, "(define (even? n) (if (= n 0) #t (odd? (- n 1))))");
+        ExpectNoError(session, "(define (odd? n) (if (= n 0) #f (even? (- n 1))))");
+        ExpectEq(session, "(even? 100001)", "#f");
+
+        /* Closures keep the values of a frame a tail call reuses */
+        ExpectNoError(session, "(define (adders n f) (if (= n 0) f (adders (- n 1) (lambda (x) (+ x n)))))");
+        ExpectEq(session, "((adders 3 (lambda (x) x)) 10)", "11");
+
+        /* Lexical scope: internal defines, shadowing, captures through
+         * several lambdas and assignments every closure sees */
+        ExpectEq(session, "(define (f x) (define y (* x 2)) (define (g) (+ x y)) (g)) (f 5)", "15");
+        ExpectNameError(session, "y");
+        ExpectEq(session, "(define (shadow x) ((lambda (x) (* x 10)) (+ x 1))) (shadow 1)", "20");
+        ExpectEq(session, "(define (curry a) (lambda (b) (lambda (c) (+ a b c)))) (((curry 1) 2) 3)",
+                 "6");
+        ExpectNoError(session, R"(
+            (define (account balance)
+              (define (deposit n) (set! balance (+ balance n)) balance)
+              (define (peek) balance)
+              (lambda (op n) (if (= op 0) (deposit n) (peek)))))");
+        ExpectNoError(session, "(define acc (account 100))");
+        ExpectEq(session, "(acc 0 10) (acc 0 5) (acc 1 0)", "115");
+        ExpectEq(session, "(define (later) (define (a) (b)) (define (b) 7) (a)) (later)", "7");
+        ExpectEq(session, "(define (deep x) (lambda () (lambda () (set! x (+ x 1)) x))) "
+                          "(define d (deep 0)) ((d)) ((d))", "2");
+
+        /* Folding leaves errors and side effects where they were */
+        ExpectRuntimeError(session, "(/ 1 0)");
+        ExpectRuntimeError(session, "(+ 1 #t)");
+        ExpectRuntimeError(session, "(if (= 1 2) 3)");
+        ExpectEq(session, "(define (scale x) (+ 1 x 2 (* 2 3 x))) (scale 1)", "10");
+        ExpectRuntimeError(session, "(scale #t)");
+        ExpectEq(session, "(define folded 0) (if (< 1 2) (set! folded 5) (set! folded 6)) folded",
+                 "5");
+
+        /* Bignum products large enough to split, checked against (a+b)^2 */
+        ExpectNoError(session, "(define (fact n) (if (= n 0) 1 (* n (fact (- n 1)))))");
+        ExpectEq(session, "(fact 25)", "15511210043330985984000000");
+        ExpectEq(session, "(/ (fact 300) (fact 299))", "300");
+        ExpectNoError(session, "(define a (fact 400)) (define b (- (fact 401) 12345))");
+        ExpectEq(session, "(= (* (+ a b) (+ a b)) (+ (* a a) (* 2 a b) (* b b)))", "#t");
+        ExpectEq(session, "(- (/ (* a b) b) a)", "0");
+        ExpectRuntimeError(session, "(/ a 0)");
+
+        /* Flonum loops stay unboxed, division by an exact zero still throws */
+        ExpectNoError(session, "(define (halves n acc) (if (= n 0) acc (halves (- n 1) (+ acc 0.5))))");
+        heap_size = session.HeapSize();
+        ExpectEq(session, "(halves 100000 0.)", "50000.0");
+        ExpectTrue(session.HeapSize() <= heap_size + 1, "immediate flonums need no allocation");
+        ExpectEq(session, "(halves 3 1/4)", "1.75");
+        ExpectRuntimeError(session, "(/ 1/2 0)");
+        ExpectRuntimeError(session, "(+ 1.5 #t)");
+        ExpectRuntimeError(session, "(< 1/2 #f)");
+
+        /* Global references keep their binding cached until it changes */
+        std::string sum_twice =
+                "(define (sum-twice n acc) (if (= n 0) acc (sum-twice (- n 1) (+ acc (twice n)))))";
+        ExpectNoError(session, "(define (twice x) (* 2 x))");
+        ExpectNoError(session, sum_twice);
+        ExpectEq(session, "(sum-twice 100 0)", "10100");
+        auto sites = session.GlobalSites(sum_twice);
+        ExpectTrue(sites.size() == 2, "one site per global reference");
+        for (auto site : sites) {
+            ExpectTrue(site->misses == 1 && site->hits == 99, "global sites hit once filled");
+        }
+        ExpectNoError(session, "(define (twice x) (* 3 x))");
+        ExpectEq(session, "(sum-twice 10 0)", "165");
+        for (auto site : session.GlobalSites(sum_twice)) {
+            size_t misses = Tokenizer::Symbols().Name(site->symbol) == "twice" ? 2 : 1;
+            ExpectTrue(site->misses == misses, "redefining a global invalidates its sites");
+        }
+        ExpectTrue(session.GlobalSites("(undefined-source)").empty(), "no sites for unknown sources");
+        ExpectNoError(session, "(define total 0)");
+        ExpectEq(session, "(set! total (+ total 1)) (set! total (+ total 1)) total", "2");
+
+        /* Collecting at every safepoint keeps whatever is still reachable */
+        Interpreter collected(1024, backend);
+        collected.SetCollectionThreshold(0, 0);
+        ExpectNoError(collected, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+        ExpectEq(collected, "(fib 15)", "610");
+        ExpectNoError(collected, "(define (counter n) (lambda () (set! n (+ n 1)) n))");
+        ExpectNoError(collected, "(define next (counter 10))");
+        ExpectEq(collected, "((lambda (a b) (+ a b)) (next) (next))", "23");
+        ExpectEq(collected, "(define (f) (set! f 0) ((counter 1))) (f)", "2");
+        ExpectNoError(collected, "(define (churn n) (counter n) (if (= n 0) 0 (churn (- n 1))))");
+        ExpectEq(collected, "(churn 1000)", "0");
+        ExpectTrue(collected.GetHeapStats().collections > 1000, "collections ran at safepoints");
+        collected.Collect();
+        /* The globals, the fib, counter, next and churn closures and the box
+         * next shares with the call that made it */
+        ExpectTrue(collected.HeapSize() == 6, "only reachable objects survive");
+        ExpectTrue(collected.GetHeapStats().freed_objects > 1000, "garbage closures are freed");
+
+        Interpreter lists(1024, backend);
+        ExpectEq(lists, "(cons 1 2)", "(1 . 2)");
+        ExpectEq(lists, "(list 1 2 3)", "(1 2 3)");
+        ExpectEq(lists, "(cons 1 (cons 2 3))", "(1 2 . 3)");
+        ExpectEq(lists, "(list)", "()");
+        ExpectEq(lists, "(car (list 1 2))", "1");
+        ExpectEq(lists, "(cdr (list 1 2))", "(2)");
+        ExpectEq(lists, "(null? (cdr (list 1)))", "#t");
+        ExpectEq(lists, "(pair? (cons 1 2))", "#t");
+        ExpectEq(lists, "(pair? (list))", "#f");
+        ExpectRuntimeError(lists, "(car 1)");
+        ExpectRuntimeError(lists, "(cons 1)");
+
+        /* A nursery of four cells, so every few conses move whatever survives */
+        lists.SetNurserySize(64);
+        ExpectNoError(lists, "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))");
+        ExpectNoError(lists, "(define (sum l) (if (null? l) 0 (+ (car l) (sum (cdr l)))))");
+        ExpectNoError(lists, "(define xs (build 100 (list)))");
+        ExpectEq(lists, "(sum xs)", "5050");
+        ExpectNoError(lists, "(define cell (cons 0 0))");
+        ExpectNoError(lists, "(build 100 (list))");
+        ExpectEq(lists, "(set-car! cell (list 1 2)) (set-cdr! cell (cons 3 4)) (build 100 (list)) cell",
+                 "((1 2) 3 . 4)");
+        ExpectTrue(lists.GetHeapStats().minor_collections > 50, "minor collections ran");
+        ExpectTrue(lists.GetHeapStats().promoted_cells >= 100, "survivors are promoted");
+
+        /* Old cells are marked and swept along with the objects */
+        lists.SetCollectionThreshold(0, 0);
+        ExpectEq(lists, "(build 100 (list)) (sum xs)", "5050");
+        ExpectEq(lists, "(set-cdr! (cdr cell) (build 3 (list))) cell", "((1 2) 3 1 2 3)");
+        lists.Collect();
+        /* The hundred of xs and the seven of cell */
+        ExpectTrue(lists.GetHeapStats().cells == 107, "only reachable cells survive");
+        ExpectTrue(lists.GetHeapStats().freed_cells > 100, "garbage cells are freed");
+    }
+
+    /* Batches run independent sources on a pool, results come in order */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        std::vector<std::string> sources;
+        for (int i = 0; i < 500; ++i) {
+            sources.push_back("(define (square x) (* x x)) (square " + std::to_string(i) + ")");
+        }
+        sources.push_back("(square 3)");
+        sources.push_back("(/ 1 0)");
+        sources.push_back("(+ 1");
+        sources.push_back("(define (loop n) (if (= n 0) 'done (loop (- n 1)))) (loop 100000)");
+
+        BatchEvaluator batch(4, backend);
+        auto results = batch.Evaluate(sources);
+        ExpectTrue(results.size() == sources.size(), "one result per source");
+        bool ordered = true;
+        for (int i = 0; i < 500; ++i) {
+            ordered &= results[i].Ok() && results[i].value == std::to_string(i * i);
+        }
+        ExpectTrue(ordered, "batch results follow the sources");
+        ExpectTrue(!results[500].Ok() && results[500].value.empty(),
+                   "sources do not see the definitions of others");
+        ExpectTrue(results[501].error == "ERROR: Division by zero\n", "errors are kept per source");
+        ExpectTrue(!results[502].Ok(), "syntax errors are kept per source");
+        ExpectTrue(results[503].Ok() && results[503].value == "done", "a failed source leaves the worker usable");
+        ExpectTrue(batch.Evaluate(sources).size() == sources.size(), "an evaluator runs many batches");
+    }
+    ExpectTrue(EvaluateBatch({"(+ 1 2)", "(car 1)"}, 2)[0].value == "3", "one off batches");
+
+    /* Data parallel builtins, long lists are split over the shared pool */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        Interpreter session(1024, backend);
+        ExpectNoError(session, "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons (- n 1) acc))))");
+        ExpectNoError(session, "(define (sum xs acc) (if (null? xs) acc (sum (cdr xs) (+ acc (car xs)))))");
+        ExpectNoError(session, "(define xs (iota 1000 '()))");
+
+        ExpectEq(session, "(pmap (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)");
+        ExpectEq(session, "(pmap (lambda (x) x) '())", "()");
+        ExpectEq(session, "(list-ref (pmap (lambda (x) (* x x)) xs) 999)", "998001");
+        ExpectEq(session, "(sum (pmap (lambda (x) (* x x)) xs) 0)", "332833500");
+        ExpectEq(session, "(preduce (lambda (a b) (+ a b)) 0 xs)", "499500");
+        ExpectEq(session, "(preduce (lambda (a b) (+ a b)) 0 '(1 2))", "3");
+        ExpectEq(session, "(preduce (lambda (a b) (+ a b)) 7 '())", "7");
+        ExpectNoError(session, "(pfor-each (lambda (x) (* x x)) xs)");
+
+        /* Workers allocate cells, bignums and closures the caller keeps */
+        ExpectNoError(session, "(define pairs (pmap (lambda (x) (list x (* x 4611686018427387903))) xs))");
+        ExpectNoError(session, "(iota 100000 '())");
+        ExpectEq(session, "(list-ref pairs 500)", "(500 2305843009213693951500)");
+        ExpectEq(session, "(sum (pmap (lambda (f) (f)) (pmap (lambda (x) (lambda () x)) xs)) 0)", "499500");
+
+        /* Nested calls run sequentially on the worker */
+        ExpectNoError(session, "(define ys (iota 100 '()))");
+        ExpectEq(session, "(sum (pmap (lambda (x) (preduce (lambda (a b) (+ a b)) x ys)) ys) 0)", "499950");
+
+        ExpectNoError(session, "(define counter 0)");
+        ExpectRuntimeError(session, "(pfor-each (lambda (x) (set! counter x)) xs)");
+        ExpectRuntimeError(session, "(pmap (lambda (x) (car x)) xs)");
+        ExpectRuntimeError(session, "(pmap (lambda (x y) x) xs)");
+        ExpectRuntimeError(session, "(pmap (lambda (x) x) '(1 . 2))");
+        ExpectRuntimeError(session, "(preduce 1 0 xs)");
+        ExpectSyntaxError(session, "(pmap (lambda (x) x))");
+        ExpectEq(session, "(set! counter 5) counter", "5");
+        ExpectEq(session, "(preduce (lambda (a b) (+ a b)) 0 xs)", "499500");
+
+        /* Builtins only head lists, lambdas pass them around */
+        ExpectEq(session, "(preduce + 0 xs)",
+                 "ERROR: Builtin + used as a value, wrap it in a lambda at line 1, column 10\n");
+        ExpectEq(session, "(pmap car\n  (list xs))",
+                 "ERROR: Builtin car used as a value, wrap it in a lambda at line 1, column 7\n");
+        ExpectSyntaxError(session, "(define first car)");
+        ExpectSyntaxError(session, "abs");
+        ExpectEq(session, "(car (pmap (lambda (x) (abs x)) '(-3)))", "3");
+        ExpectEq(session, "(pmap (lambda (x) (car x)) '((1) (2)))", "(1 2)");
+
+        /* Sections stop at what they may allocate uncollected, the rest runs collecting */
+        session.SetNurserySize(1 << 16);
+        session.SetCollectionThreshold(1 << 16, 2.0);
+        auto collections = session.GetHeapStats().collections;
+        ExpectEq(session, "(sum (pmap (lambda (x) (list-ref (iota 2000 '()) x)) ys) 0)", "4950");
+        ExpectEq(session, "(preduce (lambda (a b) (+ a (list-ref (iota 2000 '()) b))) 0 ys)", "4950");
+        ExpectTrue(session.GetHeapStats().collections > collections + 2, "full sections are collected");
+    }
+
+    /* Green threads run on the vm, switching when a channel blocks */
+    {
+        Interpreter session;
+        ExpectNoError(session, "(define ch (channel 1))");
+        ExpectEq(session, "ch", "#<channel>");
+        ExpectEq(session, "(spawn (lambda () (send ch 42))) (recv ch)", "42");
+        ExpectTrue(session.GreenThreads() == 0, "finished green threads are dropped");
+
+        /* A producer blocks on the full channel until the consumer catches up */
+        ExpectNoError(session, "(define (produce ch i n) (if (> i n) 'done ((lambda () (send ch i) (produce ch (+ i 1) n)))))");
+        ExpectNoError(session, "(define (consume ch n acc) (if (= n 0) acc (consume ch (- n 1) (+ acc (recv ch)))))");
+        ExpectEq(session, "(define small (channel 2)) (spawn (lambda () (produce small 1 100))) (consume small 100 0)", "5050");
+
+        /* Many threads parked at once, and collections while they are */
+        ExpectNoError(session, "(define out (channel 1))");
+        ExpectNoError(session, "(define (spawn-all i n) (if (= i n) 'done ((lambda () (spawn (lambda () (send out (list i i)))) (spawn-all (+ i 1) n)))))");
+        ExpectNoError(session, "(define (collect n acc) (if (= n 0) acc (collect (- n 1) (+ acc (car (recv out))))))");
+        ExpectEq(session, "(spawn-all 0 2000) (collect 1000 0)", "499500");
+        ExpectTrue(session.GreenThreads() == 1000, "blocked green threads wait for the next run");
+        session.Collect();
+        ExpectEq(session, "(collect 1000 0)", "1499500");
+        ExpectTrue(session.GreenThreads() == 0, "every sender finished");
+
+        ExpectRuntimeError(session, "(recv (channel 1))");
+        ExpectRuntimeError(session, "(spawn (lambda () (car 1))) (recv (channel 1))");
+        ExpectTrue(session.GreenThreads() == 0, "a thread that failed is dropped");
+        ExpectEq(session, "(spawn (lambda () (send ch 7))) 'later", "later");
+        ExpectEq(session, "(recv ch)", "7");
+        ExpectRuntimeError(session, "(channel 0)");
+        ExpectRuntimeError(session, "(send 1 2)");
+        ExpectRuntimeError(session, "(spawn (lambda (x) x))");
+        ExpectNoError(session, "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons (- n 1) acc))))");
+        ExpectRuntimeError(session, "(pmap (lambda (x) (spawn (lambda () x))) (iota 100 '()))");
+        ExpectRuntimeError(session, "(pfor-each (lambda (x) (send ch x)) (iota 100 '()))");
+        ExpectTrue(session.GreenThreads() == 0, "pmap workers spawn nothing");
+        session.Reset();
+        ExpectEq(session, "(define ch (channel 1)) (spawn (lambda () (send ch 1))) (spawn (lambda () (send ch 2))) 'go", "go");
+        session.Reset();
+        ExpectTrue(session.GreenThreads() == 0, "a reset drops the green threads");
+    }
+    {
+        Interpreter session(1024, Interpreter::Backend::CLOSURE_TREE);
+        ExpectEq(session, "(define ch (channel 2)) (send ch 1) (send ch 2) (+ (recv ch) (recv ch))", "3");
+        ExpectRuntimeError(session, "(recv ch)");
+        ExpectRuntimeError(session, "(spawn (lambda () 1))");
+
+        /* Calls nest on the C++ stack, as deep as it has room for */
+        ExpectNoError(session, "(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))");
+        ExpectEq(session, "(car (build 1000))", "1000");
+        ExpectEq(session, "(build 1000000)", "ERROR: Calls nested too deep for the stack\n");
+        ExpectRuntimeError(session, "(pmap build '(1000000 1))");
+        ExpectEq(session, "(car (build 1000))", "1000");
+    }
+
+    /* Limits stop runaway evaluations and leave the session usable */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        Interpreter session(1024, backend);
+        ExpectNoError(session, "(define (spin n) (spin (+ n 1)))");
+        ExpectNoError(session, "(define (deep n) (if (= n 0) 0 (+ 1 (deep (- n 1)))))");
+        ExpectNoError(session, "(define (grow n acc) (if (= n 0) acc (grow (- n 1) (cons n acc))))");
+        ExpectNoError(session, "(define (churn n) (cons n n) (if (= n 0) 'done (churn (- n 1))))");
+        ExpectNoError(session, "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons (- n 1) acc))))");
+        ExpectNoError(session, "(define (count n) (if (= n 0) 'done (count (- n 1))))");
+
+        Limits steps;
+        steps.steps = 100000;
+        session.SetLimits(steps);
+        ExpectBudgetError(session, "(spin 0)");
+        ExpectEq(session, "(spin 0)", "ERROR: Budget exceeded, more than 100000 steps\n");
+        ExpectEq(session, "(deep 1000)", "1000");
+        ExpectEq(session, "(deep 1000) (deep 1000)", "1000");
+        ExpectBudgetError(session, "(pmap spin (iota 100 '()))");
+        /* The workers of pmap share the steps left */
+        ExpectEq(session, "(count 9000)", "done");
+        ExpectBudgetError(session, "(pmap (lambda (x) (count 9000)) (iota 16 '()))");
+        if (backend == Interpreter::Backend::VM) {
+            ExpectBudgetError(session, "(define ch (channel 1)) (spawn (lambda () (spin 0))) (recv ch)");
+        }
+        ExpectEq(session, "(+ 1 2)", "3");
+
+        Limits depth;
+        depth.depth = 100;
+        session.SetLimits(depth);
+        ExpectEq(session, "(deep 90)", "90");
+        ExpectBudgetError(session, "(deep 200)");
+        ExpectEq(session, "(define (count n) (if (= n 0) 'done (count (- n 1)))) (count 100000)", "done");
+        /* Code deeper than the reader allows never reaches the passes before evaluation */
+        ExpectSyntaxError(session, std::string(50000, '(') + std::string(50000, ')'));
+        ExpectEq(session, "(car (list (list (list (list 4)))))", "(((4)))");
+
+        Limits heap;
+        heap.heap_bytes = 1 << 20;
+        session.SetLimits(heap);
+        ExpectEq(session, "(car (grow 1000 '()))", "1");
+        ExpectEq(session, "(churn 200000)", "done");
+        ExpectBudgetError(session, "(grow 200000 '())");
+        ExpectBudgetError(session, "(pmap (lambda (x) (car (grow 400000 '()))) (iota 16 '()))");
+        ExpectEq(session, "(car (grow 1000 '()))", "1");
+        /* Bignums and channels count with their storage */
+        ExpectEq(session, "(define ch (channel 1000000)) (define (fill n) (if (= n 0) 'full ((lambda () (send ch n) (fill (- n 1)))))) (fill 20000)", "full");
+        ExpectBudgetError(session, "(define ch (channel 1000000)) (fill 200000)");
+        ExpectNoError(session, "(define ch 0)");
+        heap.heap_bytes = 1 << 17;
+        session.SetLimits(heap);
+        ExpectNoError(session, "(define (sq x n) (if (= n 0) x (sq (* x x) (- n 1))))");
+        ExpectEq(session, "(> (sq 3 10) 0)", "#t");
+        ExpectBudgetError(session, "(sq 3 24)");
+
+        session.SetLimits(Limits());
+        ExpectEq(session, "(deep 1000)", "1000");
+        ExpectEq(session, "(car (grow 200000 '()))", "1");
+    }
+
+    /* Values nest as deep as the heap lets them */
+    for (auto backend : {Interpreter::Backend::VM, Interpreter::Backend::CLOSURE_TREE}) {
+        Interpreter session(1024, backend);
+        ExpectNoError(session, "(define (wrap x n) (if (= n 0) x (wrap (list x) (- n 1))))");
+        ExpectNoError(session, "(define deep (wrap 1 100000))");
+        ExpectEq(session, "(equal? deep (wrap 1 100000))", "#t");
+        ExpectEq(session, "(equal? deep (wrap 2 100000))", "#f");
+        ExpectEq(session, "(equal? (wrap '(1 . 2) 3) '((((1 . 2)))))", "#t");
+        ExpectTrue(session.Eval("deep").size() == 200001, "deep values show");
+
+        /* Cycles show and compare in bounded time */
+        ExpectNoError(session, "(define x (list 1 2)) (set-cdr! (cdr x) x)");
+        ExpectNoError(session, "(define y (list 1 2 1 2)) (set-cdr! (cdr (cdr (cdr y))) y)");
+        ExpectEq(session, "x", "(1 2 . #<cycle>)");
+        ExpectEq(session, "(equal? x y)", "#t");
+        ExpectEq(session, "(equal? x (list 1 2 1 2))", "#f");
+        ExpectNoError(session, "(define c (list 1 2)) (set-car! c c)");
+        ExpectNoError(session, "(define d (list 1 2)) (set-car! d d)");
+        ExpectEq(session, "c", "(#<cycle> 2)");
+        ExpectEq(session, "(list c (cdr c) (cdr c))", "((#<cycle> 2) (2) (2))");
+        ExpectEq(session, "(equal? c d)", "#t");
+        ExpectEq(session, "(equal? (list c 1) (list d 2))", "#f");
+        ExpectEq(session, "(define long (wrap '() 100000)) (set-car! long x) (equal? long (wrap '() 100000))", "#f");
+    }
+
+    /* The evaluation server answers pipelined requests in their order */
+    {
+        LatencyHistogram latencies;
+        for (uint64_t ns = 1; ns <= 100000; ++ns) {
+            latencies.Record(ns);
+        }
+        auto p50 = latencies.Percentile(0.5), p99 = latencies.Percentile(0.99);
+        ExpectTrue(p50 > 47000 && p50 < 53000 && p99 > 93000 && p99 < 105000,
+                   "latency percentiles are close");
+
+        auto path = "/tmp/lisp-test-" + std::to_string(getpid()) + ".sock";
+        Limits limits;
+        limits.steps = 1000000;
+        EvalServer server(path, 2, Interpreter::Backend::VM, limits);
+        std::thread loop([&server] { server.Run(); });
+        {
+            EvalClient client(path);
+            ExpectTrue(client.Eval("(+ 1 2)").body == "3", "the server evaluates");
+            auto error = client.Eval("(car 1)");
+            ExpectTrue(error.kind == MessageKind::ERROR && error.body.find("ERROR") == 0,
+                       "the server sends errors back");
+            ExpectTrue(client.Eval("(define x 1) x").body == "1", "requests may define");
+            ExpectTrue(client.Eval("x").kind == MessageKind::ERROR, "requests do not share globals");
+
+            client.Send(MessageKind::EVAL, "(define (loop n) (if (= n 0) 'slow (loop (- n 1)))) (loop 100000)");
+            for (int i = 0; i < 500; ++i) {
+                client.Send(MessageKind::EVAL, "(* " + std::to_string(i) + " " + std::to_string(i) + ")");
+            }
+            client.Send(MessageKind::STATS, "");
+            bool ordered = client.Receive().body == "slow";
+            for (int i = 0; i < 500; ++i) {
+                ordered &= client.Receive().body == std::to_string(i * i);
+            }
+            ExpectTrue(ordered, "pipelined responses follow the requests");
+            auto stats = client.Receive();
+            ExpectTrue(stats.kind == MessageKind::VALUE && stats.body.find("requests 505\n") == 0,
+                       "stats come in order as well");
+
+            auto deep = client.Eval(std::string(50000, '(') + std::string(50000, ')'));
+            ExpectTrue(deep.kind == MessageKind::ERROR && deep.body.find("ERROR: Lists nested") == 0,
+                       "the server rejects code nested too deep");
+
+            /* More responses than the server buffers for a client not reading */
+            auto up = "(define (up n l) (if (= n 0) l (up (- n 1) (cons n l)))) (up 20000 '())";
+            for (int i = 0; i < 40; ++i) {
+                client.Send(MessageKind::EVAL, up);
+            }
+            auto first = client.Receive().body;
+            bool same = first.size() > 100000;
+            for (int i = 1; i < 40; ++i) {
+                same &= client.Receive().body == first;
+            }
+            ExpectTrue(same, "slow readers get every response");
+        }
+        EvalClient(path).Eval("(+ 1");
+        auto spin = EvalClient(path).Eval("(define (spin n) (spin (+ n 1))) (spin 0)");
+        ExpectTrue(spin.kind == MessageKind::ERROR && spin.body.find("ERROR: Budget exceeded") == 0,
+                   "the server stops runaway requests");
+        auto stats = server.Stats();
+        ExpectTrue(stats.requests == 548 && stats.errors == 5 && stats.budget_exceeded == 1 &&
+                           stats.connections == 3,
+                   "the server counts requests, errors and connections");
+        ExpectTrue(stats.p50_ns > 0 && stats.p50_ns <= stats.p99_ns, "the server measures latencies");
+        /* Only socket files nothing listens on are replaced */
+        auto binds = [](const std::string& path) {
+            try {
+                EvalServer other(path, 1);
+                return true;
+            } catch (const std::system_error&) {
+                return false;
+            }
+        };
+        ExpectTrue(!binds(path), "a socket in use is kept");
+        auto file = path + ".txt";
+        std::ofstream(file) << "data";
+        ExpectTrue(!binds(file) && std::ifstream(file).good(), "files other than sockets are kept");
+        unlink(file.c_str());
+        server.Stop();
+        loop.join();
+    }
+
+    /* Lists */
+    ExpectEq("'()", "()");
+    ExpectEq("'(1 2)", "(1 2)");
+    ExpectEq("'(1 2 . 3)", "(1 2 . 3)");
+    ExpectEq("'(1 . (2 . ()))", "(1 2)");
+    ExpectEq("(quote (1 (x #t) . y))", "(1 (x #t) . y)");
+    ExpectEq("''x", "(quote x)");
+    ExpectEq("(pair? '(1 . 2))", "#t");
+    ExpectEq("(pair? '())", "#f");
+    ExpectEq("(null? '())", "#t");
+    ExpectEq("(null? '(1 2))", "#f");
+    ExpectEq("(list? '())", "#t");
+    ExpectEq("(list? '(1 2))", "#t");
+    ExpectEq("(list? '(1 2 3 4 . 5))", "#f");
+    ExpectEq("(symbol? 'x)", "#t");
+    ExpectEq("(symbol? 1)", "#f");
+    ExpectEq("(cons 1 '(2))", "(1 2)");
+    ExpectEq("(car '(1 . 2))", "1");
+    ExpectEq("(cdr '(1 . 2))", "2");
+    ExpectEq("(list 1 (+ 1 1) 3)", "(1 2 3)");
+    ExpectEq("(list-ref '(1 2 3) 1)", "2");
+    ExpectEq("(list-tail '(1 2 3) 3)", "()");
+    ExpectEq("(equal? '(1 (2 3)) (list 1 (list 2 3)))", "#t");
+    ExpectEq("(eq? '(1) '(1))", "#f");
+
+    Interpreter quoted;
+    ExpectSyntaxError(quoted, "(1 . 2 3)");
+    ExpectSyntaxError(quoted, "(.)");
+    ExpectSyntaxError(quoted, "'(1 .)");
+    ExpectSyntaxError(quoted, "(. 2)");
+    ExpectSyntaxError(quoted, "'");
+    ExpectRuntimeError(quoted, "(list-ref '(1 2 3) 3)");
+    ExpectRuntimeError(quoted, "(list-tail '(1 2 3) 10)");
+    ExpectNoError(quoted, "(define x '(1 . 2))");
+    ExpectEq(quoted, "(set-car! x 5) (set-cdr! x '(6)) x", "(5 6)");
+    ExpectEq(quoted, "(set-cdr! (cdr x) x) (list? x)", "#f");
+
+    /* Variables */
+    Interpreter symbols_session;
+    ExpectNameError(symbols_session, "x");
+
+    ExpectNoError(symbols_session, "(define x (+ 1 2))");
+    ExpectEq(symbols_session, "x", "3");
+
+    ExpectNoError(symbols_session, "(define x (+ 2 2))");
+    ExpectEq(symbols_session, "x", "4");
+
+    ExpectSyntaxError(symbols_session, "(define)");
+    ExpectSyntaxError(symbols_session, "(define 1)");
+    ExpectSyntaxError(symbols_session, "(define x 1 2)");
+
+    ExpectNameError(symbols_session, "(set! y 2)");
+    ExpectNameError(symbols_session, "y");
+
+    ExpectNoError(symbols_session, "(set! x (+ 2 4))");
+    ExpectEq(symbols_session, "x", "6");
+
+    ExpectSyntaxError(symbols_session, "(set!)");
+    ExpectSyntaxError(symbols_session, "(set! 1)");
+    ExpectSyntaxError(symbols_session, "(set! x 1 2)");
+
+    ExpectNoError(symbols_session, "(and #f (set! x 2))");
+    ExpectNoError(symbols_session, "(or #t (set! x 2))");
+    ExpectEq(symbols_session, "x", "6");
+
+    ExpectSyntaxError(symbols_session, "((1)");
+    ExpectSyntaxError(symbols_session, "(1))");
+    ExpectSyntaxError(symbols_session, ")(1)");
+
+    /* Arity is checked for the whole source before anything runs */
+    ExpectEq(symbols_session, "(abs 1 2)\n  (+ 1 (if #t))",
+             "ERROR: abs expects 1 argument but got 2 at line 1, column 1\n"
+             "ERROR: if expects 2 to 3 arguments but got 1 at line 2, column 8\n");
+    ExpectSyntaxError(symbols_session, "(define unreached 1) (if #f (car) 2)");
+    ExpectNameError(symbols_session, "unreached");
+    ExpectSyntaxError(symbols_session, "(lambda (x x) x)");
+    ExpectSyntaxError(symbols_session, "(max)");
+
+    /* Code nests up to a limit, checked as it is read */
+    std::string nested;
+    for (int i = 0; i < 1000; ++i) {
+        nested += "(list ";
+    }
+    nested += "1" + std::string(1000, ')');
+    ExpectEq(nested, std::string(1000, '(') + "1" + std::string(1000, ')'));
+    ExpectSyntaxError(symbols_session, "(list " + nested + ")");
+    ExpectSyntaxError(symbols_session, std::string(1001, '\'') + "x");
+    ExpectEq(symbols_session, "(+ 1 1/0)", "ERROR: Division by zero in 1/0 at line 1, column 6\n");
+    ExpectEq(symbols_session, "'-7/00", "ERROR: Division by zero in -7/00 at line 1, column 2\n");
+    ExpectEq(symbols_session, "(car @x)", "ERROR: Unknown token @x at line 1, column 6\n");
+    ExpectEq(symbols_session, "'(1 #x)\n(abs)",
+             "ERROR: Unknown token #x at line 1, column 5\n"
+             "ERROR: abs expects 1 argument but got 0 at line 2, column 1\n");
+    ExpectEq(symbols_session, "'(abs 1 2)", "(abs 1 2)");
+
+    /* Number literals are as long as they can be converted quickly */
+    auto digits = "1" + std::string(9999, '0');
+    ExpectEq(symbols_session, "(- " + digits + " 1)", std::string(9999, '9'));
+    ExpectEq(symbols_session, "(+ 1 " + digits + "0)",
+             "ERROR: Token longer than 10000 characters at line 1, column 6\n");
+    ExpectSyntaxError(symbols_session, "1/" + std::string(200000, '7'));
+
 /*
     Test bool
 
@@ -238,149 +1180,6 @@ int main() {
     ExpectRuntimeError("(abs #t)");
     ExpectRuntimeError("(abs 1 2)");
 
-
-
-    Test lambdas
-
-    ExpectEq("((lambda (x) (+ 1 x)) 5)", "6");
-
-    ExpectNoError("(define test (lambda (x) (set! x (* x 2)) (+ 1 x)))");
-    ExpectEq("(test 20)", "41");
-
-    ExpectNoError("(define slow-add (lambda (x y) (if (= x 0) y (slow-add (- x 1) (+ y 1)))))");
-    ExpectEq("(slow-add 3 3)", "6");
-    ExpectEq("(slow-add 100 100)", "200");
-
-
-    ExpectNoError("(define x 1)");
-
-    ExpectNoError(R"(
-        (define range
-          (lambda (x)
-            (lambda ()
-              (set! x (+ x 1))
-              x)))
-                    )");
-
-    ExpectNoError("(define my-range (range 10))");
-    ExpectEq("(my-range)", "11");
-    ExpectEq("(my-range)", "12");
-    ExpectEq("(my-range)", "13");
-
-    ExpectEq("x", "1");
-
-    ExpectSyntaxError("(lambda)");
-    ExpectSyntaxError("(lambda x)");
-    ExpectSyntaxError("(lambda (x))");
-
-    ExpectNoError("(define (inc x) (+ x 1))");
-    ExpectEq("(inc -1)", "0");
-
-    ExpectNoError("(define (add x y) (+ x y 1))");
-    ExpectEq("(add -10 10)", "1");
-
-    ExpectNoError("(define (zero) 0)");
-    ExpectEq("(zero)", "0");
-
-
-    Test list
-
-    ExpectRuntimeError("()");
-    ExpectRuntimeError("(1)");
-    ExpectRuntimeError("(1 2 3)");
-
-    ExpectEq("'()", "()");
-    ExpectEq("'(1)", "(1)");
-    ExpectEq("'(1 2)", "(1 2)");
-
-    ExpectEq("'(1 . 2)", "(1 . 2)");
-    ExpectSyntaxError("(1 . 2 3)");
-
-    ExpectEq("'(1 2 . 3)", "(1 2 . 3)");
-    ExpectEq("'(1 2 . ())", "(1 2)");
-    ExpectEq("'(1 . (2 . ()))", "(1 2)");
-
-    ExpectSyntaxError("((1)");
-    ExpectSyntaxError("(1))");
-    ExpectSyntaxError(")(1)");
-
-    ExpectSyntaxError("(.)");
-    ExpectSyntaxError("(1 .)");
-    ExpectSyntaxError("(. 2)");
-
-    ExpectEq("(pair? '(1 . 2))", "#t");
-    ExpectEq("(pair? '(1 2))", "#t");
-    ExpectEq("(pair? '())", "#f");
-
-    ExpectEq("(null? '())", "#t");
-    ExpectEq("(null? '(1 2))", "#f");
-    ExpectEq("(null? '(1 . 2))", "#f");
-
-    ExpectEq("(list? '())", "#t");
-    ExpectEq("(list? '(1 2))", "#t");
-    ExpectEq("(list? '(1 . 2))", "#f");
-    ExpectEq("(list? '(1 2 3 4 . 5))", "#f");
-
-    ExpectEq("(cons 1 2)", "(1 . 2)");
-    ExpectEq("(car '(1 . 2))", "1");
-    ExpectEq("(cdr '(1 . 2))", "2");
-
-    ExpectNoError("(define x '(1 . 2))");
-
-    ExpectNoError("(set-car! x 5)");
-    ExpectEq("(car x)", "5");
-
-    ExpectNoError("(set-cdr! x 6)");
-    ExpectEq("(cdr x)", "6");
-
-    ExpectEq("(list)", "()");
-    ExpectEq("(list 1)", "(1)");
-    ExpectEq("(list 1 2 3)", "(1 2 3)");
-
-    ExpectEq("(list-ref '(1 2 3) 1)", "2");
-    ExpectEq("(list-tail '(1 2 3) 1)", "(2 3)");
-    ExpectEq("(list-tail '(1 2 3) 3)", "()");
-
-    ExpectRuntimeError("(list-ref '(1 2 3) 3)");
-    ExpectRuntimeError("(list-ref '(1 2 3) 10)");
-    ExpectRuntimeError("(list-tail '(1 2 3) 10)");
-
-
-
-    Test symbol
-
-
-    ExpectNameError("x");
-
-    ExpectEq("'x", "x");
-    ExpectEq("(quote x)", "x");
-
-    ExpectEq("(symbol? 'x)", "#t");
-    ExpectEq("(symbol? 1)", "#f");
-
-    ExpectNoError("(define x (+ 1 2))");
-    ExpectEq("x", "3");
-
-    ExpectNoError("(define x (+ 2 2))");
-    ExpectEq("x", "4");
-
-    ExpectSyntaxError("(define)");
-    ExpectSyntaxError("(define 1)");
-    ExpectSyntaxError("(define x 1 2)");
-
-    ExpectNameError("(set! x 2)");
-    ExpectNameError("x");
-
-    ExpectNoError("(define x 1)");
-    ExpectEq("x", "1");
-
-    ExpectNoError("(set! x (+ 2 4))");
-    ExpectEq("x", "6");
-
-    ExpectSyntaxError("(set!)");
-    ExpectSyntaxError("(set! 1)");
-    ExpectSyntaxError("(set! x 1 2)");
-
 */
     return 0;
 }
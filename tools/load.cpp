@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../src/server.h"
+
+/* lisp-load [socket] [--connections C] [--depth D] [--requests N] [--expr E]
+ *
+ * Keeps D requests in flight on each of C connections until N were
+ * answered, then prints the throughput, the latencies seen by the client
+ * and the counters of the server. */
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::vector<uint64_t> latencies;
+    size_t errors = 0;
+    /* Of the connection, if it broke */
+    std::string failure;
+};
+
+void Drive(const std::string& path, const std::string& expr, size_t requests, size_t depth,
+           Result* result) try {
+    EvalClient client(path);
+    std::deque<Clock::time_point> sent;
+    size_t received = 0;
+    while (received < requests) {
+        while (sent.size() < depth && received + sent.size() < requests) {
+            sent.push_back(Clock::now());
+            client.Send(MessageKind::EVAL, expr);
+        }
+
+        auto response = client.Receive();
+        result->latencies.push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent.front())
+                        .count());
+        result->errors += response.kind == MessageKind::ERROR;
+        sent.pop_front();
+        ++received;
+    }
+} catch (std::exception& error) {
+    result->failure = error.what();
+}
+
+int main(int argc, char** argv) {
+    std::string path = "/tmp/lisp.sock";
+    std::string expr = "(+ 1 2)";
+    size_t connections = 4;
+    size_t depth = 16;
+    size_t requests = 100000;
+    for (int i = 1; i < argc; ++i) {
+        auto option = argv[i];
+        if (option[0] != '-') {
+            path = option;
+        } else if (i + 1 >= argc) {
+            break;
+        } else if (!std::strcmp(option, "--connections")) {
+            connections = std::max<size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+        } else if (!std::strcmp(option, "--depth")) {
+            depth = std::max<size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+        } else if (!std::strcmp(option, "--requests")) {
+            requests = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(option, "--expr")) {
+            expr = argv[++i];
+        }
+    }
+
+    std::vector<Result> results(connections);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        auto share = requests * (i + 1) / connections - requests * i / connections;
+        threads.emplace_back(Drive, path, expr, share, depth, &results[i]);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<uint64_t> latencies;
+    size_t errors = 0;
+    for (auto& result : results) {
+        if (!result.failure.empty()) {
+            std::cerr << result.failure << std::endl;
+            return 1;
+        }
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double fraction) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        auto index = std::min(latencies.size() - 1, size_t(fraction * latencies.size()));
+        return latencies[index] / 1e3;
+    };
+
+    std::cout << latencies.size() << " requests in " << seconds << " s, "
+              << latencies.size() / seconds << " requests/s, " << errors << " errors"
+              << std::endl;
+    std::cout << "client p50 " << percentile(0.5) << " us, p99 " << percentile(0.99) << " us"
+              << std::endl;
+
+    try {
+        EvalClient client(path);
+        client.Send(MessageKind::STATS, "");
+        std::cout << "server:\n" << client.Receive().body;
+    } catch (std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
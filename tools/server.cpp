@@ -0,0 +1,60 @@
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "../src/server.h"
+
+/* lisp-server [socket] [--sessions N] [--backend vm|tree]
+ *             [--steps N] [--heap-bytes N] [--depth N]
+ *
+ * Serves until SIGINT or SIGTERM, then prints its counters. */
+
+EvalServer* server = nullptr;
+
+void HandleSignal(int) {
+    server->Stop();
+}
+
+int main(int argc, char** argv) {
+    std::string path = "/tmp/lisp.sock";
+    size_t sessions = 0;
+    auto backend = Interpreter::Backend::VM;
+    Limits limits;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--sessions") && i + 1 < argc) {
+            sessions = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--backend") && i + 1 < argc) {
+            backend = !std::strcmp(argv[++i], "tree") ? Interpreter::Backend::CLOSURE_TREE
+                                                     : Interpreter::Backend::VM;
+        } else if (!std::strcmp(argv[i], "--steps") && i + 1 < argc) {
+            limits.steps = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--heap-bytes") && i + 1 < argc) {
+            limits.heap_bytes = std::strtoul(argv[++i], nullptr, 10);
+        } else if (!std::strcmp(argv[i], "--depth") && i + 1 < argc) {
+            limits.depth = std::strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            std::cerr << "usage: lisp-server [socket] [--sessions N] [--backend vm|tree]"
+                         " [--steps N] [--heap-bytes N] [--depth N]"
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    try {
+        EvalServer instance(path, sessions, backend, limits);
+        server = &instance;
+        std::signal(SIGINT, HandleSignal);
+        std::signal(SIGTERM, HandleSignal);
+        std::cerr << "listening on " << path << " with " << instance.Sessions()
+                  << " sessions" << std::endl;
+
+        instance.Run();
+        std::cerr << instance.Stats().Format();
+    } catch (std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}